@@ -0,0 +1,81 @@
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+static size_t align_offset(Arena_Block * block)
+{
+	uintptr_t next = (uintptr_t) (block->data + block->used);
+	return block->used + (-next & (ARENA_ALIGN - 1));
+}
+
+void * arena_alloc(Arena * arena, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	Arena_Block * block = arena->blocks;
+	if (!block || align_offset(block) + size > block->size) {
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		// Room to align the first allocation
+		block = malloc(sizeof(Arena_Block) + block_size + ARENA_ALIGN);
+		block->next = arena->blocks;
+		block->used = 0;
+		block->size = block_size + ARENA_ALIGN;
+		arena->blocks = block;
+	}
+	size_t offset = align_offset(block);
+	void * ptr = block->data + offset;
+	block->used = offset + size;
+	arena->allocations++;
+	arena->bytes += size;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void arena_free(Arena * arena)
+{
+	Arena_Block * block = arena->blocks;
+	while (block) {
+		Arena_Block * next = block->next;
+		free(block);
+		block = next;
+	}
+	memset(arena, 0, sizeof(Arena));
+}
+
+void * arena_sb_copy(Arena * arena, void * buf, size_t item_size)
+{
+	if (!buf) return NULL;
+	int count = stb__sbn(buf);
+	// The header is two ints, which keeps the items 8-byte aligned
+	int * raw = arena_alloc(arena, 2 * sizeof(int) + count * item_size);
+	raw[0] = count;
+	raw[1] = count;
+	memcpy(raw + 2, buf, count * item_size);
+	sb_free(buf);
+	return raw + 2;
+}
+
+void arena_test()
+{
+	Arena arena = {0};
+	char * first = arena_alloc(&arena, 3);
+	char * second = arena_alloc(&arena, 1);
+	assert(((uintptr_t) first & (ARENA_ALIGN - 1)) == 0);
+	assert(((uintptr_t) second & (ARENA_ALIGN - 1)) == 0);
+	assert(first != second && first[0] == 0 && second[0] == 0);
+
+	// Larger than a block
+	char * big = arena_alloc(&arena, 3 * ARENA_BLOCK_SIZE);
+	big[3 * ARENA_BLOCK_SIZE - 1] = 1;
+
+	int * buf = NULL;
+	for (int i = 0; i < 100; i++) sb_push(buf, i);
+	arena_sb(&arena, buf);
+	assert(sb_count(buf) == 100 && buf[99] == 99);
+	int * empty = NULL;
+	arena_sb(&arena, empty);
+	assert(sb_count(empty) == 0);
+
+	assert(arena.allocations == 4);
+	arena_free(&arena);
+	assert(arena.blocks == NULL && arena.allocations == 0);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "common.h"
+
+/*
+ * Bump-pointer arena. Allocations are carved out of large blocks and
+ * are all released together by arena_free, so nothing allocated from
+ * an arena is freed individually.
+ */
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct Arena_Block {
+	struct Arena_Block * next;
+	size_t used;
+	size_t size;
+	char data[];
+} Arena_Block;
+
+typedef struct Arena {
+	Arena_Block * blocks;
+	size_t allocations; // Calls to arena_alloc since the last arena_free
+	size_t bytes;       // Bytes handed out by them
+} Arena;
+
+// Zeroed, and aligned for any type
+void * arena_alloc(Arena * arena, size_t size);
+void arena_free(Arena * arena);
+
+/* Moves a finished stretchy buffer into the arena and frees the
+ * original. The copy keeps the stretchy buffer header, so sb_count
+ * still works on it, but it must not be pushed to or sb_free'd.
+ */
+void * arena_sb_copy(Arena * arena, void * buf, size_t item_size);
+#define arena_sb(arena, a) ((a) = arena_sb_copy((arena), (a), sizeof(*(a))))
+
+void arena_test();
@@ -0,0 +1,181 @@
+#include "bench.h"
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "fold.h"
+#include "peephole.h"
+#include "profile.h"
+#include "vm.h"
+
+// Identifies the build in the results, as for the cache
+static const char * build_stamp = __DATE__ " " __TIME__;
+
+typedef struct Bench_Result {
+	char name[64];
+	size_t lines;
+	size_t bytes;
+	u64 lex_ns;
+	u64 parse_ns;
+	u64 prepare_ns;
+	u64 compile_ns;
+	u64 execute_ns;
+	u64 instructions;
+	s64 result;
+} Bench_Result;
+
+static void bench_source(Bench_Result * r, const char * source)
+{
+	r->bytes = strlen(source);
+	r->lines = 0;
+	for (const char * c = source; *c; c++) {
+		if (*c == '\n') r->lines++;
+	}
+
+	// Stages as prepare and compile_source run them, timed one by one
+	Compiler compiler;
+	u64 start = time_ns();
+	compiler_init(&compiler, source); // Lexes everything up front
+	r->lex_ns = time_ns() - start;
+
+	start = time_ns();
+	Function ** functions = NULL;
+	while (tokens_left(&compiler.parser)) {
+		sb_push(functions, parse_function(&compiler.parser));
+	}
+	r->parse_ns = time_ns() - start;
+
+	start = time_ns();
+	compiler.function_map = make_map(512);
+	for (int i = 0; i < sb_count(functions); i++) {
+		prepare_function(&compiler, functions[i]);
+		map_insert(compiler.function_map, (u64) functions[i]->name, (u64) functions[i]);
+	}
+	r->prepare_ns = time_ns() - start;
+	sb_free(functions);
+
+	VM _vm;
+	VM * vm = &_vm;
+	vm_init(vm);
+	start = time_ns();
+	fold(&compiler);
+	compile(&compiler, vm);
+	peephole(vm);
+	finish_compilation(&compiler);
+	r->compile_ns = time_ns() - start;
+
+	u64 entry = vm->ip;
+	start = time_ns();
+	vm_run(vm);
+	r->execute_ns = time_ns() - start;
+	r->result = vm->op_stack[vm->op_sp - 1];
+
+	vm->ip = entry;
+	vm->op_sp = 0;
+	vm->call_sp = 0;
+	Profile profile;
+	profile_init(&profile, vm);
+	vm_run_profiled(vm, &profile);
+	r->instructions = 0;
+	for (u64 ip = 0; ip < profile.inst_count; ip++) {
+		r->instructions += profile.counts[ip];
+	}
+	if (vm->op_stack[vm->op_sp - 1] != r->result) {
+		internal_error("Benchmark %s gave different results on two runs", r->name);
+	}
+	profile_free(&profile);
+
+	vm_free(vm);
+	compiler_free(&compiler);
+}
+
+// Chains of small functions, each calling the one before, so the
+// program runs briefly however large it is
+static char * make_synthetic_source(size_t lines)
+{
+	char * source = NULL;
+	char text[512];
+	int count = 0;
+	for (size_t line = 0; line < lines; line += 6, count++) {
+		int len = sprintf(text,
+			"func f%d(n) {\n"
+			"\tlet s;\n"
+			"\tset s = (n * %d) %% 1000;\n"
+			"\tif n > 0 { set s = s + f%d(n - 1); }\n"
+			"\treturn s;\n"
+			"}\n",
+			count, count % 97 + 1, count ? count - 1 : 0);
+		memcpy(sb_add(source, len), text, len);
+	}
+	int len = sprintf(text, "func main() { return f%d(50); }\n", count - 1);
+	memcpy(sb_add(source, len + 1), text, len + 1);
+	return source;
+}
+
+static double ms(u64 ns)
+{
+	return ns / 1e6;
+}
+
+static double per_second(u64 count, u64 ns)
+{
+	return ns ? count / (ns / 1e9) : 0.0;
+}
+
+static void print_json_result(Bench_Result * r, bool last)
+{
+	printf("    {\"name\": \"");
+	for (const char * c = r->name; *c; c++) {
+		if (*c == '"' || *c == '\\') putchar('\\');
+		putchar(*c);
+	}
+	printf("\", \"lines\": %zu, \"bytes\": %zu, ", r->lines, r->bytes);
+	printf("\"lex_ms\": %.3f, \"parse_ms\": %.3f, \"prepare_ms\": %.3f, ",
+		ms(r->lex_ns), ms(r->parse_ns), ms(r->prepare_ns));
+	printf("\"compile_ms\": %.3f, \"execute_ms\": %.3f, ",
+		ms(r->compile_ns), ms(r->execute_ns));
+	printf("\"instructions\": %lu, \"instructions_per_second\": %.0f, \"result\": %ld}%s\n",
+		r->instructions, per_second(r->instructions, r->execute_ns), r->result,
+		last ? "" : ",");
+}
+
+int bench_pipeline(int count, char ** paths)
+{
+	Bench_Result * results = calloc(count + 1, sizeof(Bench_Result));
+	for (int i = 0; i < count; i++) {
+		Loaded_File file;
+		if (!load_file(paths[i], &file)) {
+			fprintf(stderr, "Couldn't read %s\n", paths[i]);
+			return 1;
+		}
+		// Named after the file, without directories or extension
+		const char * name = strrchr(paths[i], '/');
+		name = name ? name + 1 : paths[i];
+		snprintf(results[i].name, sizeof(results[i].name), "%.*s",
+			(int) strcspn(name, "."), name);
+		bench_source(&results[i], file.str);
+		free_loaded_file(&file);
+	}
+	char * synthetic = make_synthetic_source(BENCH_SYNTHETIC_LINES);
+	strcpy(results[count].name, "synthetic");
+	bench_source(&results[count], synthetic);
+	sb_free(synthetic);
+
+	fprintf(stderr, "%-12s %9s %9s %9s %10s %10s %10s %10s\n", "benchmark", "lines",
+		"lex ms", "parse ms", "prepare ms", "compile ms", "execute ms", "Minst/s");
+	for (int i = 0; i <= count; i++) {
+		Bench_Result * r = &results[i];
+		fprintf(stderr, "%-12s %9zu %9.1f %9.1f %10.1f %10.1f %10.1f %10.1f\n",
+			r->name, r->lines, ms(r->lex_ns), ms(r->parse_ns), ms(r->prepare_ns),
+			ms(r->compile_ns), ms(r->execute_ns),
+			per_second(r->instructions, r->execute_ns) / 1e6);
+	}
+
+	printf("{\n  \"build\": \"%s\",\n  \"bytecode_version\": %d,\n  \"benchmarks\": [\n",
+		build_stamp, BYTECODE_VERSION);
+	for (int i = 0; i <= count; i++) {
+		print_json_result(&results[i], i == count);
+	}
+	printf("  ]\n}\n");
+	free(results);
+	return 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "common.h"
+
+/*
+ * Pipeline benchmarks
+ *
+ * Each program is run through every stage in turn, timing lexing,
+ * parsing, preparation, compilation (with folding and the peephole
+ * pass) and execution separately. A second, profiled run counts the
+ * instructions executed, for instructions retired per second.
+ *
+ * Programs report through main's return value rather than printing,
+ * so the JSON on stdout stays clean. A table goes to stderr.
+ */
+
+// Lines in the generated program benchmarked after the files
+#define BENCH_SYNTHETIC_LINES 1000000
+
+// Benchmarks the programs at paths, then the generated one. Returns
+// the process exit code.
+int bench_pipeline(int count, char ** paths);
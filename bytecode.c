@@ -0,0 +1,514 @@
+#include "bytecode.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "error.h"
+#include "fold.h"
+#include "peephole.h"
+
+bool bytecode_try_write(VM * vm, const char * path, const Bytecode_Source * source)
+{
+	for (int i = 0; i < sb_count(vm->insts); i++) {
+		if (vm->insts[i].type == INST_SYMBOL)
+			internal_error("Writing bytecode before symbols were stripped");
+	}
+
+	Bytecode_Function * functions = NULL;
+	char * strings = NULL;
+	for (int i = 0; i < sb_count(vm->symbols); i++) {
+		Bytecode_Function func = {vm->symbols[i].ip, sb_count(strings)};
+		sb_push(functions, func);
+		const char * name = vm->symbols[i].name;
+		for (size_t j = 0; j <= strlen(name); j++) {
+			sb_push(strings, name[j]);
+		}
+	}
+
+	Bytecode_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+	header.version         = BYTECODE_VERSION;
+	header.inst_size       = sizeof(Inst);
+	header.inst_type_count = INST_COUNT;
+	header.entry           = vm->ip;
+	header.inst_offset     = sizeof(header);
+	header.inst_count      = sb_count(vm->insts);
+	header.function_offset = header.inst_offset + header.inst_count * sizeof(Inst);
+	header.function_count  = sb_count(functions);
+	header.string_offset   = header.function_offset +
+		header.function_count * sizeof(Bytecode_Function);
+	header.string_size     = sb_count(strings);
+	if (source) {
+		header.source_size = source->size;
+		header.source_hash = source->hash;
+	}
+	header.inst_sb_capacity = header.inst_count;
+	header.inst_sb_count    = header.inst_count;
+
+	bool ok = false;
+	FILE * file = fopen(path, "wb");
+	if (file) {
+		ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+			fwrite(vm->insts, sizeof(Inst), header.inst_count, file) == header.inst_count &&
+			fwrite(functions, sizeof(Bytecode_Function), header.function_count, file) ==
+				header.function_count &&
+			fwrite(strings, 1, header.string_size, file) == header.string_size;
+		ok = fclose(file) == 0 && ok;
+	}
+
+	sb_free(functions);
+	sb_free(strings);
+	return ok;
+}
+
+void bytecode_write(VM * vm, const char * path)
+{
+	if (!bytecode_try_write(vm, path, NULL)) fatal("Couldn't write %s", path);
+}
+
+// Whether count items of item_size bytes, starting at offset, end
+// within size bytes. Written so that no step can overflow.
+static bool fits(u64 offset, u64 count, u64 item_size, u64 size)
+{
+	return offset <= size && count <= (size - offset) / item_size;
+}
+
+/* Loaded programs are checked before they run, since a file, or a
+ * cache entry, can hold anything and the VM trusts its instructions
+ * as far as it trusts the compiler.
+ *
+ * The function table splits the instructions into functions, each
+ * starting with its ENTER, and the entry code follows the last one.
+ * Jumps stay inside their function, and no function runs off its
+ * end. Calls go to the start of a function and pass as many
+ * arguments as its RETs drop. Locals name a slot of the frame, never
+ * the saved fp or the return ip. The op stack never drops below
+ * where the function found it, has the same depth wherever two paths
+ * meet, and holds just the result at a RET. Instructions the compiler
+ * never emits are refused.
+ */
+
+typedef struct Verify_Function {
+	u64 start;
+	u64 end;
+	bool frame;    // False for the entry code
+	s64 locals;
+	s64 arg_count; // -1 until a call or a return pins it
+} Verify_Function;
+
+static bool local_in_frame(Verify_Function * func, s64 local)
+{
+	if (local >= 0) return local < func->locals;
+	return local < -2 && local >= -(func->arg_count + 2);
+}
+
+static bool pin_arg_count(Verify_Function * func, s64 arg_count)
+{
+	if (arg_count < 0 || arg_count > UINT32_MAX) return false;
+	if (func->arg_count == -1) func->arg_count = arg_count;
+	return func->arg_count == arg_count;
+}
+
+// The function starting at ip, if any
+static Verify_Function * function_at(Verify_Function * funcs, int count, u64 ip)
+{
+	int lo = 0;
+	int hi = count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (funcs[mid].start < ip) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < count && funcs[lo].start == ip ? &funcs[lo] : NULL;
+}
+
+// The operand form of a binary or compare-and-branch instruction, or
+// -1 for anything else
+static int binary_form(Inst_Type type)
+{
+	switch (type) {
+	#define BINARY_FORM_CASES(name, op) \
+	case INST_##name:                   \
+	case INST_##name##_I:               \
+	case INST_##name##_LI:              \
+	case INST_##name##_LL:              \
+		return type - INST_##name;
+	BINARY_INSTS(BINARY_FORM_CASES)
+	#undef BINARY_FORM_CASES
+	#define COMPARE_JUMP_FORM_CASES(name, op) \
+	case INST_JZ_##name:                      \
+	case INST_JZ_##name##_I:                  \
+	case INST_JZ_##name##_LI:                 \
+	case INST_JZ_##name##_LL:                 \
+		return type - INST_JZ_##name;
+	COMPARE_INSTS(COMPARE_JUMP_FORM_CASES)
+	#undef COMPARE_JUMP_FORM_CASES
+	default:
+		return -1;
+	}
+}
+
+// Points locals at the frame slots inst names, and returns how many
+static int inst_locals(Inst * inst, s64 * locals[2])
+{
+	switch (inst->type) {
+	case INST_LOADL:
+	case INST_STOREL:
+		locals[0] = &inst->arg0.local;
+		return 1;
+	default:
+		break;
+	}
+	int form = binary_form(inst->type);
+	if (form == BINARY_FORM_LI) {
+		locals[0] = &inst->arg0.local;
+		return 1;
+	}
+	if (form == BINARY_FORM_LL) {
+		locals[0] = &inst->arg0.local;
+		locals[1] = &inst->arg1.local;
+		return 2;
+	}
+	return 0;
+}
+
+static bool verify_function(Inst * insts, Verify_Function * func,
+	Verify_Function * funcs, int count, s64 * depths, u64 * work)
+{
+	int pending = 0;
+	depths[func->start] = 0;
+	work[pending++] = func->start;
+	while (pending > 0) {
+		u64 ip = work[--pending];
+		Inst * inst = &insts[ip];
+		s64 depth = depths[ip];
+		s64 pops = 0;
+		s64 pushes = 0;
+		bool falls = true;
+		u64 * target = inst_jump_target(inst);
+
+		int form = binary_form(inst->type);
+		if (form != -1) {
+			// Stack forms take two values, _I forms one
+			pops = form == BINARY_FORM_STACK ? 2 : form == BINARY_FORM_I ? 1 : 0;
+			pushes = target ? 0 : 1;
+		} else switch (inst->type) {
+		case INST_NOP:
+		case INST_JMP:
+			break;
+		case INST_HALT:
+			falls = false;
+			break;
+		case INST_NEG:
+		case INST_LNEG:
+		case INST_PRINT:
+			pops = pushes = 1;
+			break;
+		case INST_PUSHO:
+		case INST_LOADL:
+			pushes = 1;
+			break;
+		case INST_POPO:
+		case INST_STOREL:
+		case INST_JZ:
+		case INST_JNZ:
+			pops = 1;
+			break;
+		case INST_ENTER:
+			if (ip != func->start) return false;
+			break;
+		case INST_CALL: {
+			Verify_Function * callee = function_at(funcs, count, inst->arg0.jmp_ip);
+			if (!callee || !callee->frame || inst->arg1.literal != callee->arg_count) return false;
+			pops = callee->arg_count;
+			pushes = 1;
+			target = NULL; // Comes back to the next instruction
+		} break;
+		case INST_RET:
+			if (!func->frame || inst->arg0.literal != func->arg_count || depth != 1) return false;
+			falls = false;
+			break;
+		default:
+			return false;
+		}
+		if (inst->type == INST_JMP) falls = false;
+
+		s64 * locals[2];
+		int local_count = inst_locals(inst, locals);
+		for (int i = 0; i < local_count; i++) {
+			if (!local_in_frame(func, *locals[i])) return false;
+		}
+		if (depth < pops) return false;
+		depth += pushes - pops;
+
+		u64 next[2];
+		int next_count = 0;
+		if (falls) next[next_count++] = ip + 1;
+		if (target) next[next_count++] = *target;
+		for (int i = 0; i < next_count; i++) {
+			if (next[i] < func->start || next[i] >= func->end) return false;
+			if (depths[next[i]] == -1) {
+				depths[next[i]] = depth;
+				work[pending++] = next[i];
+			} else if (depths[next[i]] != depth) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool verify_program(Inst * insts, u64 inst_count,
+	Bytecode_Function * functions, u64 function_count, u64 entry)
+{
+	// Functions are written in instruction order, from the start, with
+	// the entry code after them
+	int count = function_count + 1;
+	Verify_Function * funcs = malloc(count * sizeof(Verify_Function));
+	for (int i = 0; i < count; i++) {
+		Verify_Function * func = &funcs[i];
+		bool last = i == count - 1;
+		func->start     = last ? entry : functions[i].ip;
+		func->end       = last ? inst_count : i + 1 < count - 1 ? functions[i + 1].ip : entry;
+		func->frame     = !last;
+		func->locals    = func->frame ? insts[func->start].arg0.literal : 0;
+		func->arg_count = func->frame ? -1 : 0;
+	}
+	bool ok = funcs[0].start == 0;
+	for (int i = 0; ok && i < count; i++) {
+		Verify_Function * func = &funcs[i];
+		ok = func->start < func->end;
+		if (ok && func->frame) {
+			ok = insts[func->start].type == INST_ENTER &&
+				func->locals >= 0 && func->locals <= UINT32_MAX;
+		}
+	}
+
+	// Every RET in a function and every CALL to it agree on its
+	// argument count. A function that's neither called nor returned
+	// from never runs, so it gets as many as its locals reach down to.
+	for (int i = 0; ok && i < count; i++) {
+		for (u64 ip = funcs[i].start; ok && ip < funcs[i].end; ip++) {
+			if (insts[ip].type == INST_RET) {
+				ok = funcs[i].frame && pin_arg_count(&funcs[i], insts[ip].arg0.literal);
+			} else if (insts[ip].type == INST_CALL) {
+				Verify_Function * callee = function_at(funcs, count, insts[ip].arg0.jmp_ip);
+				ok = callee && callee->frame && pin_arg_count(callee, insts[ip].arg1.literal);
+			}
+		}
+	}
+	for (int i = 0; ok && i < count; i++) {
+		if (funcs[i].arg_count != -1) continue;
+		s64 deepest = -2;
+		for (u64 ip = funcs[i].start; ip < funcs[i].end; ip++) {
+			s64 * locals[2];
+			int local_count = inst_locals(&insts[ip], locals);
+			for (int j = 0; j < local_count; j++) {
+				if (*locals[j] < deepest) deepest = *locals[j];
+			}
+		}
+		ok = deepest >= -((s64) UINT32_MAX + 2) && pin_arg_count(&funcs[i], -deepest - 2);
+	}
+
+	s64 * depths = malloc(inst_count * sizeof(s64));
+	u64 * work = malloc(inst_count * sizeof(u64));
+	for (u64 i = 0; i < inst_count; i++) depths[i] = -1;
+	for (int i = 0; ok && i < count; i++) {
+		ok = verify_function(insts, &funcs[i], funcs, count, depths, work);
+	}
+	free(depths);
+	free(work);
+	free(funcs);
+	return ok;
+}
+
+bool bytecode_load(VM * vm, const char * path)
+{
+	return bytecode_load_source(vm, path, NULL);
+}
+
+bool bytecode_load_source(VM * vm, const char * path, const Bytecode_Source * source)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(Bytecode_Header)) {
+		close(fd);
+		return false;
+	}
+	Bytecode_Header header;
+	if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+		memcmp(header.magic, BYTECODE_MAGIC, sizeof(header.magic)) != 0) {
+		close(fd);
+		return false;
+	}
+	if (source && (header.source_size != source->size || header.source_hash != source->hash)) {
+		close(fd);
+		return false;
+	}
+
+	if (header.version != BYTECODE_VERSION)
+		fatal("%s is bytecode version %u, expected %u", path,
+			header.version, BYTECODE_VERSION);
+	if (header.inst_size != sizeof(Inst) || header.inst_type_count != INST_COUNT)
+		fatal("%s was compiled for a different instruction set", path);
+	u64 size = st.st_size;
+	if (header.inst_offset != sizeof(header) ||
+		header.inst_sb_count < 0 || (u64) header.inst_sb_count != header.inst_count ||
+		!fits(header.inst_offset, header.inst_count, sizeof(Inst), size) ||
+		header.function_offset % sizeof(u64) != 0 ||
+		!fits(header.function_offset, header.function_count, sizeof(Bytecode_Function), size) ||
+		!fits(header.string_offset, header.string_size, 1, size) ||
+		header.entry >= header.inst_count)
+		fatal("%s is truncated or corrupt", path);
+
+	char * image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) fatal("Couldn't map %s", path);
+
+	Inst * insts = (Inst*) (image + header.inst_offset);
+	for (u64 i = 0; i < header.inst_count; i++) {
+		u64 * target = inst_jump_target(&insts[i]);
+		if (insts[i].type >= INST_COUNT || (target && *target >= header.inst_count))
+			fatal("%s is truncated or corrupt", path);
+	}
+	Bytecode_Function * functions = (Bytecode_Function*) (image + header.function_offset);
+	const char * strings = image + header.string_offset;
+	if (header.string_size > 0 && strings[header.string_size - 1] != '\0')
+		fatal("%s is truncated or corrupt", path);
+	for (u64 i = 0; i < header.function_count; i++) {
+		if (functions[i].ip >= header.inst_count || functions[i].name >= header.string_size)
+			fatal("%s is truncated or corrupt", path);
+		Symbol symbol = {functions[i].ip, strings + functions[i].name};
+		sb_push(vm->symbols, symbol);
+	}
+	if (!verify_program(insts, header.inst_count, functions, header.function_count, header.entry))
+		fatal("%s is truncated or corrupt", path);
+
+	vm->insts      = insts;
+	vm->ip         = header.entry;
+	vm->image      = image;
+	vm->image_size = st.st_size;
+	return true;
+}
+
+static void assert_refused(const char * path)
+{
+	VM _vm;
+	VM * vm = &_vm;
+	vm_init(vm);
+	Error_Trap trap;
+	if (setjmp(trap.jump) == 0) {
+		error_trap_set(&trap);
+		bytecode_load(vm, path);
+		assert(!"Loaded a corrupt bytecode file");
+	}
+	assert(strstr(trap.message, "truncated or corrupt"));
+	vm_free(vm);
+}
+
+void bytecode_test()
+{
+	const char * source =
+		"func fib(n) { if n < 2 { return n; } return fib(n - 1) + fib(n - 2); }\n"
+		"func main() { let x; set x = 10; return fib(x) * 2; }";
+	char path[] = "/tmp/slc-test-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	for (int optimize = 0; optimize <= 1; optimize++) {
+		Compiler compiler;
+		compiler_init(&compiler, source);
+		prepare(&compiler);
+		if (optimize) fold(&compiler);
+		VM _vm;
+		VM * vm = &_vm;
+		vm_init(vm);
+		compile(&compiler, vm);
+		if (optimize) peephole(vm);
+		else strip_symbols(vm);
+		finish_compilation(&compiler);
+		int count = sb_count(vm->insts);
+		bytecode_write(vm, path);
+		compiler_free(&compiler);
+		vm_free(vm);
+
+		vm_init(vm);
+		assert(bytecode_load(vm, path));
+		assert(sb_count(vm->symbols) == 2);
+		assert(sb_count(vm->insts) == count);
+		vm_run(vm);
+		assert(vm->op_stack[vm->op_sp - 1] == 110);
+		vm_free(vm);
+	}
+
+	// Headers and function tables that point outside the file, even
+	// by overflowing, are refused before anything is read through them
+	Bytecode_Header header;
+	fd = open(path, O_RDWR);
+	assert(fd >= 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header));
+	Bytecode_Function func;
+	assert(pread(fd, &func, sizeof(func), header.function_offset) == sizeof(func));
+	Bytecode_Header bad_headers[4] = {header, header, header, header};
+	bad_headers[0].function_count = (u64) 1 << 60;
+	bad_headers[1].function_offset = ~(u64) 0 - 7;
+	bad_headers[2].string_size = ~(u64) 0;
+	bad_headers[3].inst_count = bad_headers[3].inst_sb_count = bad_headers[3].inst_sb_capacity = 1 << 30;
+	for (int i = 0; i < 4; i++) {
+		assert(pwrite(fd, &bad_headers[i], sizeof(header), 0) == sizeof(header));
+		assert_refused(path);
+	}
+	assert(pwrite(fd, &header, sizeof(header), 0) == sizeof(header));
+	Bytecode_Function bad_func = {header.inst_count, func.name};
+	assert(pwrite(fd, &bad_func, sizeof(func), header.function_offset) == sizeof(func));
+	assert_refused(path);
+	assert(pwrite(fd, &func, sizeof(func), header.function_offset) == sizeof(func));
+
+	// So are locals outside their frame, and calls passing the wrong
+	// number of arguments
+	Inst * insts = malloc(header.inst_count * sizeof(Inst));
+	size_t inst_bytes = header.inst_count * sizeof(Inst);
+	assert(pread(fd, insts, inst_bytes, header.inst_offset) == (ssize_t) inst_bytes);
+	int patched = 0;
+	for (u64 i = 0; i < header.inst_count; i++) {
+		Inst inst = insts[i];
+		s64 * locals[2];
+		off_t at = header.inst_offset + i * sizeof(Inst);
+		if (inst_locals(&insts[i], locals) > 0) {
+			s64 bad_locals[] = {1000, -1, -2, -1000};
+			for (int j = 0; j < 4; j++) {
+				*locals[0] = bad_locals[j];
+				assert(pwrite(fd, &insts[i], sizeof(Inst), at) == sizeof(Inst));
+				assert_refused(path);
+			}
+			patched++;
+		} else if (inst.type == INST_CALL) {
+			insts[i].arg1.literal++;
+			assert(pwrite(fd, &insts[i], sizeof(Inst), at) == sizeof(Inst));
+			assert_refused(path);
+			patched++;
+		} else {
+			continue;
+		}
+		insts[i] = inst;
+		assert(pwrite(fd, &inst, sizeof(Inst), at) == sizeof(Inst));
+	}
+	assert(patched > 0);
+	free(insts);
+	close(fd);
+
+	VM _vm;
+	VM * vm = &_vm;
+	vm_init(vm);
+	assert(bytecode_load(vm, path));
+	vm_run(vm);
+	assert(vm->op_stack[vm->op_sp - 1] == 110);
+	vm_free(vm);
+
+	unlink(path);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Compiled program files
+ *
+ * A bytecode file is a header followed by the instruction stream, the
+ * function table and the string data holding function names, all in
+ * native byte order. Instructions are stored exactly as they sit in
+ * vm->insts, so loading maps the file and points vm->insts straight
+ * at it. Nothing is copied, and processes running the same file share
+ * its pages. The header ends in the same two ints a stretchy buffer
+ * keeps in front of its items, so sb_count works on the mapped
+ * instructions.
+ *
+ * Literals live in the instructions that use them, so there's no
+ * separate constant pool. INST_SYMBOL markers are moved into the
+ * function table before writing, which leaves the instruction stream
+ * free of pointers.
+ */
+
+#define BYTECODE_MAGIC   "SLC"
+#define BYTECODE_VERSION 4
+
+typedef struct Bytecode_Header {
+	char magic[4];
+	u32 version;
+	// Files from a build with a different instruction set are refused
+	u32 inst_size;
+	u32 inst_type_count;
+
+	u64 entry;
+	u64 inst_offset;
+	u64 inst_count;
+	u64 function_offset;
+	u64 function_count;
+	u64 string_offset;
+	u64 string_size;
+	// The source a cache entry was compiled from, all 0 for other files
+	u64 source_size;
+	u64 source_hash;
+
+	// Immediately precedes the instructions. See stretchy_buffer.h.
+	int inst_sb_capacity;
+	int inst_sb_count;
+} Bytecode_Header;
+
+typedef struct Bytecode_Function {
+	u64 ip;
+	u64 name; // Offset into the string data
+} Bytecode_Function;
+
+// Identifies the source a program was compiled from
+typedef struct Bytecode_Source {
+	u64 size;
+	u64 hash;
+} Bytecode_Source;
+
+void bytecode_write(VM * vm, const char * path);
+// Like bytecode_write, but returns false instead of failing. source,
+// if given, is recorded for bytecode_load_source to check.
+bool bytecode_try_write(VM * vm, const char * path, const Bytecode_Source * source);
+// Returns false if path isn't a bytecode file, so the caller can
+// treat it as source instead
+bool bytecode_load(VM * vm, const char * path);
+// Like bytecode_load, but also returns false unless the file was
+// written with source
+bool bytecode_load_source(VM * vm, const char * path, const Bytecode_Source * source);
+void bytecode_test();
@@ -0,0 +1,249 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "fold.h"
+#include "peephole.h"
+
+// The Makefile hashes every source file, header and the Makefile
+// itself into SLC_BUILD_ID, so any change to the compiler changes it.
+// Builds without one get no cache, as nothing would tell their
+// entries apart.
+#ifdef SLC_BUILD_ID
+static const char * compiler_stamp = SLC_BUILD_ID;
+#else
+static const char * compiler_stamp = NULL;
+#endif
+
+static u64 fnv1a(u64 hash, const char * data, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (u8) data[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// A second hash of the source, unrelated to the one naming the entry,
+// kept inside it so a collision in the name can't pass for a hit
+static Bytecode_Source source_key(const char * source)
+{
+	size_t len = strlen(source);
+	u64 hash = len * 0x9e3779b97f4a7c15ull;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (u8) source[i]) * 0xff51afd7ed558ccdull;
+		hash ^= hash >> 32;
+	}
+	return (Bytecode_Source) {len, hash};
+}
+
+// mkdir -p
+static bool make_dirs(char * path)
+{
+	for (char * slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+		*slash = '/';
+		if (!ok) return false;
+	}
+	return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static char * cache_dir()
+{
+	const char * env;
+	char * dir;
+	if ((env = getenv("SLC_CACHE_DIR")) && *env) {
+		dir = strdup(env);
+	} else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+		dir = malloc(strlen(env) + sizeof("/simple-lang"));
+		sprintf(dir, "%s/simple-lang", env);
+	} else if ((env = getenv("HOME")) && *env) {
+		dir = malloc(strlen(env) + sizeof("/.cache/simple-lang"));
+		sprintf(dir, "%s/.cache/simple-lang", env);
+	} else {
+		return NULL;
+	}
+	if (!make_dirs(dir)) {
+		free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+char * cache_entry_path(const char * source, int opt_level)
+{
+	if (!compiler_stamp) return NULL;
+	char * dir = cache_dir();
+	if (!dir) return NULL;
+
+	char version[64];
+	sprintf(version, "%d %zu %d %d", BYTECODE_VERSION, sizeof(Inst), INST_COUNT, opt_level);
+	u64 hash = 0xcbf29ce484222325ull;
+	hash = fnv1a(hash, compiler_stamp, strlen(compiler_stamp) + 1);
+	hash = fnv1a(hash, version, strlen(version) + 1);
+	hash = fnv1a(hash, source, strlen(source));
+
+	char * path = malloc(strlen(dir) + 32);
+	sprintf(path, "%s/%016lx.slc", dir, hash);
+	free(dir);
+	return path;
+}
+
+bool cache_load(VM * vm, const char * path, const char * source)
+{
+	Bytecode_Source key = source_key(source);
+	return bytecode_load_source(vm, path, &key);
+}
+
+void cache_store(VM * vm, const char * path, const char * source)
+{
+	// A temporary name of its own, even against other threads storing
+	// the same entry
+	char * temp = malloc(strlen(path) + sizeof(".XXXXXX"));
+	sprintf(temp, "%s.XXXXXX", path);
+	int fd = mkstemp(temp);
+	if (fd < 0) {
+		free(temp);
+		return;
+	}
+	fchmod(fd, 0644);
+	close(fd);
+	Bytecode_Source key = source_key(source);
+	if (!bytecode_try_write(vm, temp, &key) || rename(temp, path) != 0) {
+		unlink(temp);
+	}
+	free(temp);
+}
+
+// Point the cache at a fresh directory for the duration of a test
+static char * use_temp_cache_dir(char ** saved)
+{
+	const char * old = getenv("SLC_CACHE_DIR");
+	*saved = old ? strdup(old) : NULL;
+	char * dir = strdup("/tmp/slc-cache-XXXXXX");
+	assert(mkdtemp(dir));
+	setenv("SLC_CACHE_DIR", dir, 1);
+	return dir;
+}
+
+static void restore_cache_dir(char * dir, char * saved)
+{
+	rmdir(dir);
+	free(dir);
+	if (saved) setenv("SLC_CACHE_DIR", saved, 1);
+	else unsetenv("SLC_CACHE_DIR");
+	free(saved);
+}
+
+// Symbol names belong to compiler, so the caller frees it once the
+// program is stored
+static void compile_program(Compiler * compiler, VM * vm, const char * source, int opt_level)
+{
+	compiler_init(compiler, source);
+	prepare(compiler);
+	if (opt_level >= 1) fold(compiler);
+	compile(compiler, vm);
+	if (opt_level >= 1) peephole(vm);
+	else strip_symbols(vm);
+	finish_compilation(compiler);
+}
+
+void cache_test()
+{
+	char * saved;
+	char * dir = use_temp_cache_dir(&saved);
+
+	const char * source = "func main() { let a; set a = 6; return a * 7; }";
+	char * path = cache_entry_path(source, 1);
+	char * again = cache_entry_path(source, 1);
+	char * other_level = cache_entry_path(source, 0);
+	char * other_source = cache_entry_path("func main() { return 0; }", 1);
+	assert(strcmp(path, again) == 0);
+	assert(strcmp(path, other_level) != 0);
+	assert(strcmp(path, other_source) != 0);
+
+	VM _vm;
+	VM * vm = &_vm;
+	vm_init(vm);
+	assert(!cache_load(vm, path, source));
+	Compiler compiler;
+	compile_program(&compiler, vm, source, 1);
+	cache_store(vm, path, source);
+	compiler_free(&compiler);
+	vm_free(vm);
+
+	vm_init(vm);
+	assert(cache_load(vm, path, source));
+	vm_run(vm);
+	assert(vm->op_stack[vm->op_sp - 1] == 42);
+	vm_free(vm);
+
+	// An entry whose name collides with another source's is a miss
+	vm_init(vm);
+	assert(!cache_load(vm, path, "func main() { return 0; }"));
+	assert(!cache_load(vm, path, "func main() { let a; set a = 6; return a * 8; }"));
+	vm_free(vm);
+
+	unlink(path);
+	free(path);
+	free(again);
+	free(other_level);
+	free(other_source);
+	restore_cache_dir(dir, saved);
+}
+
+void cache_bench()
+{
+	char * saved;
+	char * dir = use_temp_cache_dir(&saved);
+
+	// Plenty of functions, so compiling costs something
+	char * source = NULL;
+	char line[256];
+	for (int i = 0; i < 500; i++) {
+		int len = sprintf(line,
+			"func f%d(n) { let i; let s; while i < n { if (i %% 3) == 0 { set s = s + i * %d; } "
+			"elif (i %% 3) == 1 { set s = s - 1; } else { set s = s + f%d(1); } set i = i + 1; } "
+			"return s; }\n", i, i, i > 0 ? i - 1 : 0);
+		memcpy(sb_add(source, len), line, len);
+	}
+	const char * main_func = "func main() { return f499(10); }\n";
+	memcpy(sb_add(source, strlen(main_func) + 1), main_func, strlen(main_func) + 1);
+
+	#define CACHE_BENCH_RUNS 20
+	char * path = cache_entry_path(source, 1);
+	u64 cold_ns = 0, cached_ns = 0;
+	for (int i = 0; i < CACHE_BENCH_RUNS; i++) {
+		VM _vm;
+		VM * vm = &_vm;
+
+		u64 start = time_ns();
+		vm_init(vm);
+		Compiler compiler;
+		compile_program(&compiler, vm, source, 1);
+		cache_store(vm, path, source);
+		compiler_free(&compiler);
+		cold_ns += time_ns() - start;
+		vm_free(vm);
+
+		start = time_ns();
+		vm_init(vm);
+		char * entry = cache_entry_path(source, 1);
+		assert(cache_load(vm, entry, source));
+		cached_ns += time_ns() - start;
+		free(entry);
+		vm_free(vm);
+	}
+	printf("cache: %d functions, cold %.3f ms, cached %.3f ms\n", 500,
+		cold_ns / 1e6 / CACHE_BENCH_RUNS, cached_ns / 1e6 / CACHE_BENCH_RUNS);
+
+	unlink(path);
+	free(path);
+	sb_free(source);
+	restore_cache_dir(dir, saved);
+}
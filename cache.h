@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Compilation cache
+ *
+ * Compiled programs are kept as bytecode files named after a hash of
+ * the source text, the optimization level and an id the Makefile
+ * derives from every source file, so a rebuilt compiler never picks
+ * up entries an older one wrote. Each entry also records the length
+ * and a second hash of its source, checked on load, so two sources
+ * whose names collide can't be mistaken for each other. Entries are
+ * written to a temporary file and renamed into place, so concurrent
+ * runs only ever see complete files.
+ *
+ * The directory is $SLC_CACHE_DIR if set, otherwise
+ * $XDG_CACHE_HOME/simple-lang or ~/.cache/simple-lang.
+ */
+
+// Path of the cache entry for source, or NULL if there's no usable
+// cache directory or the build has no id. The caller frees it.
+char * cache_entry_path(const char * source, int opt_level);
+// Load the entry at path into vm, if it was compiled from source
+bool cache_load(VM * vm, const char * path, const char * source);
+// Write vm's program as the entry at path. Failing to write is not
+// an error, the next run just compiles again.
+void cache_store(VM * vm, const char * path, const char * source);
+void cache_test();
+void cache_bench();
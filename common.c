@@ -1,15 +1,131 @@
 #include "common.h"
 
-char * load_string_from_file(char * path)
-{
-	FILE * file = fopen(path, "r");
-	if (file == NULL) return NULL;
-	int file_len = 0;
-	while (fgetc(file) != EOF) file_len++;
-	char * str = (char*) malloc(file_len + 1);
-	str[file_len] = '\0';
-	fseek(file, 0, SEEK_SET);
-	for (int i = 0; i < file_len; i++) str[i] = fgetc(file);
-	fclose(file);
-	return str;
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read everything left on fd in large chunks, for pipes and the like
+static bool read_all(int fd, Loaded_File * file)
+{
+	size_t capacity = 64 * 1024;
+	size_t len = 0;
+	char * str = malloc(capacity);
+	while (true) {
+		if (len + 1 == capacity) {
+			capacity *= 2;
+			str = realloc(str, capacity);
+		}
+		ssize_t got = read(fd, str + len, capacity - len - 1);
+		if (got == 0) break;
+		if (got < 0) {
+			free(str);
+			return false;
+		}
+		len += got;
+	}
+	str[len] = '\0';
+	file->str    = str;
+	file->len    = len;
+	file->mapped = 0;
+	return true;
+}
+
+bool load_file(const char * path, Loaded_File * file)
+{
+	if (strcmp(path, "-") == 0) {
+		return read_all(STDIN_FILENO, file);
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		bool ok = read_all(fd, file);
+		close(fd);
+		return ok;
+	}
+
+	// The rest of the last page of a mapping reads as zero, which
+	// terminates the string for free. A file that exactly fills its
+	// last page has no room for that, so it gets read instead.
+	size_t len = st.st_size;
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (len % page_size != 0) {
+		char * str = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (str != MAP_FAILED) {
+			close(fd);
+			file->str    = str;
+			file->len    = len;
+			file->mapped = len;
+			return true;
+		}
+	}
+
+	char * str = malloc(len + 1);
+	size_t got = 0;
+	while (got < len) {
+		ssize_t n = read(fd, str + got, len - got);
+		if (n <= 0) break;
+		got += n;
+	}
+	close(fd);
+	if (got != len) {
+		free(str);
+		return false;
+	}
+	str[len] = '\0';
+	file->str    = str;
+	file->len    = len;
+	file->mapped = 0;
+	return true;
+}
+
+void free_loaded_file(Loaded_File * file)
+{
+	if (file->mapped) {
+		munmap(file->str, file->mapped);
+	} else {
+		free(file->str);
+	}
+	file->str = NULL;
+	file->len = file->mapped = 0;
+}
+
+void load_file_test()
+{
+	char path[] = "/tmp/slc-load-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t sizes[] = {0, 1, 100, page_size, page_size + 1, 3 * page_size};
+	for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		FILE * out = fopen(path, "wb");
+		for (size_t j = 0; j < sizes[i]; j++) fputc('a' + j % 26, out);
+		fclose(out);
+
+		Loaded_File file;
+		assert(load_file(path, &file));
+		assert(file.len == sizes[i]);
+		assert(strlen(file.str) == sizes[i]);
+		for (size_t j = 0; j < sizes[i]; j++) assert(file.str[j] == 'a' + j % 26);
+		free_loaded_file(&file);
+	}
+
+	unlink(path);
+	Loaded_File file;
+	assert(!load_file(path, &file));
+}
+
+u64 time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000ull + (u64) ts.tv_nsec;
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <ctype.h>
 #include <stdarg.h>
@@ -9,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "stretchy_buffer.h"
 
@@ -29,4 +32,18 @@
 #define s32 int32_t
 #define s64 int64_t
 
-char * load_string_from_file(char * path);
+// A file's contents, NUL-terminated so the lexer can stop on it
+typedef struct Loaded_File {
+	char * str;
+	size_t len;
+	size_t mapped; // Size of the mapping, or 0 if str came from malloc
+} Loaded_File;
+
+// Maps the file where possible and reads it otherwise. A path of "-"
+// reads stdin. Returns false if the file can't be read.
+bool load_file(const char * path, Loaded_File * file);
+void free_loaded_file(Loaded_File * file);
+void load_file_test();
+
+// Monotonic clock in nanoseconds, for benchmarks
+u64 time_ns();
@@ -1,62 +1,98 @@
 #include "compiler.h"
 
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "fold.h"
 #include "lexer.h"
+#include "peephole.h"
+#include "regvm.h"
 
-Map * function_map;
-int * return_jumps; // TODO(pixlark): Hacky global variable. Fix this.
+// Where a tagged name sits relative to fp. See the frame layout in
+// vm.h.
+static s64 frame_offset(Compiler * compiler, s64 decl_pos)
+{
+	s64 decl_count = sb_count(compiler->func->decls);
+	if (decl_pos <= decl_count) {
+		return decl_pos - 1;
+	}
+	// Arguments are tagged last to first from just past the locals
+	return -(decl_pos - decl_count) - 1;
+}
+
+static s64 name_offset(Compiler * compiler, Expression * expr)
+{
+	if (expr->name.decl_pos == -1) {
+		internal_error("Encountered untagged name %s", expr->name.name);
+	}
+	return frame_offset(compiler, expr->name.decl_pos);
+}
 
-void compile_expression(VM * vm, Expression * expr)
+void compile_expression(Compiler * compiler, VM * vm, Expression * expr)
 {
 	switch (expr->type) {
 	case EXPR_UNARY:
-		compile_expression(vm, expr->unary.right);
-		EMIT_ARG(INST_OP, op_type, expr->unary.type);
-		break;
-	case EXPR_BINARY:
-		compile_expression(vm, expr->binary.left);
-		compile_expression(vm, expr->binary.right);
-		EMIT_ARG(INST_OP, op_type, expr->binary.type);
+		compile_expression(compiler, vm, expr->unary.right);
+		EMIT(op_to_inst[expr->unary.type]);
 		break;
+	case EXPR_BINARY: {
+		// Pick the operand form that saves the most dispatches
+		Inst_Type inst = op_to_inst[expr->binary.type];
+		Expression * left  = expr->binary.left;
+		Expression * right = expr->binary.right;
+		if (left->type == EXPR_NAME && right->type == EXPR_NAME) {
+			EMIT_ARGS(inst + BINARY_FORM_LL,
+				local, name_offset(compiler, left),
+				local, name_offset(compiler, right));
+		} else if (left->type == EXPR_NAME && right->type == EXPR_LITERAL) {
+			EMIT_ARGS(inst + BINARY_FORM_LI,
+				local, name_offset(compiler, left),
+				literal, right->literal.value);
+		} else if (right->type == EXPR_LITERAL) {
+			compile_expression(compiler, vm, left);
+			EMIT_ARGS(inst + BINARY_FORM_I,
+				literal, 0,
+				literal, right->literal.value);
+		} else {
+			compile_expression(compiler, vm, left);
+			compile_expression(compiler, vm, right);
+			EMIT(inst);
+		}
+	} break;
 	case EXPR_INDEX:
 		internal_error("Indexing operator not yet supported");
 		break;
 	case EXPR_FUNCALL: {
 		const char * name = expr->funcall.name->name.name;
-		if (name == str_intern("print")) {
+		if (name == intern_str(&compiler->interns, "print")) {
 			// TODO(pixlark): Create a real FFI, this is just a hack
 			// to get print working
 			if (sb_count(expr->funcall.args) != 1) {
 				fatal("print requires one argument");
 			}
-			compile_expression(vm, expr->funcall.args[0]);
+			compile_expression(compiler, vm, expr->funcall.args[0]);
 			EMIT(INST_PRINT);
 			break;
 		}
+		// Left on the op stack for INST_CALL to move into the frame
 		for (int i = 0; i < sb_count(expr->funcall.args); i++) {
-			EMIT_ARG(INST_PUSHC, literal, 0); // Make space for argument
-			compile_expression(vm, expr->funcall.args[i]);
-			EMIT_ARG(INST_SAVE, offset, 1);   // Save arg into space
+			compile_expression(compiler, vm, expr->funcall.args[i]);
 		}
-		if (!map_index(function_map, (u64) name, NULL)) {
+		if (!map_index(compiler->function_map, (u64) name, NULL)) {
 			fatal("Function %s does not exist", name);
 		}
 		Function * func;
-		map_index(function_map, (u64) name, (u64*) &func);
+		map_index(compiler->function_map, (u64) name, (u64*) &func);
 		if (sb_count(expr->funcall.args) != sb_count(func->arg_names)) {
 			fatal("Called procedure %s with %d arguments, expected %d",
 				func->name, sb_count(expr->funcall.args),
 				sb_count(func->arg_names));
 		}
-		EMIT_ARG(INST_JSIP, jmp_ip, func->ip_start);
-		EMIT(INST_POPC); // Pop ip
-		for (int i = 0; i < sb_count(expr->funcall.args); i++)
-			EMIT(INST_POPC); // Pop args
+		sb_push(compiler->call_fixups, ((Call_Fixup) {sb_count(vm->insts), func}));
+		EMIT_ARGS(INST_CALL, jmp_ip, 0, literal, sb_count(func->arg_names));
 	} break;
 	case EXPR_NAME:
-		if (expr->name.decl_pos == -1) {
-			internal_error("Encountered untagged name %s", expr->name.name);
-		}
-		EMIT_ARG(INST_LOAD, offset, expr->name.decl_pos);
+		EMIT_ARG(INST_LOADL, local, name_offset(compiler, expr));
 		break;
 	case EXPR_LITERAL:
 		EMIT_ARG(INST_PUSHO, literal, expr->literal.value);
@@ -64,21 +100,37 @@ void compile_expression(VM * vm, Expression * expr)
 	}
 }
 
-void compile_statement(VM * vm, Statement * stmt)
+// Instructions emitted from here on came from line, counted from 1
+static void mark_line(VM * vm, u32 line)
 {
+	Line_Entry entry = {sb_count(vm->insts), line};
+	if (sb_count(vm->lines) && sb_last(vm->lines).ip == entry.ip) {
+		sb_last(vm->lines) = entry;
+	} else if (!sb_count(vm->lines) || sb_last(vm->lines).line != line) {
+		sb_push(vm->lines, entry);
+	}
+}
+
+void compile_statement(Compiler * compiler, VM * vm, Statement * stmt)
+{
+	mark_line(vm, stmt->line + 1);
 	switch (stmt->type) {
 	case STMT_EXPR:
-		compile_expression(vm, stmt->stmt_expr.expr);
+		compile_expression(compiler, vm, stmt->stmt_expr.expr);
 		EMIT(INST_POPO);
 		break;
 	case STMT_ASSIGN:
 		if (stmt->stmt_assign.left->type != EXPR_NAME) {
 			internal_error("All lvalues are bare names at the moment");
 		}
-		compile_expression(vm, stmt->stmt_assign.right);
-		EMIT_ARG(INST_SAVE, offset, stmt->stmt_assign.left->name.decl_pos);
+		compile_expression(compiler, vm, stmt->stmt_assign.right);
+		EMIT_ARG(INST_STOREL, local, name_offset(compiler, stmt->stmt_assign.left));
 		break;
 	case STMT_DECL:
+		if (stmt->stmt_decl.reset) {
+			EMIT_ARG(INST_PUSHO, literal, 0);
+			EMIT_ARG(INST_STOREL, local, frame_offset(compiler, stmt->stmt_decl.decl_pos));
+		}
 		break;
 	case STMT_IF: {
 		/* 0 CONDITION 0
@@ -94,16 +146,17 @@ void compile_statement(VM * vm, Statement * stmt)
 		assert(sb_count(stmt->stmt_if.conditions) == sb_count(stmt->stmt_if.scopes));
 		int * jmps = 0;
 		for (int i = 0; i < sb_count(stmt->stmt_if.conditions); i++) {
-			compile_expression(vm, stmt->stmt_if.conditions[i]);
+			mark_line(vm, stmt->line + 1);
+			compile_expression(compiler, vm, stmt->stmt_if.conditions[i]);
 			int jz = sb_count(vm->insts);
 			EMIT(INST_JZ);
-			compile_statement(vm, stmt->stmt_if.scopes[i]);
+			compile_statement(compiler, vm, stmt->stmt_if.scopes[i]);
 			sb_push(jmps, sb_count(vm->insts));
 			EMIT(INST_JMP);
 			vm->insts[jz].arg0.jmp_ip = sb_count(vm->insts);
 		}
 		if (stmt->stmt_if.else_scope) {
-			compile_statement(vm, stmt->stmt_if.else_scope);
+			compile_statement(compiler, vm, stmt->stmt_if.else_scope);
 		}
 		for (int i = 0; i < sb_count(jmps); i++) {
 			vm->insts[jmps[i]].arg0.jmp_ip = sb_count(vm->insts);
@@ -111,202 +164,700 @@ void compile_statement(VM * vm, Statement * stmt)
 	} break;
 	case STMT_WHILE: {
 		int begin = sb_count(vm->insts);
-		compile_expression(vm, stmt->stmt_while.condition);
+		Expression * condition = stmt->stmt_while.condition;
+		if (condition->type == EXPR_LITERAL && condition->literal.value != 0) {
+			// Loops forever, no need to test the condition
+			compile_statement(compiler, vm, stmt->stmt_while.scope);
+			EMIT_ARG(INST_JMP, jmp_ip, begin);
+			break;
+		}
+		compile_expression(compiler, vm, condition);
 		int jz_end = sb_count(vm->insts);
 		EMIT(INST_JZ);
-		compile_statement(vm, stmt->stmt_while.scope);
+		compile_statement(compiler, vm, stmt->stmt_while.scope);
+		mark_line(vm, stmt->line + 1);
 		EMIT_ARG(INST_JMP, jmp_ip, begin);
 		vm->insts[jz_end].arg0.jmp_ip = sb_count(vm->insts);
 	} break;
 	case STMT_RETURN:
-		compile_expression(vm, stmt->stmt_return.expr);
-		sb_push(return_jumps, sb_count(vm->insts));
+		compile_expression(compiler, vm, stmt->stmt_return.expr);
+		sb_push(compiler->return_jumps, sb_count(vm->insts));
 		EMIT(INST_JMP);
 		break;
 	case STMT_SCOPE:
 		for (int i = 0; i < sb_count(stmt->stmt_scope.body); i++) {
-			compile_statement(vm, stmt->stmt_scope.body[i]);
+			compile_statement(compiler, vm, stmt->stmt_scope.body[i]);
 		}
 		break;
 	}
 }
 
-void compile_function(VM * vm, Function * func)
+void compile_function(Compiler * compiler, VM * vm, Function * func)
 {
-	return_jumps = 0;
+	compiler->return_jumps = 0;
+	compiler->func = func;
 	func->ip_start = sb_count(vm->insts);
+	mark_line(vm, func->body->line + 1);
 	EMIT_ARG(INST_SYMBOL, symbol, func->name);
-	for (int i = 0; i < sb_count(func->decls); i++) {
-		EMIT_ARG(INST_PUSHC, literal, 0);
-	}
-	compile_statement(vm, func->body);
-	for (int i = 0; i < sb_count(return_jumps); i++) {
-		if (vm->insts[return_jumps[i]].type != INST_JMP) {
-			internal_error("Invalid instruction in return_jumps");
+	EMIT_ARG(INST_ENTER, literal, sb_count(func->decls));
+	compile_statement(compiler, vm, func->body);
+	// Falling off the end returns 0, as on the register engine
+	EMIT_ARG(INST_PUSHO, literal, 0);
+	for (int i = 0; i < sb_count(compiler->return_jumps); i++) {
+		if (vm->insts[compiler->return_jumps[i]].type != INST_JMP) {
+			internal_error("Invalid instruction in compiler->return_jumps");
 		}
-		vm->insts[return_jumps[i]].arg0.jmp_ip = sb_count(vm->insts);
+		vm->insts[compiler->return_jumps[i]].arg0.jmp_ip = sb_count(vm->insts);
 	}
-	for (int i = 0; i < sb_count(func->decls); i++) {
-		EMIT(INST_POPC);
-	}
-	EMIT_ARG(INST_LOAD, offset, 1);
-	EMIT(INST_JIP);
+	EMIT_ARG(INST_RET, literal, sb_count(func->arg_names));
 }
 
-void compile(VM * vm)
+void compile_functions(Compiler * compiler, VM * vm)
 {
+	compiler->call_fixups = 0;
 	int iter = -1;
-	while ((iter = map_iter(function_map, iter)) != -1) {
+	while ((iter = map_iter(compiler->function_map, iter)) != -1) {
 		/*
 		printf("Compiling function %s\n",
-		((Function*)function_map->values[iter])->name);*/
-		compile_function(vm,
-			(Function*) function_map->values[iter]);
+		((Function*)compiler->function_map->slots[iter].value)->name);*/
+		compile_function(compiler, vm,
+			(Function*) compiler->function_map->slots[iter].value);
+	}
+	for (int i = 0; i < sb_count(compiler->call_fixups); i++) {
+		vm->insts[compiler->call_fixups[i].inst].arg0.jmp_ip = compiler->call_fixups[i].func->ip_start;
 	}
+	sb_free(compiler->call_fixups);
+}
+
+void compile(Compiler * compiler, VM * vm)
+{
+	compile_functions(compiler, vm);
 	vm->ip = sb_count(vm->insts);
-	if (!map_index(function_map, (u64) str_intern("main"), NULL)) {
+	mark_line(vm, 0);
+	if (!map_index(compiler->function_map, (u64) intern_str(&compiler->interns, "main"), NULL)) {
 		fatal("No main function");
 	}
 	Function * main;
-	map_index(function_map, (u64) str_intern("main"), (u64*) &main);
-	EMIT_ARG(INST_JSIP, jmp_ip, main->ip_start);
-	EMIT(INST_POPC);
+	map_index(compiler->function_map, (u64) intern_str(&compiler->interns, "main"), (u64*) &main);
+	EMIT_ARGS(INST_CALL, jmp_ip, main->ip_start, literal, 0);
 	EMIT(INST_HALT);
 }
 
-void tag_names_in_expr(Expression * expr, const char * name, int pos)
+/*
+ * Register backend
+ *
+ * Arguments take the first registers of a function's window, in
+ * order, then one register per declaration, then temporaries. Temps
+ * are handed out like a stack: compiler->reg_next is the first free one, and
+ * each expression gives back everything above its result.
+ */
+
+static int reg_alloc(Compiler * compiler)
+{
+	int reg = compiler->reg_next++;
+	if (compiler->reg_next > compiler->reg_max) compiler->reg_max = compiler->reg_next;
+	return reg;
+}
+
+// Maps a tagged name to its register, undoing the call stack offsets
+// prepare assigns
+static int reg_local(Compiler * compiler, Expression * expr)
+{
+	if (expr->name.decl_pos == -1) {
+		internal_error("Encountered untagged name %s", expr->name.name);
+	}
+	int decl_count = sb_count(compiler->reg_func->decls);
+	int arg_count  = sb_count(compiler->reg_func->arg_names);
+	int pos = expr->name.decl_pos;
+	if (pos <= decl_count) {
+		return arg_count + pos - 1;
+	}
+	return arg_count - (pos - decl_count - 1);
+}
+
+static bool is_compare_op(Operator_Type type)
+{
+	return type == OP_EQ || type == OP_GT || type == OP_LT ||
+		type == OP_GTE || type == OP_LTE;
+}
+
+static Reg_Inst_Type reg_binary_inst(Operator_Type type)
 {
+	switch (type) {
+	#define REG_BINARY_CASE(name, op) case OP_##name: return RINST_##name;
+	BINARY_INSTS(REG_BINARY_CASE)
+	#undef REG_BINARY_CASE
+	default:
+		internal_error("No register instruction for operator %s", op_to_str[type]);
+		return RINST_HALT;
+	}
+}
+
+static Reg_Inst_Type reg_compare_jump_inst(Operator_Type type)
+{
+	switch (type) {
+	#define REG_COMPARE_CASE(name, op) case OP_##name: return RINST_JZ_##name;
+	COMPARE_INSTS(REG_COMPARE_CASE)
+	#undef REG_COMPARE_CASE
+	default:
+		internal_error("No register jump for operator %s", op_to_str[type]);
+		return RINST_HALT;
+	}
+}
+
+/* Compiles expr and returns the register holding its value. If dest
+ * isn't -1 the value is computed straight into dest.
+ */
+int compile_reg_expression(Compiler * compiler, Reg_VM * rvm, Expression * expr, int dest)
+{
+	int top = compiler->reg_next;
+	int result;
 	switch (expr->type) {
-	case EXPR_UNARY:
-		tag_names_in_expr(expr->unary.right, name, pos);
-		break;
+	case EXPR_UNARY: {
+		int right = compile_reg_expression(compiler, rvm, expr->unary.right, -1);
+		compiler->reg_next = top;
+		result = dest == -1 ? reg_alloc(compiler) : dest;
+		REMIT(expr->unary.type == OP_NEG ? RINST_NEG : RINST_LNEG, result, right, 0, 0);
+	} break;
+	case EXPR_BINARY: {
+		Reg_Inst_Type inst = reg_binary_inst(expr->binary.type);
+		int left = compile_reg_expression(compiler, rvm, expr->binary.left, -1);
+		if (expr->binary.right->type == EXPR_LITERAL) {
+			compiler->reg_next = top;
+			result = dest == -1 ? reg_alloc(compiler) : dest;
+			REMIT(inst + 1, result, left, 0, expr->binary.right->literal.value);
+		} else {
+			int right = compile_reg_expression(compiler, rvm, expr->binary.right, -1);
+			compiler->reg_next = top;
+			result = dest == -1 ? reg_alloc(compiler) : dest;
+			REMIT(inst, result, left, right, 0);
+		}
+	} break;
 	case EXPR_INDEX:
-		tag_names_in_expr(expr->index.left, name, pos);
-		tag_names_in_expr(expr->index.right, name, pos);
+		internal_error("Indexing operator not yet supported");
 		break;
-	case EXPR_FUNCALL:
-		tag_names_in_expr(expr->funcall.name, name, pos);
+	case EXPR_FUNCALL: {
+		const char * name = expr->funcall.name->name.name;
+		if (name == intern_str(&compiler->interns, "print")) {
+			if (sb_count(expr->funcall.args) != 1) {
+				fatal("print requires one argument");
+			}
+			result = compile_reg_expression(compiler, rvm, expr->funcall.args[0], dest);
+			REMIT(RINST_PRINT, result, 0, 0, 0);
+			break;
+		}
+		Function * func;
+		if (!map_index(compiler->function_map, (u64) name, (u64*) &func)) {
+			fatal("Function %s does not exist", name);
+		}
+		if (sb_count(expr->funcall.args) != sb_count(func->arg_names)) {
+			fatal("Called procedure %s with %d arguments, expected %d",
+				func->name, sb_count(expr->funcall.args),
+				sb_count(func->arg_names));
+		}
+		// Arguments go in consecutive registers that become the
+		// bottom of the callee's window
+		int base = top;
 		for (int i = 0; i < sb_count(expr->funcall.args); i++) {
-			tag_names_in_expr(expr->funcall.args[i], name, pos);
+			compiler->reg_next = base + i;
+			reg_alloc(compiler);
+			compile_reg_expression(compiler, rvm, expr->funcall.args[i], base + i);
 		}
+		compiler->reg_next = base;
+		result = dest == -1 ? reg_alloc(compiler) : dest;
+		sb_push(compiler->reg_call_fixups, ((Call_Fixup) {sb_count(rvm->insts), func}));
+		REMIT(RINST_CALL, result, base, 0, 0);
+	} break;
+	case EXPR_NAME: {
+		int local = reg_local(compiler, expr);
+		if (dest == -1) return local;
+		result = dest;
+		REMIT(RINST_MOV, result, local, 0, 0);
+	} break;
+	case EXPR_LITERAL:
+		result = dest == -1 ? reg_alloc(compiler) : dest;
+		REMIT(RINST_MOVI, result, 0, 0, expr->literal.value);
 		break;
-	case EXPR_BINARY:
-		tag_names_in_expr(expr->binary.left, name, pos);
-		tag_names_in_expr(expr->binary.right, name, pos);
+	}
+	return result;
+}
+
+/* Emits a jump taken when condition is false and returns its index,
+ * for the caller to patch. Comparisons fuse into the jump.
+ */
+static int compile_reg_branch(Compiler * compiler, Reg_VM * rvm, Expression * condition)
+{
+	int top = compiler->reg_next;
+	int jump;
+	if (condition->type == EXPR_BINARY && is_compare_op(condition->binary.type)) {
+		Reg_Inst_Type inst = reg_compare_jump_inst(condition->binary.type);
+		int left = compile_reg_expression(compiler, rvm, condition->binary.left, -1);
+		jump = sb_count(rvm->insts);
+		if (condition->binary.right->type == EXPR_LITERAL) {
+			REMIT(inst + 1, left, 0, 0, condition->binary.right->literal.value);
+		} else {
+			int right = compile_reg_expression(compiler, rvm, condition->binary.right, -1);
+			jump = sb_count(rvm->insts);
+			REMIT(inst, left, right, 0, 0);
+		}
+	} else {
+		int reg = compile_reg_expression(compiler, rvm, condition, -1);
+		jump = sb_count(rvm->insts);
+		REMIT(RINST_JZ, reg, 0, 0, 0);
+	}
+	compiler->reg_next = top;
+	return jump;
+}
+
+void compile_reg_statement(Compiler * compiler, Reg_VM * rvm, Statement * stmt)
+{
+	int top = compiler->reg_next;
+	switch (stmt->type) {
+	case STMT_EXPR:
+		compile_reg_expression(compiler, rvm, stmt->stmt_expr.expr, -1);
 		break;
-	case EXPR_NAME:
-		if (expr->name.name == name) {
-			expr->name.decl_pos = pos;
+	case STMT_ASSIGN:
+		if (stmt->stmt_assign.left->type != EXPR_NAME) {
+			internal_error("All lvalues are bare names at the moment");
+		}
+		compile_reg_expression(compiler, rvm, stmt->stmt_assign.right,
+			reg_local(compiler, stmt->stmt_assign.left));
+		break;
+	case STMT_DECL:
+		if (stmt->stmt_decl.reset) {
+			int reg = sb_count(compiler->reg_func->arg_names) + stmt->stmt_decl.decl_pos - 1;
+			REMIT(RINST_MOVI, reg, 0, 0, 0);
+		}
+		break;
+	case STMT_IF: {
+		int * jmps = 0;
+		for (int i = 0; i < sb_count(stmt->stmt_if.conditions); i++) {
+			int jz = compile_reg_branch(compiler, rvm, stmt->stmt_if.conditions[i]);
+			compile_reg_statement(compiler, rvm, stmt->stmt_if.scopes[i]);
+			sb_push(jmps, sb_count(rvm->insts));
+			REMIT(RINST_JMP, 0, 0, 0, 0);
+			rvm->insts[jz].c = sb_count(rvm->insts);
+		}
+		if (stmt->stmt_if.else_scope) {
+			compile_reg_statement(compiler, rvm, stmt->stmt_if.else_scope);
+		}
+		for (int i = 0; i < sb_count(jmps); i++) {
+			rvm->insts[jmps[i]].c = sb_count(rvm->insts);
+		}
+		sb_free(jmps);
+	} break;
+	case STMT_WHILE: {
+		int begin = sb_count(rvm->insts);
+		Expression * condition = stmt->stmt_while.condition;
+		if (condition->type == EXPR_LITERAL && condition->literal.value != 0) {
+			compile_reg_statement(compiler, rvm, stmt->stmt_while.scope);
+			REMIT(RINST_JMP, 0, 0, begin, 0);
+			break;
+		}
+		int jz_end = compile_reg_branch(compiler, rvm, condition);
+		compile_reg_statement(compiler, rvm, stmt->stmt_while.scope);
+		REMIT(RINST_JMP, 0, 0, begin, 0);
+		rvm->insts[jz_end].c = sb_count(rvm->insts);
+	} break;
+	case STMT_RETURN: {
+		int reg = compile_reg_expression(compiler, rvm, stmt->stmt_return.expr, -1);
+		REMIT(RINST_RET, reg, 0, 0, 0);
+	} break;
+	case STMT_SCOPE:
+		for (int i = 0; i < sb_count(stmt->stmt_scope.body); i++) {
+			compile_reg_statement(compiler, rvm, stmt->stmt_scope.body[i]);
 		}
 		break;
 	}
+	compiler->reg_next = top;
 }
 
-void tag_names(Statement * scope, int start, const char * name, int pos)
+void compile_reg_function(Compiler * compiler, Reg_VM * rvm, Function * func)
 {
-	assert(scope->type == STMT_SCOPE);
-	for (int i = start; i < sb_count(scope->stmt_scope.body); i++) {
-		Statement * it = scope->stmt_scope.body[i];
-		switch (it->type) {
-		case STMT_EXPR:
-			tag_names_in_expr(it->stmt_expr.expr, name, pos);
-			break;
-		case STMT_ASSIGN:
-			tag_names_in_expr(it->stmt_assign.left, name, pos);
-			tag_names_in_expr(it->stmt_assign.right, name, pos);
-			break;
-		case STMT_IF:
-			// Tag names in conditions
-			for (int i = 0; i < sb_count(it->stmt_if.conditions); i++) {
-				tag_names_in_expr(it->stmt_if.conditions[i], name, pos);
-			}
-			// Recurse with each if scope
-			for (int i = 0; i < sb_count(it->stmt_if.scopes); i++) {
-				tag_names(it->stmt_if.scopes[i], 0, name, pos);
-			}
-			if (it->stmt_if.else_scope) {
-				tag_names(it->stmt_if.else_scope, 0, name, pos);
-			}
-			break;
-		case STMT_WHILE:
-			// Tag names in condition
-			tag_names_in_expr(it->stmt_while.condition, name, pos);
-			// Recurse with the while scope
-			tag_names(it->stmt_while.scope, 0, name, pos);
-			break;
-		case STMT_RETURN:
-			tag_names_in_expr(it->stmt_return.expr, name, pos);
-			break;
-		case STMT_SCOPE:
-			tag_names(it, 0, name, pos);
-			break;
+	compiler->reg_func = func;
+	int arg_count  = sb_count(func->arg_names);
+	int decl_count = sb_count(func->decls);
+	compiler->reg_next = compiler->reg_max = arg_count + decl_count;
+	func->reg_ip_start = sb_count(rvm->insts);
+	REMIT(RINST_ENTER, arg_count, decl_count, 0, 0);
+	compile_reg_statement(compiler, rvm, func->body);
+	// Falling off the end returns 0
+	int reg = reg_alloc(compiler);
+	REMIT(RINST_MOVI, reg, 0, 0, 0);
+	REMIT(RINST_RET, reg, 0, 0, 0);
+	rvm->insts[func->reg_ip_start].c = compiler->reg_max;
+}
+
+void compile_reg(Compiler * compiler, Reg_VM * rvm)
+{
+	compiler->reg_call_fixups = 0;
+	int iter = -1;
+	while ((iter = map_iter(compiler->function_map, iter)) != -1) {
+		compile_reg_function(compiler, rvm,
+			(Function*) compiler->function_map->slots[iter].value);
+	}
+	for (int i = 0; i < sb_count(compiler->reg_call_fixups); i++) {
+		rvm->insts[compiler->reg_call_fixups[i].inst].c = compiler->reg_call_fixups[i].func->reg_ip_start;
+	}
+	sb_free(compiler->reg_call_fixups);
+	rvm->ip = sb_count(rvm->insts);
+	Function * main;
+	if (!map_index(compiler->function_map, (u64) intern_str(&compiler->interns, "main"), (u64*) &main)) {
+		fatal("No main function");
+	}
+	// main's window starts above r0, which receives its result
+	REMIT(RINST_CALL, 0, 1, main->reg_ip_start, 0);
+	REMIT(RINST_HALT, 0, 0, 0, 0);
+}
+
+/* Name resolution
+ *
+ * One walk over a function gives each let the next slot and tags
+ * every name with the slot of the innermost binding in scope, so each
+ * name is looked at once. Bindings are kept on a stack, with a map
+ * from each name to its innermost binding so lookups don't search
+ * it. A binding remembers the one it hides, which comes back into
+ * view when its scope closes.
+ *
+ * Arguments are bound outside the body, so any let can shadow them.
+ * Their slots sit above the locals, so names bound to them are only
+ * given a slot once the walk has counted the locals.
+ *
+ * Slots are handed out like a stack, and given back when the scope
+ * holding their let closes, so lets in scopes that don't overlap share
+ * slots and the frame only needs as many as are ever live at once. A
+ * let that takes a slot someone else had is reset to 0, as though it
+ * were fresh from the prologue. Within a loop nothing is given back
+ * until the loop ends, since a local keeps its value from one
+ * iteration to the next and a reset would have to run each time round.
+ */
+
+typedef struct Binding {
+	const char * name;
+	int decl_pos; // Slot of a local
+	int arg;      // Index of an argument, or -1 for a local
+	int shadowed; // Binding this one hides, or -1
+} Binding;
+
+typedef struct Resolver {
+	Function * func;
+	Declaration * decls; // One for each slot, named after its first local
+	int next_slot;
+	int loop_depth;
+	Binding * bindings;
+	Map * innermost;        // Name to the index of its innermost binding
+	Expression ** arg_uses; // Names bound to arguments
+} Resolver;
+
+static void bind(Resolver * resolver, const char * name, int decl_pos, int arg)
+{
+	Binding binding = {name, decl_pos, arg, -1};
+	u64 shadowed;
+	if (map_index(resolver->innermost, (u64) name, &shadowed)) {
+		binding.shadowed = shadowed;
+	}
+	map_insert(resolver->innermost, (u64) name, sb_count(resolver->bindings));
+	sb_push(resolver->bindings, binding);
+}
+
+// Drops the bindings made since there were count of them
+static void close_scope(Resolver * resolver, int count)
+{
+	while (sb_count(resolver->bindings) > count) {
+		Binding binding = sb_pop(resolver->bindings);
+		if (binding.shadowed == -1) {
+			map_delete(resolver->innermost, (u64) binding.name);
+		} else {
+			map_insert(resolver->innermost, (u64) binding.name, binding.shadowed);
+		}
+	}
+}
+
+static void resolve_expression(Resolver * resolver, Expression * expr)
+{
+	switch (expr->type) {
+	case EXPR_UNARY:
+		resolve_expression(resolver, expr->unary.right);
+		break;
+	case EXPR_INDEX:
+		resolve_expression(resolver, expr->index.left);
+		resolve_expression(resolver, expr->index.right);
+		break;
+	case EXPR_FUNCALL:
+		// The callee's name is a function's, not a variable's
+		for (int i = 0; i < sb_count(expr->funcall.args); i++) {
+			resolve_expression(resolver, expr->funcall.args[i]);
+		}
+		break;
+	case EXPR_BINARY:
+		resolve_expression(resolver, expr->binary.left);
+		resolve_expression(resolver, expr->binary.right);
+		break;
+	case EXPR_NAME: {
+		u64 index;
+		if (!map_index(resolver->innermost, (u64) expr->name.name, &index)) {
+			fatal("Undeclared name %s in function %s", expr->name.name, resolver->func->name);
 		}
+		Binding * binding = &resolver->bindings[index];
+		if (binding->arg == -1) {
+			expr->name.decl_pos = binding->decl_pos;
+		} else {
+			expr->name.decl_pos = binding->arg;
+			sb_push(resolver->arg_uses, expr);
+		}
+	} break;
+	case EXPR_LITERAL:
+		break;
 	}
 }
 
-void read_declarations(Declaration ** decls, Statement * stmt)
+static void resolve_statement(Resolver * resolver, Statement * stmt)
 {
 	switch (stmt->type) {
+	case STMT_EXPR:
+		resolve_expression(resolver, stmt->stmt_expr.expr);
+		break;
+	case STMT_ASSIGN:
+		resolve_expression(resolver, stmt->stmt_assign.left);
+		resolve_expression(resolver, stmt->stmt_assign.right);
+		break;
+	case STMT_DECL: {
+		int slot = resolver->next_slot++;
+		stmt->stmt_decl.decl_pos = slot + 1;
+		stmt->stmt_decl.reset = slot < sb_count(resolver->decls);
+		if (!stmt->stmt_decl.reset) {
+			Declaration decl;
+			decl.name = stmt->stmt_decl.name;
+			decl.size = sizeof(u64); // No types at the moment
+			decl.decl_pos = slot;
+			sb_push(resolver->decls, decl);
+		}
+		assert(!stmt->stmt_decl.reset || resolver->loop_depth == 0);
+		bind(resolver, stmt->stmt_decl.name, slot + 1, -1);
+	} break;
 	case STMT_IF:
-		// Recurse with each if scope
-		for (int i = 0; i < sb_count(stmt->stmt_if.scopes); i++) {
-			read_declarations(decls, stmt->stmt_if.scopes[i]);
+		for (int i = 0; i < sb_count(stmt->stmt_if.conditions); i++) {
+			resolve_expression(resolver, stmt->stmt_if.conditions[i]);
+			resolve_statement(resolver, stmt->stmt_if.scopes[i]);
 		}
 		if (stmt->stmt_if.else_scope) {
-			read_declarations(decls, stmt->stmt_if.else_scope);
+			resolve_statement(resolver, stmt->stmt_if.else_scope);
 		}
 		break;
-	case STMT_WHILE:
-		// Recurse with the while scope
-		read_declarations(decls, stmt->stmt_while.scope);
+	case STMT_WHILE: {
+		int next_slot = resolver->next_slot;
+		if (resolver->loop_depth == 0) {
+			// Slots given back before the loop would need resetting
+			resolver->next_slot = sb_count(resolver->decls);
+		}
+		resolver->loop_depth++;
+		resolve_expression(resolver, stmt->stmt_while.condition);
+		resolve_statement(resolver, stmt->stmt_while.scope);
+		resolver->loop_depth--;
+		if (resolver->loop_depth == 0) {
+			resolver->next_slot = next_slot;
+		}
+	} break;
+	case STMT_RETURN:
+		resolve_expression(resolver, stmt->stmt_return.expr);
 		break;
-	case STMT_SCOPE:
+	case STMT_SCOPE: {
+		int count = sb_count(resolver->bindings);
+		int next_slot = resolver->next_slot;
 		for (int i = 0; i < sb_count(stmt->stmt_scope.body); i++) {
-			Statement * it = stmt->stmt_scope.body[i];
-			if (it->type == STMT_DECL) {
-				Declaration decl;
-				decl.name = it->stmt_decl.name;
-				decl.size = sizeof(u64); // No types at the moment
-				decl.decl_pos = sb_count(*decls);
-				tag_names(stmt, i, it->stmt_decl.name, sb_count(*decls) + 1);
-				sb_push(*decls, decl);
-			} else {
-				read_declarations(decls, it);
-			}
+			resolve_statement(resolver, stmt->stmt_scope.body[i]);
 		}
-		break;
+		close_scope(resolver, count);
+		if (resolver->loop_depth == 0) {
+			resolver->next_slot = next_slot;
+		}
+	} break;
 	}
 }
 
-void tag_args(Function * func)
+static Declaration * resolve_names(Arena * arena, Function * func)
 {
-	int decl_count = sb_count(func->decls);
-	int arg_count  = sb_count(func->arg_names);
+	Resolver resolver = {0};
+	resolver.func = func;
+	resolver.innermost = make_map(16);
+	int arg_count = sb_count(func->arg_names);
 	for (int i = 0; i < arg_count; i++) {
-		tag_names(func->body, 0, func->arg_names[i],
-			decl_count + 1 + (arg_count - i));
+		bind(&resolver, func->arg_names[i], 0, i);
 	}
+	resolve_statement(&resolver, func->body);
+
+	int decl_count = sb_count(resolver.decls);
+	for (int i = 0; i < sb_count(resolver.arg_uses); i++) {
+		Expression * use = resolver.arg_uses[i];
+		use->name.decl_pos = decl_count + 1 + (arg_count - use->name.decl_pos);
+	}
+
+	free_map(resolver.innermost);
+	sb_free(resolver.bindings);
+	sb_free(resolver.arg_uses);
+	return arena_sb(arena, resolver.decls);
 }
 
-Declaration * read_function_decls(Function * func)
+void compiler_init(Compiler * compiler, const char * source)
 {
-	Declaration * decls = 0;
-	read_declarations(&decls, func->body);
-	return decls;
+	memset(compiler, 0, sizeof(*compiler));
+	parser_init(&compiler->parser, &compiler->interns);
+	init_stream(&compiler->parser.lex, source);
 }
 
-void prepare()
+void compiler_free(Compiler * compiler)
 {
-	function_map = make_map(512);
-	while (tokens_left()) {
-		Function * func = parse_function();
-		prepare_function(func);
-		map_insert(function_map, (u64) func->name, (u64) func);
+	finish_compilation(compiler);
+	parser_free(&compiler->parser);
+	intern_table_free(&compiler->interns);
+}
+
+void prepare(Compiler * compiler)
+{
+	Parser * parser = &compiler->parser;
+	compiler->function_map = make_map(512);
+	while (tokens_left(parser)) {
+		Function * func = parse_function(parser);
+		prepare_function(compiler, func);
+		map_insert(compiler->function_map, (u64) func->name, (u64) func);
 	}
 }
 
-void prepare_function(Function * func)
+void prepare_function(Compiler * compiler, Function * func)
+{
+	func->decls = resolve_names(&compiler->parser.arena, func);
+}
+
+void finish_compilation(Compiler * compiler)
 {
-	func->decls = read_function_decls(func);
-	tag_args(func);
+	arena_free(&compiler->parser.arena);
+	if (compiler->function_map) free_map(compiler->function_map);
+	compiler->function_map = NULL;
+}
+
+static size_t peak_rss_kb()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+void compile_bench()
+{
+	char * source = NULL;
+	char line[256];
+	for (int i = 0; i < 20000; i++) {
+		int len = sprintf(line,
+			"func f%d(n) { let i; let s; while i < n { if (i %% 3) == 0 { set s = s + i * %d; } "
+			"elif (i %% 3) == 1 { set s = s - 1; } else { set s = s + f%d(1); } set i = i + 1; } "
+			"return s; }\n", i, i, i > 0 ? i - 1 : 0);
+		memcpy(sb_add(source, len), line, len);
+	}
+	const char * main_func = "func main() { return f19999(10); }\n";
+	memcpy(sb_add(source, strlen(main_func) + 1), main_func, strlen(main_func) + 1);
+
+	// Compile the same program repeatedly, first releasing each AST
+	// and then keeping them all, as happened before the arena
+	for (int release = 1; release >= 0; release--) {
+		for (int run = 0; run < 5; run++) {
+			VM _vm;
+			VM * vm = &_vm;
+			vm_init(vm);
+			Compiler compiler;
+			compiler_init(&compiler, source);
+			prepare(&compiler);
+			compile(&compiler, vm);
+			Arena * arena = &compiler.parser.arena;
+			size_t allocations = arena->allocations;
+			size_t blocks = 0;
+			for (Arena_Block * it = arena->blocks; it; it = it->next) blocks++;
+			if (!release) {
+				memset(arena, 0, sizeof(*arena));
+			}
+			compiler_free(&compiler);
+			vm_free(vm);
+			if (run == 4) {
+				printf("compile: %s ASTs, %zu nodes and arrays in %zu blocks, peak RSS %zu KB\n",
+					release ? "released" : "kept", allocations, blocks, peak_rss_kb());
+			}
+		}
+	}
+	sb_free(source);
+
+	// One function with many locals, each used a few times further
+	// on, for the cost of resolving names
+	for (int locals = 1000; locals <= 10000; locals = locals < 5000 ? 5000 : locals * 2) {
+		source = NULL;
+		const char * header = "func main() {\n";
+		memcpy(sb_add(source, strlen(header)), header, strlen(header));
+		for (int i = 0; i < locals; i++) {
+			int len = sprintf(line, "let v%d; set v%d = %d;\n", i, i, i % 100);
+			memcpy(sb_add(source, len), line, len);
+		}
+		for (int i = 1; i < locals; i++) {
+			int len = sprintf(line, "set v%d = v%d + v%d;\n", i, i, i - 1);
+			memcpy(sb_add(source, len), line, len);
+		}
+		int len = sprintf(line, "return v%d; }\n", locals - 1);
+		memcpy(sb_add(source, len + 1), line, len + 1);
+
+		Compiler compiler;
+		compiler_init(&compiler, source);
+		Function * func = parse_function(&compiler.parser);
+		u64 start = time_ns();
+		prepare_function(&compiler, func);
+		u64 elapsed = time_ns() - start;
+		printf("resolve: %d locals, %d names in %.3f ms\n",
+			locals, 4 * locals - 3, elapsed / 1e6);
+		compiler_free(&compiler);
+		sb_free(source);
+	}
+}
+
+typedef struct Thread_Job {
+	char source[512];
+	s64 expected;
+	bool passed;
+} Thread_Job;
+
+static void * compile_and_run(void * data)
+{
+	Thread_Job * job = (Thread_Job*) data;
+	job->passed = true;
+	for (int run = 0; run < 20; run++) {
+		VM _vm;
+		VM * vm = &_vm;
+		vm_init(vm);
+		Compiler compiler;
+		compiler_init(&compiler, job->source);
+		prepare(&compiler);
+		fold(&compiler);
+		compile(&compiler, vm);
+		peephole(vm);
+		compiler_free(&compiler);
+		vm_run(vm);
+		if (vm->op_stack[vm->op_sp - 1] != job->expected) job->passed = false;
+		vm_free(vm);
+	}
+	return NULL;
+}
+
+void compiler_thread_test()
+{
+	#define THREAD_TEST_COUNT 8
+	pthread_t threads[THREAD_TEST_COUNT];
+	Thread_Job jobs[THREAD_TEST_COUNT];
+	for (int i = 0; i < THREAD_TEST_COUNT; i++) {
+		// Different names and sizes in each, so shared state would show
+		int n = 1000 + 37 * i;
+		sprintf(jobs[i].source,
+			"func sum%d(n) { let i; let s; while i < n { set i = i + 1; set s = s + i * %d; } return s; }\n"
+			"func main() { return sum%d(%d) - %d; }\n", i, i + 1, i, n, i);
+		jobs[i].expected = (s64) n * (n + 1) / 2 * (i + 1) - i;
+		assert(pthread_create(&threads[i], NULL, compile_and_run, &jobs[i]) == 0);
+	}
+	for (int i = 0; i < THREAD_TEST_COUNT; i++) {
+		pthread_join(threads[i], NULL);
+		assert(jobs[i].passed);
+	}
 }
@@ -14,18 +14,65 @@ typedef struct Function Function;
 typedef struct VM VM;
 //
 
+// From regvm.h
+typedef struct Reg_VM Reg_VM;
+//
+
 typedef struct Declaration {
 	const char * name;
 	size_t size;
 	int decl_pos;
 } Declaration;
 
-extern Map * function_map;
+// Calls are patched once every function has an ip_start, since
+// function_map iteration order has nothing to do with call order
+typedef struct Call_Fixup {
+	int inst;
+	Function * func;
+} Call_Fixup;
+
+/* Everything one compilation needs. Compilers share nothing, so
+ * separate threads can each run their own.
+ */
+typedef struct Compiler {
+	Parser parser;
+	Intern_Table interns; // Every name in the program
+	Map * function_map;
+
+	// Stack backend
+	Function * func;
+	int * return_jumps;
+	Call_Fixup * call_fixups;
+
+	// Register backend
+	Function * reg_func;
+	int reg_next;
+	int reg_max;
+	Call_Fixup * reg_call_fixups;
+} Compiler;
+
+void compiler_init(Compiler * compiler, const char * source);
+// Releases the names, and everything finish_compilation does if it
+// hasn't run yet
+void compiler_free(Compiler * compiler);
+
+void prepare(Compiler * compiler);
+void prepare_function(Compiler * compiler, Function * func);
+// Release the AST and function_map once compiling, and anything else
+// that relocates function entry points, is done
+void finish_compilation(Compiler * compiler);
+void compile_bench();
+void compiler_thread_test();
 
-void prepare();
-void prepare_function(Function * func);
+void compile(Compiler * compiler, VM * vm);
+// Every function, without the entry stub that calls main
+void compile_functions(Compiler * compiler, VM * vm);
+void compile_function(Compiler * compiler, VM * vm, Function * func);
+void compile_expression(Compiler * compiler, VM * vm, Expression * expr);
+void compile_statement(Compiler * compiler, VM * vm, Statement * stmt);
 
-void compile(VM * vm);
-void compile_function(VM * vm, Function * func);
-void compile_expression(VM * vm, Expression * expr);
-void compile_statement(VM * vm, Statement * stmt);
+// Register backend, for the engine in regvm.h
+void compile_reg(Compiler * compiler, Reg_VM * rvm);
+void compile_reg_function(Compiler * compiler, Reg_VM * rvm, Function * func);
+int compile_reg_expression(Compiler * compiler, Reg_VM * rvm, Expression * expr, int dest);
+void compile_reg_statement(Compiler * compiler, Reg_VM * rvm, Statement * stmt);
@@ -1,9 +1,34 @@
 #include "error.h"
 
+static __thread Error_Trap * error_trap = NULL;
+
+void error_trap_set(Error_Trap * trap)
+{
+	trap->previous = error_trap;
+	error_trap = trap;
+}
+
+void error_trap_clear(Error_Trap * trap)
+{
+	error_trap = trap->previous;
+}
+
+// Hands the error to the thread's trap, if it has one
+static void spring_trap(const char * prefix, const char * fmt, va_list args)
+{
+	Error_Trap * trap = error_trap;
+	if (!trap) return;
+	int length = snprintf(trap->message, sizeof(trap->message), "%s", prefix);
+	vsnprintf(trap->message + length, sizeof(trap->message) - length, fmt, args);
+	error_trap = trap->previous;
+	longjmp(trap->jump, 1);
+}
+
 void fatal(const char * fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
+	spring_trap("", fmt, args);
 
 	printf("Fatal Error:\n  ");
 	vprintf(fmt, args);
@@ -17,6 +42,9 @@ void fatal_line(u32 line, const char * fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
+	char prefix[32];
+	snprintf(prefix, sizeof(prefix), "[:%d] ", line);
+	spring_trap(prefix, fmt, args);
 
 	printf("Fatal Error:\n  [:%d] ", line);
 	vprintf(fmt, args);
@@ -30,6 +58,7 @@ void runtime(const char * fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
+	spring_trap("", fmt, args);
 
 	printf("Runtime Error:\n  ");
 	vprintf(fmt, args);
@@ -43,6 +72,9 @@ void runtime_line(u32 line, const char * fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
+	char prefix[32];
+	snprintf(prefix, sizeof(prefix), "[:%d] ", line);
+	spring_trap(prefix, fmt, args);
 
 	printf("Runtime Error:\n  [:%d] ", line);
 	vprintf(fmt, args);
@@ -56,6 +88,7 @@ void _internal_error(const char * fmt, char * file, int line, ...)
 {
 	va_list args;
 	va_start(args, line);
+	spring_trap("Internal compiler error: ", fmt, args);
 
 	printf("Internal Compiler Error:\nFile: %s | Line: %d\n  ", file, line);
 	vprintf(fmt, args);
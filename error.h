@@ -1,6 +1,8 @@
 #pragma once
 #include "common.h"
 
+#include <setjmp.h>
+
 void fatal(const char * fmt, ...);
 void fatal_line(u32 line, const char * fmt, ...);
 
@@ -10,3 +12,23 @@ void runtime_line(u32 line, const char * fmt, ...);
 void _internal_error(const char * fmt, char * file, int line, ...);
 
 #define internal_error(fmt, ...) _internal_error(fmt, __FILE__, __LINE__, ##__VA_ARGS__)
+
+/* Errors end the process unless the thread has set a trap. Then the
+ * message goes into the trap instead, the trap is removed, and
+ * control longjmps back to it. The setjmp has to happen in the
+ * caller's own frame:
+ *
+ *     Error_Trap trap;
+ *     if (setjmp(trap.jump)) { ...trap.message... }
+ *     error_trap_set(&trap);
+ *     ...
+ *     error_trap_clear(&trap);
+ */
+typedef struct Error_Trap {
+	jmp_buf jump;
+	char message[256];
+	struct Error_Trap * previous;
+} Error_Trap;
+
+void error_trap_set(Error_Trap * trap);
+void error_trap_clear(Error_Trap * trap);
@@ -0,0 +1,270 @@
+#include "fold.h"
+
+#include "peephole.h"
+#include "vm.h"
+
+static bool is_literal(Expression * expr, s64 value)
+{
+	return expr->type == EXPR_LITERAL && (s64) expr->literal.value == value;
+}
+
+// Whether evaluating expr can be skipped without changing behaviour
+static bool is_pure(Expression * expr)
+{
+	switch (expr->type) {
+	case EXPR_UNARY:
+		return is_pure(expr->unary.right);
+	case EXPR_BINARY:
+		// Division by zero is a runtime error, which can't be skipped
+		if ((expr->binary.type == OP_DIV || expr->binary.type == OP_MOD) &&
+			(expr->binary.right->type != EXPR_LITERAL || is_literal(expr->binary.right, 0))) {
+			return false;
+		}
+		return is_pure(expr->binary.left) && is_pure(expr->binary.right);
+	case EXPR_NAME:
+	case EXPR_LITERAL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Whether expr always evaluates to 0 or 1
+static bool is_boolean(Expression * expr)
+{
+	if (expr->type == EXPR_UNARY) {
+		return expr->unary.type == OP_LNEG;
+	} else if (expr->type == EXPR_BINARY) {
+		switch (expr->binary.type) {
+		case OP_EQ:
+		case OP_GT:
+		case OP_LT:
+		case OP_GTE:
+		case OP_LTE:
+			return true;
+		default:
+			return false;
+		}
+	}
+	return is_literal(expr, 0) || is_literal(expr, 1);
+}
+
+static Expression * make_literal(Arena * arena, s64 value, u32 line)
+{
+	Expression * expr = make_expr(arena, EXPR_LITERAL);
+	expr->literal.value = value;
+	expr->line = line;
+	return expr;
+}
+
+static s64 fold_binary(Operator_Type type, s64 x, s64 y)
+{
+	switch (type) {
+	case OP_ADD: return EVAL_ADD(x, y);
+	case OP_SUB: return EVAL_SUB(x, y);
+	case OP_MUL: return EVAL_MUL(x, y);
+	case OP_DIV: return EVAL_DIV(x, y);
+	case OP_MOD: return EVAL_MOD(x, y);
+	case OP_EQ:  return EVAL_EQ(x, y);
+	case OP_GT:  return EVAL_GT(x, y);
+	case OP_LT:  return EVAL_LT(x, y);
+	case OP_GTE: return EVAL_GTE(x, y);
+	case OP_LTE: return EVAL_LTE(x, y);
+	default:
+		internal_error("Folding non-binary operator %s", op_to_str[type]);
+		return 0;
+	}
+}
+
+Expression * fold_expression(Arena * arena, Expression * expr)
+{
+	switch (expr->type) {
+	case EXPR_UNARY: {
+		Expression * right = expr->unary.right = fold_expression(arena, expr->unary.right);
+		if (right->type == EXPR_LITERAL) {
+			s64 x = right->literal.value;
+			s64 value = expr->unary.type == OP_NEG ? EVAL_NEG(x) : EVAL_LNEG(x);
+			return make_literal(arena, value, expr->line);
+		}
+		if (right->type == EXPR_UNARY && right->unary.type == expr->unary.type) {
+			// -(-x) is x, and !!x is x once x is already 0 or 1
+			if (expr->unary.type == OP_NEG || is_boolean(right->unary.right)) {
+				return right->unary.right;
+			}
+		}
+	} break;
+	case EXPR_BINARY: {
+		Expression * left  = expr->binary.left  = fold_expression(arena, expr->binary.left);
+		Expression * right = expr->binary.right = fold_expression(arena, expr->binary.right);
+		Operator_Type type = expr->binary.type;
+		if (left->type == EXPR_LITERAL && right->type == EXPR_LITERAL) {
+			// Leave division by zero for the VM to report at runtime
+			if ((type == OP_DIV || type == OP_MOD) && is_literal(right, 0)) break;
+			return make_literal(arena, fold_binary(type, left->literal.value,
+					right->literal.value), expr->line);
+		}
+		switch (type) {
+		case OP_ADD:
+			if (is_literal(right, 0)) return left;
+			if (is_literal(left, 0))  return right;
+			break;
+		case OP_SUB:
+			if (is_literal(right, 0)) return left;
+			break;
+		case OP_MUL:
+			if (is_literal(right, 1)) return left;
+			if (is_literal(left, 1))  return right;
+			if ((is_literal(right, 0) && is_pure(left)) ||
+				(is_literal(left, 0) && is_pure(right))) {
+				return make_literal(arena, 0, expr->line);
+			}
+			break;
+		case OP_DIV:
+			if (is_literal(right, 1)) return left;
+			break;
+		default:
+			break;
+		}
+	} break;
+	case EXPR_INDEX:
+		expr->index.left  = fold_expression(arena, expr->index.left);
+		expr->index.right = fold_expression(arena, expr->index.right);
+		break;
+	case EXPR_FUNCALL:
+		for (int i = 0; i < sb_count(expr->funcall.args); i++) {
+			expr->funcall.args[i] = fold_expression(arena, expr->funcall.args[i]);
+		}
+		break;
+	default: // Names and literals are as folded as they get
+		break;
+	}
+	return expr;
+}
+
+// Only zero versus non-zero matters in a condition, so !!x is x
+static Expression * fold_condition(Arena * arena, Expression * expr)
+{
+	expr = fold_expression(arena, expr);
+	while (expr->type == EXPR_UNARY && expr->unary.type == OP_LNEG &&
+		expr->unary.right->type == EXPR_UNARY &&
+		expr->unary.right->unary.type == OP_LNEG) {
+		expr = expr->unary.right->unary.right;
+	}
+	return expr;
+}
+
+// Stands in for a statement that can never do anything
+static Statement * empty_scope(Arena * arena, Statement * stmt)
+{
+	Statement * scope = make_stmt(arena, STMT_SCOPE);
+	scope->line = stmt->line;
+	return scope;
+}
+
+Statement * fold_statement(Arena * arena, Statement * stmt)
+{
+	switch (stmt->type) {
+	case STMT_EXPR:
+		stmt->stmt_expr.expr = fold_expression(arena, stmt->stmt_expr.expr);
+		break;
+	case STMT_ASSIGN:
+		stmt->stmt_assign.right = fold_expression(arena, stmt->stmt_assign.right);
+		break;
+	case STMT_IF: {
+		// Drop arms that can never run, and turn the first arm that
+		// always runs into the else
+		Expression ** conditions = 0;
+		Statement ** scopes = 0;
+		Statement * else_scope = stmt->stmt_if.else_scope;
+		for (int i = 0; i < sb_count(stmt->stmt_if.conditions); i++) {
+			Expression * condition = fold_condition(arena, stmt->stmt_if.conditions[i]);
+			if (is_literal(condition, 0)) continue;
+			Statement * scope = fold_statement(arena, stmt->stmt_if.scopes[i]);
+			if (condition->type == EXPR_LITERAL) {
+				else_scope = scope;
+				break;
+			}
+			sb_push(conditions, condition);
+			sb_push(scopes, scope);
+		}
+		if (else_scope) {
+			else_scope = fold_statement(arena, else_scope);
+		}
+		arena_sb(arena, conditions);
+		arena_sb(arena, scopes);
+		if (sb_count(conditions) == 0) {
+			return else_scope ? else_scope : empty_scope(arena, stmt);
+		}
+		stmt->stmt_if.conditions = conditions;
+		stmt->stmt_if.scopes     = scopes;
+		stmt->stmt_if.else_scope = else_scope;
+	} break;
+	case STMT_WHILE:
+		// A literal non-zero condition is compiled as an unconditional loop
+		stmt->stmt_while.condition = fold_condition(arena, stmt->stmt_while.condition);
+		if (is_literal(stmt->stmt_while.condition, 0)) {
+			return empty_scope(arena, stmt);
+		}
+		stmt->stmt_while.scope = fold_statement(arena, stmt->stmt_while.scope);
+		break;
+	case STMT_RETURN:
+		stmt->stmt_return.expr = fold_expression(arena, stmt->stmt_return.expr);
+		break;
+	case STMT_SCOPE:
+		for (int i = 0; i < sb_count(stmt->stmt_scope.body); i++) {
+			stmt->stmt_scope.body[i] = fold_statement(arena, stmt->stmt_scope.body[i]);
+		}
+		break;
+	default: // Declarations have nothing to fold
+		break;
+	}
+	return stmt;
+}
+
+void fold_function(Arena * arena, Function * func)
+{
+	func->body = fold_statement(arena, func->body);
+}
+
+void fold(Compiler * compiler)
+{
+	Map * function_map = compiler->function_map;
+	int iter = -1;
+	while ((iter = map_iter(function_map, iter)) != -1) {
+		fold_function(&compiler->parser.arena, (Function*) function_map->slots[iter].value);
+	}
+}
+
+// Whether main's body, once folded and compiled, still divides
+static bool divides(const char * source)
+{
+	Compiler compiler;
+	compiler_init(&compiler, source);
+	prepare(&compiler);
+	fold(&compiler);
+	VM _vm;
+	VM * vm = &_vm;
+	vm_init(vm);
+	compile(&compiler, vm);
+	peephole(vm);
+	bool found = false;
+	for (int i = 0; i < sb_count(vm->insts); i++) {
+		Inst_Type type = vm->insts[i].type;
+		if ((type >= INST_DIV && type <= INST_DIV_LL) || (type >= INST_MOD && type <= INST_MOD_LL)) {
+			found = true;
+		}
+	}
+	vm_free(vm);
+	compiler_free(&compiler);
+	return found;
+}
+
+void fold_test()
+{
+	// Multiplying by zero may drop a division only if it can't fault
+	assert(divides("func main() { let a; let b; return (a / b) * 0; }"));
+	assert(divides("func main() { let a; let b; return 0 * (a % b); }"));
+	assert(divides("func main() { let a; return (a / 0) * 0; }"));
+	assert(!divides("func main() { let a; return (a / 2) * 0; }"));
+	assert(!divides("func main() { let a; return 0 * (a % 7); }"));
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "common.h"
+#include "compiler.h"
+#include "parser.h"
+
+/*
+ * Constant folding and algebraic simplification on the AST. Runs
+ * after prepare has tagged every name, and before compile.
+ */
+
+// Replacement nodes are allocated from the compiler's AST arena
+void fold(Compiler * compiler);
+void fold_function(Arena * arena, Function * func);
+Expression * fold_expression(Arena * arena, Expression * expr);
+Statement * fold_statement(Arena * arena, Statement * stmt);
+void fold_test();
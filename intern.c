@@ -1,22 +1,100 @@
 #include "intern.h"
 
-Str_Intern * str_interns;
+Intern_Table str_interns;
 
-const char * str_intern_range(const char * start, const char * end)
+static u64 intern_hash(const char * start, size_t len)
+{
+	// FNV-1a
+	u64 hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (u8) start[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static char * intern_alloc(Intern_Table * table, size_t size)
 {
+	Intern_Block * block = table->blocks;
+	if (!block || block->used + size > block->size) {
+		// Oversized strings get a block all to themselves
+		size_t block_size = size > INTERN_BLOCK_SIZE ? size : INTERN_BLOCK_SIZE;
+		block = malloc(sizeof(Intern_Block) + block_size);
+		block->used = 0;
+		block->size = block_size;
+		block->next = table->blocks;
+		table->blocks = block;
+	}
+	char * ptr = block->data + block->used;
+	block->used += size;
+	return ptr;
+}
+
+static void intern_grow(Intern_Table * table)
+{
+	size_t new_capacity = table->capacity ? table->capacity * 2 : 256;
+	Str_Intern * new_entries = calloc(new_capacity, sizeof(Str_Intern));
+	size_t mask = new_capacity - 1;
+	for (size_t i = 0; i < table->capacity; i++) {
+		Str_Intern it = table->entries[i];
+		if (!it.str) continue;
+		size_t position = it.hash & mask;
+		while (new_entries[position].str) {
+			position = (position + 1) & mask;
+		}
+		new_entries[position] = it;
+	}
+	free(table->entries);
+	table->entries  = new_entries;
+	table->capacity = new_capacity;
+}
+
+const char * intern_range(Intern_Table * table, const char * start, const char * end)
+{
+	// Keep load factor under 1/2
+	if (2 * (table->count + 1) > table->capacity) {
+		intern_grow(table);
+	}
 	size_t len = end - start;
-	for (int i = 0; i < sb_count(str_interns); i++) {
-		if (str_interns[i].len == len &&
-			strncmp(str_interns[i].str, start, len) == 0) {
-			return str_interns[i].str;
+	u64 hash = intern_hash(start, len);
+	size_t mask = table->capacity - 1;
+	size_t position = hash & mask;
+	while (table->entries[position].str) {
+		Str_Intern * it = &table->entries[position];
+		if (it->hash == hash && it->len == len &&
+			memcmp(it->str, start, len) == 0) {
+			return it->str;
 		}
+		position = (position + 1) & mask;
 	}
-	char * interned = malloc(len + 1);
-	strncpy(interned, start, len);
+	char * interned = intern_alloc(table, len + 1);
+	memcpy(interned, start, len);
 	interned[len] = '\0';
-	Str_Intern new_intern = {len, interned};
-	sb_push(str_interns, new_intern);
-	return new_intern.str;
+	table->entries[position] = (Str_Intern) {len, hash, interned};
+	table->count++;
+	return interned;
+}
+
+const char * intern_str(Intern_Table * table, const char * str)
+{
+	return intern_range(table, str, str + strlen(str));
+}
+
+void intern_table_free(Intern_Table * table)
+{
+	Intern_Block * block = table->blocks;
+	while (block) {
+		Intern_Block * next = block->next;
+		free(block);
+		block = next;
+	}
+	free(table->entries);
+	memset(table, 0, sizeof(Intern_Table));
+}
+
+const char * str_intern_range(const char * start, const char * end)
+{
+	return intern_range(&str_interns, start, end);
 }
 
 const char * str_intern(const char * str)
@@ -28,8 +106,50 @@ void str_intern_test()
 {
 	const char a[] = "asdf";
 	const char b[] = "asdf";
-	assert(a != b);
 	assert(str_intern(a) == str_intern(b));
 	const char c[] = "ASDF";
 	assert(str_intern(a) != str_intern(c));
+
+	// Force several resizes and make sure nothing moves
+	Intern_Table table = {0};
+	const char * first = intern_range(&table, a, a + 4);
+	char buf[32];
+	for (int i = 0; i < 10000; i++) {
+		int len = sprintf(buf, "name_%d", i);
+		intern_range(&table, buf, buf + len);
+	}
+	assert(table.count == 10001);
+	assert(intern_range(&table, b, b + 4) == first);
+	assert(strcmp(intern_range(&table, "name_42", "name_42" + 7), "name_42") == 0);
+	intern_table_free(&table);
+}
+
+void str_intern_bench(int count)
+{
+	// Lay out the synthetic names back to back so generating them
+	// doesn't count against the interner
+	char * names = malloc(count * 16);
+	int * lens = malloc(count * sizeof(int));
+	for (int i = 0; i < count; i++) {
+		lens[i] = sprintf(names + i * 16, "name_%d", i);
+	}
+
+	Intern_Table table = {0};
+	u64 start = time_ns();
+	for (int i = 0; i < count; i++) {
+		intern_range(&table, names + i * 16, names + i * 16 + lens[i]);
+	}
+	u64 insert_ns = time_ns() - start;
+	start = time_ns();
+	for (int i = 0; i < count; i++) {
+		intern_range(&table, names + i * 16, names + i * 16 + lens[i]);
+	}
+	u64 lookup_ns = time_ns() - start;
+
+	printf("str_intern: %d names, %.1f ns/insert, %.1f ns/lookup\n",
+		count, (double) insert_ns / count, (double) lookup_ns / count);
+
+	intern_table_free(&table);
+	free(names);
+	free(lens);
 }
@@ -1,15 +1,44 @@
 #pragma once
 #include "common.h"
 
+/*
+ * String interner. Entries live in an open-addressed table keyed on
+ * an FNV-1a hash of the string, and the interned bytes themselves
+ * are bump-allocated out of large blocks rather than malloc'd one at
+ * a time.
+ */
+
+#define INTERN_BLOCK_SIZE (64 * 1024)
+
 typedef struct Str_Intern {
 	size_t len;
-	const char * str;
+	u64 hash;
+	const char * str; // NULL marks an empty slot
 } Str_Intern;
 
-extern Str_Intern * str_interns;
+typedef struct Intern_Block {
+	struct Intern_Block * next;
+	size_t used;
+	size_t size;
+	char data[];
+} Intern_Block;
+
+typedef struct Intern_Table {
+	Str_Intern * entries;
+	size_t capacity; // Always a power of two
+	size_t count;
+	Intern_Block * blocks;
+} Intern_Table;
+
+extern Intern_Table str_interns;
+
+const char * intern_range(Intern_Table * table, const char * start, const char * end);
+const char * intern_str(Intern_Table * table, const char * str);
+void intern_table_free(Intern_Table * table);
 
 const char * str_intern_range(const char * start, const char * end);
 
 const char * str_intern(const char * str);
 
 void str_intern_test();
+void str_intern_bench(int count);
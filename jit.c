@@ -0,0 +1,965 @@
+// MAP_ANONYMOUS isn't part of POSIX
+#define _DEFAULT_SOURCE
+#include "jit.h"
+
+#include <sys/mman.h>
+
+#include "compiler.h"
+#include "fold.h"
+#include "peephole.h"
+
+#if JIT_SUPPORTED
+
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// Register roles in native code. rax holds the cached top of the op
+// stack, rcx, rdx and r11 are scratch.
+#define FRAME    RBX // Call stack slot fp indexes
+#define OP_TOP   R12 // Next free op stack slot
+#define CALL_TOP R13 // Next free call stack slot
+#define VM_REG   R14
+#define ENTRIES  R15
+
+// Condition codes, as used by jcc and setcc
+enum {
+	CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF,
+};
+
+// Upper bound on the code a single instruction's template emits
+#define MAX_TEMPLATE_SIZE 96
+
+static void emit8(Jit * jit, u8 byte)
+{
+	jit->code[jit->used++] = byte;
+}
+
+static void emit32(Jit * jit, u32 value)
+{
+	memcpy(jit->code + jit->used, &value, 4);
+	jit->used += 4;
+}
+
+static void emit64(Jit * jit, u64 value)
+{
+	memcpy(jit->code + jit->used, &value, 8);
+	jit->used += 8;
+}
+
+static bool fits32(s64 value)
+{
+	return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static void emit_rex(Jit * jit, int reg, int base)
+{
+	emit8(jit, 0x48 | ((reg >> 3) << 2) | (base >> 3));
+}
+
+// ModRM, and SIB where needed, addressing [base + disp]
+static void emit_mem(Jit * jit, int reg, int base, s32 disp)
+{
+	int mod = 2;
+	if (disp == 0 && (base & 7) != RBP) mod = 0;
+	else if (disp >= -128 && disp <= 127) mod = 1;
+	emit8(jit, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP) emit8(jit, 0x24);
+	if (mod == 1) emit8(jit, (u8) disp);
+	if (mod == 2) emit32(jit, disp);
+}
+
+// opcode reg, [base + disp], or the reverse for stores
+static void emit_mem_op(Jit * jit, u8 opcode, int reg, int base, s32 disp)
+{
+	emit_rex(jit, reg, base);
+	emit8(jit, opcode);
+	emit_mem(jit, reg, base, disp);
+}
+
+#define LOAD      0x8B
+#define STORE     0x89
+#define LEA       0x8D
+#define ADD_LOAD  0x03
+#define SUB_LOAD  0x2B
+
+// opcode dst, src for the "r/m, reg" forms below
+static void emit_rr(Jit * jit, u8 opcode, int dst, int src)
+{
+	emit_rex(jit, src, dst);
+	emit8(jit, opcode);
+	emit8(jit, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+#define ADD_RR  0x01
+#define SUB_RR  0x29
+#define CMP_RR  0x39
+#define TEST_RR 0x85
+#define MOV_RR  0x89
+
+// Group 1 arithmetic with an immediate, digit picks the operation
+static void emit_ri(Jit * jit, int digit, int dst, s32 imm)
+{
+	emit_rex(jit, 0, dst);
+	bool short_imm = imm >= -128 && imm <= 127;
+	emit8(jit, short_imm ? 0x83 : 0x81);
+	emit8(jit, 0xC0 | (digit << 3) | (dst & 7));
+	if (short_imm) emit8(jit, (u8) imm);
+	else emit32(jit, imm);
+}
+
+#define ADD_DIGIT 0
+#define SUB_DIGIT 5
+#define CMP_DIGIT 7
+
+static void emit_shift(Jit * jit, int digit, int reg, u8 count)
+{
+	emit_rex(jit, 0, reg);
+	emit8(jit, 0xC1);
+	emit8(jit, 0xC0 | (digit << 3) | (reg & 7));
+	emit8(jit, count);
+}
+
+#define SHL_DIGIT 4
+#define SHR_DIGIT 5
+
+// mov qword [base + disp], imm
+static void emit_store_imm(Jit * jit, int base, s32 disp, s32 imm)
+{
+	emit_rex(jit, 0, base);
+	emit8(jit, 0xC7);
+	emit_mem(jit, 0, base, disp);
+	emit32(jit, (u32) imm);
+}
+
+// reg = vm->call_stack + reg * 8, turning a call stack index into
+// the address of its slot
+static void emit_call_stack_address(Jit * jit, int reg)
+{
+	emit_shift(jit, SHL_DIGIT, reg, 3);
+	emit_mem_op(jit, ADD_LOAD, reg, VM_REG, offsetof(VM, call_stack));
+}
+
+// The reverse of emit_call_stack_address
+static void emit_call_stack_index(Jit * jit, int reg)
+{
+	emit_mem_op(jit, SUB_LOAD, reg, VM_REG, offsetof(VM, call_stack));
+	emit_shift(jit, SHR_DIGIT, reg, 3);
+}
+
+static void emit_mov_imm(Jit * jit, int dst, s64 imm)
+{
+	if (fits32(imm)) {
+		emit_rex(jit, 0, dst);
+		emit8(jit, 0xC7);
+		emit8(jit, 0xC0 | (dst & 7));
+		emit32(jit, (u32) imm);
+	} else {
+		emit_rex(jit, 0, dst);
+		emit8(jit, 0xB8 + (dst & 7));
+		emit64(jit, (u64) imm);
+	}
+}
+
+static void emit_push(Jit * jit, int reg)
+{
+	if (reg >= R8) emit8(jit, 0x41);
+	emit8(jit, 0x50 + (reg & 7));
+}
+
+static void emit_pop(Jit * jit, int reg)
+{
+	if (reg >= R8) emit8(jit, 0x41);
+	emit8(jit, 0x58 + (reg & 7));
+}
+
+// jmp or call through a register, digit 4 or 2
+static void emit_indirect(Jit * jit, int digit, int reg)
+{
+	if (reg >= R8) emit8(jit, 0x41);
+	emit8(jit, 0xFF);
+	emit8(jit, 0xC0 | (digit << 3) | (reg & 7));
+}
+
+static void emit_call(Jit * jit, void * function)
+{
+	emit_mov_imm(jit, R11, (s64) function);
+	emit_indirect(jit, 2, R11);
+}
+
+// rel32 from the end of a 4 byte field at pos to target
+static void patch_rel32(Jit * jit, size_t pos, size_t target)
+{
+	u32 rel = (u32) (s32) ((s64) target - (s64) (pos + 4));
+	memcpy(jit->code + pos, &rel, 4);
+}
+
+static void emit_jmp_to(Jit * jit, size_t target)
+{
+	emit8(jit, 0xE9);
+	emit32(jit, 0);
+	patch_rel32(jit, jit->used - 4, target);
+}
+
+static void emit_jcc_to(Jit * jit, int cc, size_t target)
+{
+	emit8(jit, 0x0F);
+	emit8(jit, 0x80 + cc);
+	emit32(jit, 0);
+	patch_rel32(jit, jit->used - 4, target);
+}
+
+// Short forward jump, patched by land8 once the target is reached
+static size_t jump8(Jit * jit, u8 opcode)
+{
+	emit8(jit, opcode);
+	emit8(jit, 0);
+	return jit->used - 1;
+}
+
+static void land8(Jit * jit, size_t pos)
+{
+	jit->code[pos] = (u8) (jit->used - (pos + 1));
+}
+
+#define JNE8 0x75
+#define JNZ8 0x75
+#define JMP8 0xEB
+
+static void emit_trampolines(Jit * jit)
+{
+	// u64 enter(VM * vm, void * code, void ** entries)
+	jit->enter = (u64 (*)(VM*, void*, void**)) (jit->code + jit->used);
+	// Five pushes leave the stack 16 byte aligned for helper calls
+	emit_push(jit, RBX);
+	emit_push(jit, R12);
+	emit_push(jit, R13);
+	emit_push(jit, R14);
+	emit_push(jit, R15);
+	emit_rr(jit, MOV_RR, VM_REG, RDI);
+	emit_rr(jit, MOV_RR, ENTRIES, RDX);
+	emit_mem_op(jit, LOAD, OP_TOP, VM_REG, offsetof(VM, op_sp));
+	emit_shift(jit, SHL_DIGIT, OP_TOP, 3);
+	emit_mem_op(jit, ADD_LOAD, OP_TOP, VM_REG, offsetof(VM, op_stack));
+	emit_mem_op(jit, LOAD, CALL_TOP, VM_REG, offsetof(VM, call_sp));
+	emit_call_stack_address(jit, CALL_TOP);
+	emit_mem_op(jit, LOAD, FRAME, VM_REG, offsetof(VM, fp));
+	emit_call_stack_address(jit, FRAME);
+	emit_indirect(jit, 4, RSI);
+
+	// Writes the stack and frame pointers back and returns rax
+	jit->exit = jit->code + jit->used;
+	emit_mem_op(jit, SUB_LOAD, OP_TOP, VM_REG, offsetof(VM, op_stack));
+	emit_shift(jit, SHR_DIGIT, OP_TOP, 3);
+	emit_mem_op(jit, STORE, OP_TOP, VM_REG, offsetof(VM, op_sp));
+	emit_call_stack_index(jit, CALL_TOP);
+	emit_mem_op(jit, STORE, CALL_TOP, VM_REG, offsetof(VM, call_sp));
+	emit_call_stack_index(jit, FRAME);
+	emit_mem_op(jit, STORE, FRAME, VM_REG, offsetof(VM, fp));
+	emit_pop(jit, R15);
+	emit_pop(jit, R14);
+	emit_pop(jit, R13);
+	emit_pop(jit, R12);
+	emit_pop(jit, RBX);
+	emit8(jit, 0xC3);
+}
+
+static void jit_print(s64 value)
+{
+	printf("%ld\n", value);
+}
+
+static void jit_division_by_zero()
+{
+	runtime("Division by zero");
+}
+
+/*
+ * Translation
+ */
+
+typedef struct Jump_Fixup {
+	size_t pos; // Of the rel32 field
+	u64 target;
+} Jump_Fixup;
+
+typedef struct Translation {
+	Jit * jit;
+	Inst * insts;
+	u64 start;
+	u64 end;
+	size_t * native;  // Code offset of each instruction, by ip - start
+	bool * targets;   // Reachable other than by falling in, by ip - start
+	Jump_Fixup * fixups;
+	bool cached;      // The op stack top is in rax rather than memory
+	bool failed;
+} Translation;
+
+static void flush(Translation * t)
+{
+	if (!t->cached) return;
+	emit_mem_op(t->jit, STORE, RAX, OP_TOP, 0);
+	emit_ri(t->jit, ADD_DIGIT, OP_TOP, 8);
+	t->cached = false;
+}
+
+// Pops the op stack top into rax
+static void pop_top(Translation * t)
+{
+	if (t->cached) {
+		t->cached = false;
+		return;
+	}
+	emit_ri(t->jit, SUB_DIGIT, OP_TOP, 8);
+	emit_mem_op(t->jit, LOAD, RAX, OP_TOP, 0);
+}
+
+// Compiled code never gets near these limits
+
+// For LOAD and SAVE, relative to CALL_TOP
+static s32 stack_disp(Translation * t, u64 offset)
+{
+	if (offset >= (1u << 28)) {
+		t->failed = true;
+		return 0;
+	}
+	return -(s32) (offset * sizeof(s64));
+}
+
+// Size of count call stack slots
+static s32 arg_disp(Translation * t, s64 count)
+{
+	if (count < 0 || count >= (1 << 28)) {
+		t->failed = true;
+		return 0;
+	}
+	return (s32) (count * (s64) sizeof(s64));
+}
+
+// For locals, relative to FRAME
+static s32 local_disp(Translation * t, s64 local)
+{
+	if (local <= -(1 << 28) || local >= (1 << 28)) {
+		t->failed = true;
+		return 0;
+	}
+	return (s32) (local * (s64) sizeof(s64));
+}
+
+// Leaves native code to resume at ip. The op stack must be flushed.
+static void emit_exit(Translation * t, u64 ip)
+{
+	emit_mov_imm(t->jit, RAX, ip);
+	emit_jmp_to(t->jit, t->jit->exit - t->jit->code);
+}
+
+// Continues at the ip in rax, natively if it has an entry
+static void emit_dispatch(Translation * t)
+{
+	Jit * jit = t->jit;
+	// mov rcx, [r15 + rax * 8]
+	emit8(jit, 0x49);
+	emit8(jit, 0x8B);
+	emit8(jit, 0x0C);
+	emit8(jit, 0xC7);
+	emit_rr(jit, TEST_RR, RCX, RCX);
+	emit_jcc_to(jit, CC_E, jit->exit - jit->code);
+	emit_indirect(jit, 4, RCX);
+}
+
+// Jumps to target if cc holds, or always if cc is -1. The op stack
+// must be flushed.
+static void emit_jump(Translation * t, int cc, u64 target)
+{
+	Jit * jit = t->jit;
+	if (target >= t->start && target < t->end) {
+		if (cc == -1) {
+			emit8(jit, 0xE9);
+		} else {
+			emit8(jit, 0x0F);
+			emit8(jit, 0x80 + cc);
+		}
+		emit32(jit, 0);
+		Jump_Fixup fixup = {jit->used - 4, target};
+		sb_push(t->fixups, fixup);
+	} else if (cc == -1) {
+		emit_exit(t, target);
+	} else {
+		size_t skip = jump8(jit, 0x70 + (cc ^ 1));
+		emit_exit(t, target);
+		land8(jit, skip);
+	}
+}
+
+/* Puts the left operand of a binary instruction in rax, and the right
+ * in rcx unless it's an immediate, which goes in *imm. Returns
+ * whether it's an immediate. The op stack is flushed afterwards.
+ */
+static bool fetch_operands(Translation * t, Inst * inst, Binary_Form form, s64 * imm)
+{
+	Jit * jit = t->jit;
+	bool is_imm = false;
+	switch (form) {
+	case BINARY_FORM_STACK:
+		pop_top(t);
+		emit_rr(jit, MOV_RR, RCX, RAX);
+		pop_top(t);
+		break;
+	case BINARY_FORM_I:
+		pop_top(t);
+		*imm = inst->arg1.literal;
+		is_imm = true;
+		break;
+	case BINARY_FORM_LI:
+		flush(t);
+		emit_mem_op(jit, LOAD, RAX, FRAME, local_disp(t, inst->arg0.local));
+		*imm = inst->arg1.literal;
+		is_imm = true;
+		break;
+	case BINARY_FORM_LL:
+		flush(t);
+		emit_mem_op(jit, LOAD, RAX, FRAME, local_disp(t, inst->arg0.local));
+		emit_mem_op(jit, LOAD, RCX, FRAME, local_disp(t, inst->arg1.local));
+		break;
+	}
+	if (is_imm && !fits32(*imm)) {
+		emit_mov_imm(jit, RCX, *imm);
+		is_imm = false;
+	}
+	return is_imm;
+}
+
+static int compare_cc(Operator_Type op)
+{
+	switch (op) {
+	case OP_EQ:  return CC_E;
+	case OP_GT:  return CC_G;
+	case OP_LT:  return CC_L;
+	case OP_GTE: return CC_GE;
+	case OP_LTE: return CC_LE;
+	default:
+		internal_error("Operator %s isn't a comparison", op_to_str[op]);
+		return CC_E;
+	}
+}
+
+// rax = rax / rcx or rax % rcx, with eval_div and eval_mod's semantics
+static void emit_divide(Jit * jit, bool modulo)
+{
+	emit_rr(jit, TEST_RR, RCX, RCX);
+	size_t nonzero = jump8(jit, JNZ8);
+	emit_call(jit, jit_division_by_zero);
+	land8(jit, nonzero);
+
+	// INT64_MIN / -1 traps, so -1 is done by hand
+	emit_ri(jit, CMP_DIGIT, RCX, -1);
+	size_t divide = jump8(jit, JNE8);
+	if (modulo) {
+		emit_rr(jit, 0x31, RAX, RAX); // xor
+	} else {
+		emit_rex(jit, 0, RAX); // neg rax
+		emit8(jit, 0xF7);
+		emit8(jit, 0xD8);
+	}
+	size_t done = jump8(jit, JMP8);
+	land8(jit, divide);
+	emit8(jit, 0x48); // cqo
+	emit8(jit, 0x99);
+	emit_rex(jit, 0, RCX); // idiv rcx
+	emit8(jit, 0xF7);
+	emit8(jit, 0xF9);
+	if (modulo) emit_rr(jit, MOV_RR, RAX, RDX);
+	land8(jit, done);
+}
+
+static void translate_binary(Translation * t, Inst * inst, Operator_Type op, Binary_Form form)
+{
+	Jit * jit = t->jit;
+	s64 imm;
+	bool is_imm = fetch_operands(t, inst, form, &imm);
+	switch (op) {
+	case OP_ADD:
+		if (is_imm) emit_ri(jit, ADD_DIGIT, RAX, imm);
+		else emit_rr(jit, ADD_RR, RAX, RCX);
+		break;
+	case OP_SUB:
+		if (is_imm) emit_ri(jit, SUB_DIGIT, RAX, imm);
+		else emit_rr(jit, SUB_RR, RAX, RCX);
+		break;
+	case OP_MUL:
+		emit8(jit, 0x48);
+		if (is_imm) { // imul rax, rax, imm32
+			emit8(jit, 0x69);
+			emit8(jit, 0xC0);
+			emit32(jit, (u32) imm);
+		} else {      // imul rax, rcx
+			emit8(jit, 0x0F);
+			emit8(jit, 0xAF);
+			emit8(jit, 0xC1);
+		}
+		break;
+	case OP_DIV:
+	case OP_MOD:
+		if (is_imm) emit_mov_imm(jit, RCX, imm);
+		emit_divide(jit, op == OP_MOD);
+		break;
+	default:
+		if (is_imm) emit_ri(jit, CMP_DIGIT, RAX, imm);
+		else emit_rr(jit, CMP_RR, RAX, RCX);
+		emit8(jit, 0x0F); // setcc al
+		emit8(jit, 0x90 + compare_cc(op));
+		emit8(jit, 0xC0);
+		emit8(jit, 0x0F); // movzx eax, al
+		emit8(jit, 0xB6);
+		emit8(jit, 0xC0);
+		break;
+	}
+	t->cached = true;
+}
+
+static void translate_compare_jump(Translation * t, Inst * inst, Operator_Type op, Binary_Form form)
+{
+	s64 imm;
+	if (fetch_operands(t, inst, form, &imm)) emit_ri(t->jit, CMP_DIGIT, RAX, imm);
+	else emit_rr(t->jit, CMP_RR, RAX, RCX);
+	emit_jump(t, compare_cc(op) ^ 1, inst->arg2.jmp_ip);
+}
+
+// Frames up to this size are zeroed with a store per local
+#define ENTER_UNROLL 6
+
+static void translate_enter(Translation * t, s64 locals)
+{
+	Jit * jit = t->jit;
+	if (locals < 0 || locals >= (1 << 28)) {
+		t->failed = true;
+		return;
+	}
+	// Saved as an index, since the interpreter may be the one to
+	// restore it
+	emit_rr(jit, MOV_RR, RCX, FRAME);
+	emit_call_stack_index(jit, RCX);
+	emit_mem_op(jit, STORE, RCX, CALL_TOP, 0);
+	emit_ri(jit, ADD_DIGIT, CALL_TOP, 8);
+	emit_rr(jit, MOV_RR, FRAME, CALL_TOP);
+	if (locals <= ENTER_UNROLL) {
+		for (s64 i = 0; i < locals; i++) {
+			emit_store_imm(jit, CALL_TOP, i * 8, 0);
+		}
+		if (locals) emit_ri(jit, ADD_DIGIT, CALL_TOP, locals * 8);
+	} else {
+		emit_mov_imm(jit, RCX, locals);
+		size_t loop = jit->used;
+		emit_store_imm(jit, CALL_TOP, 0, 0);
+		emit_ri(jit, ADD_DIGIT, CALL_TOP, 8);
+		emit_rex(jit, 0, RCX); // dec rcx
+		emit8(jit, 0xFF);
+		emit8(jit, 0xC9);
+		emit8(jit, JNZ8);
+		emit8(jit, (u8) (loop - (jit->used + 1)));
+	}
+}
+
+// Calls with up to this many arguments move them with a load and
+// store each
+#define CALL_UNROLL 4
+
+static void translate_call(Translation * t, u64 ip, u64 target, s64 argc)
+{
+	Jit * jit = t->jit;
+	s32 size = arg_disp(t, argc);
+	flush(t);
+	emit_ri(jit, SUB_DIGIT, OP_TOP, size);
+	if (argc <= CALL_UNROLL) {
+		for (s64 i = 0; i < argc; i++) {
+			emit_mem_op(jit, LOAD, RCX, OP_TOP, i * 8);
+			emit_mem_op(jit, STORE, RCX, CALL_TOP, i * 8);
+		}
+		emit_ri(jit, ADD_DIGIT, CALL_TOP, size);
+	} else {
+		emit_mov_imm(jit, RCX, argc);
+		size_t loop = jit->used;
+		emit_mem_op(jit, LOAD, RDX, OP_TOP, 0);
+		emit_mem_op(jit, STORE, RDX, CALL_TOP, 0);
+		emit_ri(jit, ADD_DIGIT, OP_TOP, 8);
+		emit_ri(jit, ADD_DIGIT, CALL_TOP, 8);
+		emit_rex(jit, 0, RCX); // dec rcx
+		emit8(jit, 0xFF);
+		emit8(jit, 0xC9);
+		emit8(jit, JNZ8);
+		emit8(jit, (u8) (loop - (jit->used + 1)));
+		emit_ri(jit, SUB_DIGIT, OP_TOP, size);
+	}
+	emit_mov_imm(jit, RCX, ip + 1);
+	emit_mem_op(jit, STORE, RCX, CALL_TOP, 0);
+	emit_ri(jit, ADD_DIGIT, CALL_TOP, 8);
+	emit_mov_imm(jit, RAX, target);
+	emit_dispatch(t);
+}
+
+static void translate_inst(Translation * t, u64 ip)
+{
+	Jit * jit = t->jit;
+	Inst * inst = &t->insts[ip];
+	switch (inst->type) {
+	case INST_NOP:
+	case INST_SYMBOL:
+		break;
+	case INST_NEG:
+		pop_top(t);
+		emit_rex(jit, 0, RAX);
+		emit8(jit, 0xF7);
+		emit8(jit, 0xD8);
+		t->cached = true;
+		break;
+	case INST_LNEG:
+		pop_top(t);
+		emit_rr(jit, TEST_RR, RAX, RAX);
+		emit8(jit, 0x0F); // sete al
+		emit8(jit, 0x90 + CC_E);
+		emit8(jit, 0xC0);
+		emit8(jit, 0x0F); // movzx eax, al
+		emit8(jit, 0xB6);
+		emit8(jit, 0xC0);
+		t->cached = true;
+		break;
+	#define BINARY_CASES(name, op)                                         \
+	case INST_##name:                                                      \
+	case INST_##name##_I:                                                  \
+	case INST_##name##_LI:                                                 \
+	case INST_##name##_LL:                                                 \
+		translate_binary(t, inst, OP_##name, inst->type - INST_##name);    \
+		break;
+	BINARY_INSTS(BINARY_CASES)
+	#undef BINARY_CASES
+	case INST_PUSHC:
+		emit_mov_imm(jit, RCX, inst->arg0.literal);
+		emit_mem_op(jit, STORE, RCX, CALL_TOP, 0);
+		emit_ri(jit, ADD_DIGIT, CALL_TOP, 8);
+		break;
+	case INST_POPC:
+		emit_ri(jit, SUB_DIGIT, CALL_TOP, 8);
+		break;
+	case INST_PUSHO:
+		flush(t);
+		emit_mov_imm(jit, RAX, inst->arg0.literal);
+		t->cached = true;
+		break;
+	case INST_POPO:
+		if (t->cached) t->cached = false;
+		else emit_ri(jit, SUB_DIGIT, OP_TOP, 8);
+		break;
+	case INST_LOAD:
+		flush(t);
+		emit_mem_op(jit, LOAD, RAX, CALL_TOP, stack_disp(t, inst->arg0.offset));
+		t->cached = true;
+		break;
+	case INST_SAVE:
+		pop_top(t);
+		emit_mem_op(jit, STORE, RAX, CALL_TOP, stack_disp(t, inst->arg0.offset));
+		break;
+	case INST_LOADL:
+		flush(t);
+		emit_mem_op(jit, LOAD, RAX, FRAME, local_disp(t, inst->arg0.local));
+		t->cached = true;
+		break;
+	case INST_STOREL:
+		pop_top(t);
+		emit_mem_op(jit, STORE, RAX, FRAME, local_disp(t, inst->arg0.local));
+		break;
+	case INST_ENTER:
+		translate_enter(t, inst->arg0.literal);
+		break;
+	case INST_CALL:
+		translate_call(t, ip, inst->arg0.jmp_ip, inst->arg1.literal);
+		break;
+	case INST_RET:
+		// The saved fp sits just below the locals, and the return ip
+		// and arguments below that
+		flush(t);
+		emit_mem_op(jit, LEA, CALL_TOP, FRAME, -8);
+		emit_mem_op(jit, LOAD, RAX, CALL_TOP, -8);
+		emit_mem_op(jit, LOAD, FRAME, CALL_TOP, 0);
+		emit_call_stack_address(jit, FRAME);
+		emit_mem_op(jit, LEA, CALL_TOP, CALL_TOP, -arg_disp(t, inst->arg0.literal + 1));
+		emit_dispatch(t);
+		break;
+	case INST_JMP:
+		flush(t);
+		emit_jump(t, -1, inst->arg0.jmp_ip);
+		break;
+	case INST_JZ:
+	case INST_JNZ:
+		pop_top(t);
+		emit_rr(jit, TEST_RR, RAX, RAX);
+		emit_jump(t, inst->type == INST_JZ ? CC_E : CC_NE, inst->arg0.jmp_ip);
+		break;
+	case INST_JIP:
+		pop_top(t);
+		emit_dispatch(t);
+		break;
+	case INST_JSIP:
+		flush(t);
+		emit_mov_imm(jit, RCX, ip + 1);
+		emit_mem_op(jit, STORE, RCX, CALL_TOP, 0);
+		emit_ri(jit, ADD_DIGIT, CALL_TOP, 8);
+		emit_mov_imm(jit, RAX, inst->arg0.jmp_ip);
+		emit_dispatch(t);
+		break;
+	#define COMPARE_JUMP_CASES(name, op)                                          \
+	case INST_JZ_##name:                                                          \
+	case INST_JZ_##name##_I:                                                      \
+	case INST_JZ_##name##_LI:                                                     \
+	case INST_JZ_##name##_LL:                                                     \
+		translate_compare_jump(t, inst, OP_##name, inst->type - INST_JZ_##name);  \
+		break;
+	COMPARE_INSTS(COMPARE_JUMP_CASES)
+	#undef COMPARE_JUMP_CASES
+	case INST_PRINT:
+		flush(t);
+		emit_mem_op(jit, LOAD, RDI, OP_TOP, -8);
+		emit_call(jit, jit_print);
+		break;
+	default:
+		// Left to the interpreter
+		flush(t);
+		emit_exit(t, ip);
+		break;
+	}
+}
+
+// Returns the native entry for the function starting at start, or
+// NULL if it can't be translated
+static void * translate_function(Jit * jit, VM * vm, u64 start)
+{
+	u64 end = jit->function_end[start];
+	u64 count = end - start;
+	if (jit->used + (count + 2) * MAX_TEMPLATE_SIZE > JIT_CODE_SIZE) return NULL;
+
+	Translation _t = {0};
+	Translation * t = &_t;
+	t->jit = jit;
+	t->insts = vm->insts;
+	t->start = start;
+	t->end = end;
+	t->native = malloc(count * sizeof(size_t));
+	t->targets = calloc(count, sizeof(bool));
+	t->targets[0] = true;
+	for (u64 ip = start; ip < end; ip++) {
+		u64 * target = inst_jump_target(&vm->insts[ip]);
+		if (target && *target >= start && *target < end) {
+			t->targets[*target - start] = true;
+		}
+		Inst_Type type = vm->insts[ip].type;
+		if ((type == INST_JSIP || type == INST_CALL) && ip + 1 < end) {
+			t->targets[ip + 1 - start] = true; // Return site
+		}
+	}
+
+	size_t code_start = jit->used;
+	mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE);
+	for (u64 ip = start; ip < end; ip++) {
+		if (t->targets[ip - start]) flush(t);
+		t->native[ip - start] = jit->used;
+		translate_inst(t, ip);
+	}
+	flush(t);
+	emit_exit(t, end);
+	for (int i = 0; i < sb_count(t->fixups); i++) {
+		patch_rel32(jit, t->fixups[i].pos, t->native[t->fixups[i].target - start]);
+	}
+	mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+
+	void * entry = NULL;
+	if (t->failed) {
+		jit->used = code_start;
+	} else {
+		entry = jit->entries[start] = jit->code + t->native[0];
+		for (u64 ip = start + 1; ip < end; ip++) {
+			Inst_Type type = vm->insts[ip - 1].type;
+			if (type == INST_JSIP || type == INST_CALL) {
+				jit->entries[ip] = jit->code + t->native[ip - start];
+			}
+		}
+		jit->compiled++;
+	}
+
+	free(t->native);
+	free(t->targets);
+	sb_free(t->fixups);
+	return entry;
+}
+
+bool jit_attach(VM * vm, u32 threshold)
+{
+	u8 * code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (code == MAP_FAILED) return false;
+
+	u64 count = sb_count(vm->insts);
+	Jit * jit = calloc(1, sizeof(Jit));
+	jit->code = code;
+	jit->threshold = threshold;
+	jit->entries = calloc(count + 1, sizeof(void*));
+	jit->function_end = vm_function_ends(vm);
+	jit->calls = calloc(count + 1, sizeof(u32));
+
+	emit_trampolines(jit);
+	mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+	vm->jit = jit;
+	return true;
+}
+
+void jit_free(Jit * jit)
+{
+	munmap(jit->code, JIT_CODE_SIZE);
+	free(jit->entries);
+	free(jit->function_end);
+	free(jit->calls);
+	free(jit);
+}
+
+void jit_enter(VM * vm)
+{
+	Jit * jit = vm->jit;
+	while (1) {
+		u64 ip = vm->ip;
+		void * code = jit->entries[ip];
+		if (!code) {
+			if (!jit->function_end[ip] || ++jit->calls[ip] != jit->threshold) return;
+			code = translate_function(jit, vm, ip);
+			if (!code) return;
+		}
+		vm->ip = jit->enter(vm, code, jit->entries);
+	}
+}
+
+#else
+
+bool jit_attach(VM * vm, u32 threshold)
+{
+	return false;
+}
+
+void jit_free(Jit * jit)
+{
+}
+
+void jit_enter(VM * vm)
+{
+}
+
+#endif
+
+static s64 run_program(const char * source, bool optimize, u32 threshold, size_t stack_limit, int * compiled)
+{
+	Compiler compiler;
+	compiler_init(&compiler, source);
+	prepare(&compiler);
+	if (optimize) fold(&compiler);
+	VM _vm;
+	VM * vm = &_vm;
+	vm_init_stacks(vm, VM_STACK_INITIAL, stack_limit);
+	compile(&compiler, vm);
+	if (optimize) peephole(vm);
+	else strip_symbols(vm);
+	finish_compilation(&compiler);
+	if (threshold) assert(jit_attach(vm, threshold));
+	vm_run(vm);
+	s64 result = vm->op_stack[vm->op_sp - 1];
+	*compiled = vm->jit ? vm->jit->compiled : 0;
+	vm_free(vm);
+	compiler_free(&compiler);
+	return result;
+}
+
+static const char * jit_tests[] = {
+	"func fib(n) { if n < 2 { return n; } return fib(n - 1) + fib(n - 2); }\n"
+	"func main() { return fib(20); }",
+
+	"func f(n) { let i; let s; while i < n { if (i % 3) == 0 { set s = s + i / 2; } "
+	"elif (i % 3) == 1 { set s = s - (i % 7); } else { set s = s * 3 - 1; } set i = i + 1; } return s; }\n"
+	"func main() { let k; let t; while k < 5 { set t = t + f(100 + k); set k = k + 1; } return t; }",
+
+	"func g(a, b) { return (a / b) * 1000 + (a % b); }\n"
+	"func main() { return g(-17, 5) + g(17, -5) * 3 + g(7, -1) * 5 + g(-8, -1) * 7 + g(0 - 8, 3); }",
+
+	"func c(a, b) { return (a == b) + (a > b) * 2 + (a < b) * 4 + (a >= b) * 8 + (a <= b) * 16 "
+	"+ !a * 32 + -b * 64; }\n"
+	"func main() { return c(1, 2) + c(2, 2) * 3 + c(3, 2) * 5 + c(0, -1) * 7; }",
+
+	"func h(x) { return x * 3000000000 + 5000000000; }\n"
+	"func main() { let a; set a = h(2); return h(a) - a / 3000000000; }",
+
+	"func d(n) { if n == 0 { return 0; } return d(n - 1) + 1; }\n"
+	"func main() { return d(50000); }",
+
+	"func pick(n) { if n < 10 { return 1; } elif n < 100 { return 2; } else { return 3; } }\n"
+	"func main() { return pick(5) * 100 + pick(50) * 10 + pick(500); }",
+
+	// More locals than ENTER_UNROLL
+	"func w(n) { let a; let b; let c; let d; let e; let f; let g; let h; set a = a + n; "
+	"set b = a + 1; set c = b * 2; set d = c - a; set e = d + b; set f = e * e; set g = f % 97; "
+	"set h = g + n; return h; }\n"
+	"func main() { let k; let s; while k < 20 { set s = s + w(k); set k = k + 1; } return s; }",
+
+	// More arguments than CALL_UNROLL, which have to stay in order
+	"func m(a, b, c, d, e, f) { return a * 100000 + b * 10000 + c * 1000 + d * 100 + e * 10 + f; }\n"
+	"func main() { let k; let s; while k < 20 { set s = s + m(k, 2, 3, k % 4, 5, 6); set k = k + 1; } "
+	"return s + m(1, 2, 3, 4, 5, 6) * 1000; }",
+};
+
+void jit_test()
+{
+	if (!JIT_SUPPORTED) return;
+	int count = sizeof(jit_tests) / sizeof(jit_tests[0]);
+	for (int i = 0; i < count; i++) {
+		for (int optimize = 0; optimize <= 1; optimize++) {
+			int compiled;
+			s64 expected = run_program(jit_tests[i], optimize, 0, VM_STACK_LIMIT, &compiled);
+			assert(run_program(jit_tests[i], optimize, 1, VM_STACK_LIMIT, &compiled) == expected);
+			assert(compiled > 0);
+			assert(run_program(jit_tests[i], optimize, 3, VM_STACK_LIMIT, &compiled) == expected);
+		}
+	}
+
+	// Returns from native code have to leave the caller's frame as
+	// they found it, or a loop of calls runs out of stack
+	const char * many_calls =
+		"func f(n, m) { return n + m; }\n"
+		"func main() { let k; let s; while k < 300000 { set s = s + f(k, 1); set k = k + 1; } return s; }";
+	for (int optimize = 0; optimize <= 1; optimize++) {
+		int compiled;
+		assert(run_program(many_calls, optimize, 1, VM_STACK_INITIAL, &compiled) == 45000150000);
+		assert(compiled == 2);
+	}
+}
+
+static void jit_bench_program(const char * name, const char * source)
+{
+	u64 start = time_ns();
+	int compiled;
+	s64 interpreted = run_program(source, true, 0, VM_STACK_LIMIT, &compiled);
+	u64 interpreted_ns = time_ns() - start;
+	start = time_ns();
+	s64 jitted = run_program(source, true, JIT_THRESHOLD, VM_STACK_LIMIT, &compiled);
+	u64 jit_ns = time_ns() - start;
+	assert(interpreted == jitted);
+	printf("jit %s: interpreted %.1f ms, jit %.1f ms (%d functions compiled)\n",
+		name, interpreted_ns / 1e6, jit_ns / 1e6, compiled);
+}
+
+void jit_bench()
+{
+	if (!JIT_SUPPORTED) {
+		printf("jit: not supported on this machine\n");
+		return;
+	}
+	jit_bench_program("fib",
+		"func fib(n) { if n < 2 { return n; } return fib(n - 1) + fib(n - 2); }\n"
+		"func main() { return fib(27); }");
+	jit_bench_program("loop",
+		"func kernel(n) { let i; let s; while i < n { set s = s + (i * i) % 7; set i = i + 1; } return s; }\n"
+		"func main() { let k; let t; while k < 200 { set t = t + kernel(100000); set k = k + 1; } return t; }");
+}
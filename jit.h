@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Baseline JIT for the stack VM
+ *
+ * Once a function has been called threshold times, its instructions
+ * are translated one at a time into fixed x86-64 templates in an
+ * executable buffer. Native code keeps using the VM's stacks: r12
+ * and r13 point at the next free op and call stack slots, and the
+ * top of the op stack stays in rax between instructions until
+ * something needs it in memory.
+ *
+ * Calls and returns remain VM jumps, so native code never grows the
+ * C stack. Each one looks its target up in entries and leaves native
+ * code if the target has none. vm_run then interprets from there,
+ * counting calls, until a later call or return lands on native code.
+ * Instructions without a template (only HALT) also hand control back
+ * to the interpreter.
+ */
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_SUPPORTED true
+#else
+#define JIT_SUPPORTED false
+#endif
+
+#define JIT_THRESHOLD 100
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+
+typedef struct Jit {
+	u8 * code; // Writable only while translating
+	size_t used;
+	void ** entries;    // Native code for each ip that has any
+	u64 * function_end; // Indexed by function entry ip, 0 elsewhere
+	u32 * calls;        // Indexed by function entry ip
+	u32 threshold;
+	int compiled;       // Functions translated so far
+
+	// Trampolines at the start of code
+	u64 (*enter)(VM * vm, void * code, void ** entries);
+	u8 * exit; // Jumped to with the ip to resume at in rax
+} Jit;
+
+// Starts counting calls to vm's functions, which must all be loaded,
+// with their symbols. Returns false if there's no JIT for this
+// machine, leaving vm to interpret everything.
+bool jit_attach(VM * vm, u32 threshold);
+void jit_free(Jit * jit);
+// vm_run calls this whenever a call or return has just set vm->ip
+void jit_enter(VM * vm);
+
+void jit_test();
+void jit_bench();
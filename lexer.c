@@ -1,5 +1,7 @@
 #include "lexer.h"
 
+#include <pthread.h>
+
 void token_type_str(char * buf, Token_Type type)
 {
 	if (type >= 0 && type < 128) {
@@ -60,126 +62,321 @@ void print_token(Token token)
 	}
 }
 
-Token token;
-u32 current_line = 0;
-const char * stream;
+/* Character classes, looked up instead of calling the locale-aware
+ * ctype functions on every character.
+ */
+enum {
+	CHAR_DIGIT = 1 << 0,
+	CHAR_ALPHA = 1 << 1, // Letters and '_'
+	CHAR_SPACE = 1 << 2,
+};
+static u8 char_class[256];
+
+#define is_digit(c) (char_class[(u8) (c)] & CHAR_DIGIT)
+#define is_alpha(c) (char_class[(u8) (c)] & CHAR_ALPHA)
+#define is_alnum(c) (char_class[(u8) (c)] & (CHAR_ALPHA | CHAR_DIGIT))
+#define is_space(c) (char_class[(u8) (c)] & CHAR_SPACE)
+
+/* Keywords are found with a perfect hash on their first and last
+ * characters and length. Each slot holds at most one keyword, so
+ * one comparison decides whether a name is a keyword.
+ */
+typedef struct Keyword {
+	const char * str;
+	size_t len;
+	Token_Type type;
+} Keyword;
+
+#define KEYWORD_SLOTS 16
+#define keyword_hash(start, len) \
+	(((u8) (start)[0] + (u8) (start)[(len) - 1] * 8 + (len)) & (KEYWORD_SLOTS - 1))
 
-Map * keyword_map;
+static Keyword keywords[KEYWORD_SLOTS];
+
+static void add_keyword(const char * str, Token_Type type)
+{
+	size_t len = strlen(str);
+	Keyword * keyword = &keywords[keyword_hash(str, len)];
+	if (keyword->str)
+		internal_error("Keywords %s and %s hash to the same slot", keyword->str, str);
+	keyword->str  = str;
+	keyword->len  = len;
+	keyword->type = type;
+}
+
+static void build_tables()
+{
+	for (int c = '0'; c <= '9'; c++) char_class[c] |= CHAR_DIGIT;
+	for (int c = 'a'; c <= 'z'; c++) char_class[c] |= CHAR_ALPHA;
+	for (int c = 'A'; c <= 'Z'; c++) char_class[c] |= CHAR_ALPHA;
+	char_class['_']  |= CHAR_ALPHA;
+	char_class[' ']  |= CHAR_SPACE;
+	char_class['\t'] |= CHAR_SPACE;
+	char_class['\n'] |= CHAR_SPACE;
+
+	add_keyword("let",    TOKEN_LET);
+	add_keyword("set",    TOKEN_SET);
+	add_keyword("while",  TOKEN_WHILE);
+	add_keyword("if",     TOKEN_IF);
+	add_keyword("elif",   TOKEN_ELIF);
+	add_keyword("else",   TOKEN_ELSE);
+	add_keyword("func",   TOKEN_FUNC);
+	add_keyword("return", TOKEN_RETURN);
+}
 
 void lex_init()
 {
-	keyword_map = make_map(16);
-
-	map_insert(keyword_map, (u64) str_intern("let"),     (u64) TOKEN_LET);
-	map_insert(keyword_map, (u64) str_intern("set"),     (u64) TOKEN_SET);
-	map_insert(keyword_map, (u64) str_intern("while"),   (u64) TOKEN_WHILE);
-	map_insert(keyword_map, (u64) str_intern("if"),      (u64) TOKEN_IF);
-	map_insert(keyword_map, (u64) str_intern("elif"),    (u64) TOKEN_ELIF);
-	map_insert(keyword_map, (u64) str_intern("else"),    (u64) TOKEN_ELSE);
-	map_insert(keyword_map, (u64) str_intern("func"),    (u64) TOKEN_FUNC);
-	map_insert(keyword_map, (u64) str_intern("return"),  (u64) TOKEN_RETURN);
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, build_tables);
+}
+
+void lexer_init(Lexer * lex, Intern_Table * interns)
+{
+	memset(lex, 0, sizeof(Lexer));
+	lex->interns = interns;
+	lex->batch = true;
 }
 
-void init_stream(const char * source)
+void lexer_free(Lexer * lex)
 {
-	stream = source;
-	current_line = 0;
-	next_token();
+	free_token_stream(&lex->tokens);
 }
 
-void _next_token()
+static void load_token(Lexer * lex, int index)
 {
-	token.line = current_line;
-	token.source_start = stream;
-	if (isdigit(*stream)) {
-		token.type = TOKEN_LITERAL;
+	Token_Stream * tokens = &lex->tokens;
+	lex->index = index;
+	lex->token.type         = tokens->types[index];
+	lex->token.line         = tokens->lines[index];
+	lex->token.source_start = tokens->source + tokens->starts[index];
+	lex->token.source_end   = tokens->source + tokens->ends[index];
+	lex->token.name         = tokens->values[index].name;
+}
+
+void init_stream(Lexer * lex, const char * source)
+{
+	if (lex->batch) {
+		Token_Stream tokens;
+		lex_tokens(lex, source, &tokens);
+		free_token_stream(&lex->tokens);
+		lex->tokens = tokens;
+		load_token(lex, 0);
+		return;
+	}
+	lex->stream = source;
+	lex->current_line = 0;
+	next_token(lex);
+}
+
+/* The SSE2 paths classify 16 bytes at a time. They may read past the
+ * terminating NUL, but never across a page boundary, so they can't
+ * fault. The NUL itself is in no class, which stops both scans.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+#define SIMD_WIDTH 16
+#define simd_safe(p) (((uintptr_t) (p) & 4095) <= 4096 - SIMD_WIDTH)
+
+// Mask of the bytes in chunk that lie within [lo, hi]
+static inline int simd_range_mask(__m128i chunk, char lo, char hi)
+{
+	__m128i above = _mm_cmpgt_epi8(chunk, _mm_set1_epi8(lo - 1));
+	__m128i below = _mm_cmplt_epi8(chunk, _mm_set1_epi8(hi + 1));
+	return _mm_movemask_epi8(_mm_and_si128(above, below));
+}
+#endif
+
+static const char * skip_space(const char * p, u32 * line)
+{
+	#if defined(__SSE2__)
+	while (simd_safe(p)) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*) p);
+		int newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+		int spaces = newlines |
+			_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' '))) |
+			_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')));
+		if (spaces == 0xFFFF) {
+			*line += __builtin_popcount(newlines);
+			p += SIMD_WIDTH;
+			continue;
+		}
+		int run = __builtin_ctz(~spaces);
+		*line += __builtin_popcount(newlines & ((1 << run) - 1));
+		return p + run;
+	}
+	#endif
+	while (is_space(*p)) {
+		if (*p == '\n') (*line)++;
+		p++;
+	}
+	return p;
+}
+
+static const char * skip_alnum(const char * p)
+{
+	#if defined(__SSE2__)
+	while (simd_safe(p)) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*) p);
+		int alnum =
+			simd_range_mask(chunk, 'a', 'z') |
+			simd_range_mask(chunk, 'A', 'Z') |
+			simd_range_mask(chunk, '0', '9') |
+			_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+		if (alnum != 0xFFFF) return p + __builtin_ctz(~alnum);
+		p += SIMD_WIDTH;
+	}
+	#endif
+	while (is_alnum(*p)) p++;
+	return p;
+}
+
+static void _next_token(Lexer * lex)
+{
+	lex->stream = skip_space(lex->stream, &lex->current_line);
+	lex->token.line = lex->current_line;
+	lex->token.source_start = lex->stream;
+	if (is_digit(*lex->stream)) {
+		lex->token.type = TOKEN_LITERAL;
 		int val = 0;
-		while (isdigit(*stream)) {
+		while (is_digit(*lex->stream)) {
 			val *= 10;
-			val += *stream - '0';
-			stream++;
-		}
-		token.literal = val;
-	} else if (isalpha(*stream) || *stream == '_') {
-		token.type = TOKEN_NAME;
-		while (isalpha(*stream) || isdigit(*stream) || *stream == '_') {
-			stream++;
+			val += *lex->stream - '0';
+			lex->stream++;
 		}
-		token.name = str_intern_range(token.source_start, stream);
-		if (map_index(keyword_map, (u64) token.name, NULL)) {
-			map_index(keyword_map, (u64) token.name, (u64*) &token.type);
+		lex->token.literal = val;
+	} else if (is_alpha(*lex->stream)) {
+		lex->stream = skip_alnum(lex->stream + 1);
+		size_t len = lex->stream - lex->token.source_start;
+		Keyword * keyword = &keywords[keyword_hash(lex->token.source_start, len)];
+		if (keyword->len == len && memcmp(keyword->str, lex->token.source_start, len) == 0) {
+			lex->token.type = keyword->type;
+			lex->token.name = keyword->str;
+		} else {
+			lex->token.type = TOKEN_NAME;
+			lex->token.name = intern_range(lex->interns, lex->token.source_start, lex->stream);
 		}
 	} else {
-		switch (*stream) {
-		case ' ':
-		case '\t':
-		case '\n':
-			if (*stream == '\n') {
-				current_line++;
-			}
-			stream++;
-			_next_token();
-			break;
+		switch (*lex->stream) {
 		case '>':
-			stream++;
-			if (*stream == '=') {
-				stream++;
-				token.type = TOKEN_GTE;
+			lex->stream++;
+			if (*lex->stream == '=') {
+				lex->stream++;
+				lex->token.type = TOKEN_GTE;
 			} else {
-				token.type = '>';
+				lex->token.type = '>';
 			}
 			break;
 		case '<':
-			stream++;
-			if (*stream == '=') {
-				stream++;
-				token.type = TOKEN_LTE;
+			lex->stream++;
+			if (*lex->stream == '=') {
+				lex->stream++;
+				lex->token.type = TOKEN_LTE;
 			} else {
-				token.type = '<';
+				lex->token.type = '<';
 			}
 			break;
 		case '=':
-			stream++;
-			if (*stream == '=') {
-				stream++;
-				token.type = TOKEN_EQ;
+			lex->stream++;
+			if (*lex->stream == '=') {
+				lex->stream++;
+				lex->token.type = TOKEN_EQ;
 			} else {
-				token.type = '=';
+				lex->token.type = '=';
 			}
 			break;
 		default:
-			token.type = *stream++;
+			// Bytes past ASCII would pass for the token types numbered
+			// from 128 once stored as a u8
+			if ((u8) *lex->stream >= 128)
+				fatal_line(lex->token.line, "Invalid byte 0x%02x in source", (u8) *lex->stream);
+			lex->token.type = *lex->stream++;
 			break;
 		}
 	}
-	token.source_end = stream;
+	lex->token.source_end = lex->stream;
+}
+
+void lex_tokens(Lexer * lex, const char * source, Token_Stream * tokens)
+{
+	memset(tokens, 0, sizeof(*tokens));
+	tokens->source = source;
+	if (strlen(source) > UINT32_MAX)
+		fatal("Source is too large to tokenize");
+
+	lex->stream = source;
+	lex->current_line = 0;
+	int capacity = 0;
+	int count = 0;
+	do {
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+			tokens->types  = realloc(tokens->types,  capacity * sizeof(u8));
+			tokens->starts = realloc(tokens->starts, capacity * sizeof(u32));
+			tokens->ends   = realloc(tokens->ends,   capacity * sizeof(u32));
+			tokens->lines  = realloc(tokens->lines,  capacity * sizeof(u32));
+			tokens->values = realloc(tokens->values, capacity * sizeof(Token_Value));
+		}
+		_next_token(lex);
+		tokens->types[count]  = lex->token.type;
+		tokens->starts[count] = lex->token.source_start - source;
+		tokens->ends[count]   = lex->token.source_end - source;
+		tokens->lines[count]  = lex->token.line;
+		tokens->values[count].name = lex->token.name;
+		count++;
+	} while (lex->token.type != '\0');
+	tokens->count = count;
+}
+
+void free_token_stream(Token_Stream * tokens)
+{
+	free(tokens->types);
+	free(tokens->starts);
+	free(tokens->ends);
+	free(tokens->lines);
+	free(tokens->values);
+	memset(tokens, 0, sizeof(*tokens));
+}
+
+Token_Type peek_token(Lexer * lex, int n)
+{
+	if (!lex->batch)
+		internal_error("peek_token needs batch tokenization");
+	int index = lex->index + n;
+	if (index >= lex->tokens.count) index = lex->tokens.count - 1;
+	return lex->tokens.types[index];
 }
 
-void next_token()
+void next_token(Lexer * lex)
 {
-	_next_token();
+	if (lex->batch) {
+		// The end of input repeats once reached
+		if (lex->index + 1 < lex->tokens.count) load_token(lex, lex->index + 1);
+	} else {
+		_next_token(lex);
+	}
 	#if LEX_NEXT_TOKEN_DEBUG
-	print_token(token);
+	print_token(lex->token);
 	#endif
 }
 
-bool is_token(Token_Type type)
+bool is_token(Lexer * lex, Token_Type type)
 {
-	return token.type == type;
+	return lex->token.type == type;
 }
 
-bool is_token_name(const char * name)
+bool is_token_name(Lexer * lex, const char * name)
 {
-	return token.type == TOKEN_NAME && token.name == name;
+	return lex->token.type == TOKEN_NAME && lex->token.name == name;
 }
 
 /* Checks that the next token is of the expected type. If so, it
  * advances the stream.
  */ 
-bool match_token(Token_Type type)
+bool match_token(Lexer * lex, Token_Type type)
 {
-	if (is_token(type)) {
-		next_token();
+	if (is_token(lex, type)) {
+		next_token(lex);
 		return true;
 	}
 	return false;
@@ -197,34 +394,35 @@ void fatal_expected(Token_Type expected_type, Token got_token)
 /* Checks that the next token is of the expected type. If it's not,
  * an error occurs.
  */
-bool expect_token(Token_Type type)
+bool expect_token(Lexer * lex, Token_Type type)
 {
-	if (is_token(type)) {
-		next_token();
+	if (is_token(lex, type)) {
+		next_token(lex);
 		return true;
 	}
-	fatal_expected(type, token);
+	fatal_expected(type, lex->token);
 }
 
-bool check_token(Token_Type type) {
-	if (is_token(type)) return true;
-	fatal_expected(type, token);
+bool check_token(Lexer * lex, Token_Type type) {
+	if (is_token(lex, type)) return true;
+	fatal_expected(type, lex->token);
 }
 
+// These expect a Lexer * lex in scope
 #define _assert_token(x) \
-	assert(match_token(x))
+	assert(match_token(lex, x))
 #define _assert_token_name(x) \
-	assert(token.name == str_intern(x) && match_token(TOKEN_NAME))
+	assert(lex->token.name == intern_str(lex->interns, x) && match_token(lex, TOKEN_NAME))
 #define _assert_token_literal(x) \
-	assert(token.literal == (x) && match_token(TOKEN_LITERAL))
+	assert(lex->token.literal == (x) && match_token(lex, TOKEN_LITERAL))
 #define _assert_token_eof(x) \
-	assert(is_token('\0'))
+	assert(is_token(lex, '\0'))
 
 #if LEX_TEST_DEBUG
-#define assert_token(x) (print_token(token), _assert_token(x))
-#define assert_token_name(x) (print_token(token), _assert_token_name(x))
-#define assert_token_literal(x) (print_token(token), _assert_token_literal(x))
-#define assert_token_eof(x) (print_token(token), _assert_token_eof(x))
+#define assert_token(x) (print_token(lex->token), _assert_token(x))
+#define assert_token_name(x) (print_token(lex->token), _assert_token_name(x))
+#define assert_token_literal(x) (print_token(lex->token), _assert_token_literal(x))
+#define assert_token_eof(x) (print_token(lex->token), _assert_token_eof(x))
 #else
 #define assert_token _assert_token
 #define assert_token_name _assert_token_name
@@ -234,8 +432,13 @@ bool check_token(Token_Type type) {
 
 void lex_test()
 {
+	Intern_Table interns = {0};
+	Lexer _lex;
+	Lexer * lex = &_lex;
+	lexer_init(lex, &interns);
+
 	const char * source = "round(f() + 3, digits()) * -3";
-	init_stream(source);
+	init_stream(lex, source);
 	assert_token_name("round");
 	assert_token('(');
 	assert_token_name("f");
@@ -252,5 +455,129 @@ void lex_test()
 	assert_token('-');
 	assert_token_literal(3);
 	assert_token_eof();
-	return;
+
+	// Keywords, names that only look like them, and runs long enough
+	// for the wide scans
+	source = "let lets\n\n  \t  \n                    set\n"
+		"elif els else_ if_i func return returned while\n"
+		"a_rather_long_identifier_name_0123456789 x1\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t42";
+	init_stream(lex, source);
+	assert_token(TOKEN_LET);
+	assert_token_name("lets");
+	assert(lex->token.line == 3);
+	assert_token(TOKEN_SET);
+	assert_token(TOKEN_ELIF);
+	assert_token_name("els");
+	assert_token_name("else_");
+	assert_token_name("if_i");
+	assert_token(TOKEN_FUNC);
+	assert_token(TOKEN_RETURN);
+	assert_token_name("returned");
+	assert_token(TOKEN_WHILE);
+	assert(lex->token.line == 5);
+	assert_token_name("a_rather_long_identifier_name_0123456789");
+	assert_token_name("x1");
+	assert_token_literal(42);
+	assert_token_eof();
+
+	// Newlines in the last bytes of a page, where the wide scans give
+	// way to one byte at a time
+	char * page;
+	assert(posix_memalign((void**) &page, 4096, 8192) == 0);
+	memset(page, ' ', 4096);
+	strcpy(page + 4096 - 4, "a\n\nb");
+	init_stream(lex, page);
+	assert_token_name("a");
+	assert(lex->token.line == 2);
+	assert_token_name("b");
+	assert_token_eof();
+	free(page);
+
+	// Batch and one-at-a-time lexing agree, and lookahead sees ahead
+	// without consuming
+	Token_Stream tokens;
+	lex_tokens(lex, source, &tokens);
+	lex->batch = false;
+	init_stream(lex, source);
+	for (int i = 0; i < tokens.count; i++) {
+		assert(tokens.types[i] == lex->token.type);
+		assert(tokens.lines[i] == lex->token.line);
+		assert(source + tokens.starts[i] == lex->token.source_start);
+		assert(source + tokens.ends[i] == lex->token.source_end);
+		next_token(lex);
+	}
+	free_token_stream(&tokens);
+	lex->batch = true;
+	init_stream(lex, source);
+	assert(peek_token(lex, 0) == TOKEN_LET);
+	assert(peek_token(lex, 2) == TOKEN_SET);
+	assert(peek_token(lex, 1000) == '\0');
+	assert_token(TOKEN_LET);
+
+	// High-bit bytes are refused rather than read as names or keywords
+	Error_Trap trap;
+	if (setjmp(trap.jump) == 0) {
+		error_trap_set(&trap);
+		init_stream(lex, "print(\x81)");
+		assert(!"Lexed a high-bit byte");
+	}
+	assert(strstr(trap.message, "Invalid byte 0x81"));
+
+	lexer_free(lex);
+	intern_table_free(&interns);
+}
+
+char * make_bench_source(size_t size)
+{
+	const char * lines[] = {
+		"func function_number(argument, other_argument)\n{\n",
+		"\tlet local_variable;\n",
+		"\tset local_variable = argument * 12345 + other_argument;\n",
+		"\twhile local_variable <= 1000000 {\n\t\tset local_variable = local_variable * 2;\n\t}\n",
+		"\tif local_variable == 3 { return 1; } elif local_variable >= 4 { return 2; }\n",
+		"\n\n        \n\treturn function_number(local_variable - 1, 0);\n}\n\n",
+	};
+	char * source = NULL;
+	while (sb_count(source) < size) {
+		for (int i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+			size_t len = strlen(lines[i]);
+			memcpy(sb_add(source, len), lines[i], len);
+		}
+	}
+	sb_push(source, '\0');
+	return source;
+}
+
+void lex_bench()
+{
+	char * source = make_bench_source(16 * 1024 * 1024);
+	double mb = (sb_count(source) - 1) / (1024.0 * 1024.0);
+
+	Intern_Table interns = {0};
+	Lexer _lex;
+	Lexer * lex = &_lex;
+	lexer_init(lex, &interns);
+
+	lex->batch = false;
+	u64 tokens = 1; // The end of input
+	u64 start = time_ns();
+	init_stream(lex, source);
+	while (lex->token.type != '\0') {
+		next_token(lex);
+		tokens++;
+	}
+	u64 stream_ns = time_ns() - start;
+
+	Token_Stream batch_tokens;
+	start = time_ns();
+	lex_tokens(lex, source, &batch_tokens);
+	u64 batch_ns = time_ns() - start;
+	assert(batch_tokens.count == tokens);
+	free_token_stream(&batch_tokens);
+	lexer_free(lex);
+	intern_table_free(&interns);
+
+	printf("lexer: %.0f MB, %lu tokens, one at a time %.1f MB/s, batch %.1f MB/s\n",
+		mb, tokens, mb / (stream_ns / 1e9), mb / (batch_ns / 1e9));
+	sb_free(source);
 }
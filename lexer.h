@@ -37,28 +37,73 @@ typedef struct Token {
 void token_type_str(char * buf, Token_Type type);
 void print_token(Token token);
 
-extern Token token;
-extern u32 current_line;
-extern const char * stream;
+/*
+ * Batch tokenization
+ *
+ * lex_tokens lexes a whole buffer up front into parallel arrays, one
+ * entry per token with the end of input last. With batch set on the
+ * Lexer, init_stream does this and next_token then just steps a
+ * cursor through the arrays into token, so the parser works the same
+ * either way and can look ahead for free with peek_token.
+ */
+typedef union Token_Value {
+	int literal;
+	const char * name;
+} Token_Value;
+
+typedef struct Token_Stream {
+	const char * source;
+	u8 * types;
+	u32 * starts; // Offsets into source
+	u32 * ends;
+	u32 * lines;
+	Token_Value * values;
+	int count;
+} Token_Stream;
+
+// Everything one lexer needs, so separate lexers can run on separate
+// threads
+typedef struct Lexer {
+	Token token;
+	u32 current_line;
+	const char * stream;
+	Intern_Table * interns; // Names are interned here
 
+	bool batch;
+	Token_Stream tokens;
+	int index; // Of token in tokens
+} Lexer;
+
+// Builds the shared character and keyword tables. Call before any
+// lexer is used; calls after the first do nothing.
 void lex_init();
-void init_stream(const char * source);
+void lexer_init(Lexer * lex, Intern_Table * interns);
+void lexer_free(Lexer * lex);
+void init_stream(Lexer * lex, const char * source);
+
+void lex_tokens(Lexer * lex, const char * source, Token_Stream * tokens);
+void free_token_stream(Token_Stream * tokens);
+// Type of the token n places after the current one
+Token_Type peek_token(Lexer * lex, int n);
 
-void next_token();
-bool is_token(Token_Type type);
-bool is_token_name(const char * name);
+void next_token(Lexer * lex);
+bool is_token(Lexer * lex, Token_Type type);
+bool is_token_name(Lexer * lex, const char * name);
 
 /* Checks that the next token is of the expected type. If so, it
  * advances the stream.
  */ 
-bool match_token(Token_Type type);
+bool match_token(Lexer * lex, Token_Type type);
 
 /* Checks that the next token is of the expected type. If it's not,
  * an error occurs.
  */
-bool expect_token(Token_Type type);
-bool check_token(Token_Type type);
+bool expect_token(Lexer * lex, Token_Type type);
+bool check_token(Lexer * lex, Token_Type type);
 
 void fatal_expected(Token_Type expected_type, Token got_token);
 
 void lex_test();
+void lex_bench();
+// Synthetic source of at least size bytes, for benchmarks
+char * make_bench_source(size_t size);
@@ -1,44 +1,267 @@
+#include "arena.h"
+#include "bench.h"
+#include "bytecode.h"
+#include "cache.h"
 #include "common.h"
 #include "compiler.h"
 #include "error.h"
+#include "fold.h"
 #include "intern.h"
+#include "jit.h"
 #include "lexer.h"
 #include "map.h"
 #include "parser.h"
+#include "peephole.h"
+#include "profile.h"
+#include "regvm.h"
+#include "sample.h"
+#include "sl.h"
 #include "vm.h"
+#include "vm_stack.h"
 
-int main(int argc, char ** argv)
+// The compiler is left alive, since the program's symbol names are
+// interned in it
+static void compile_source(Compiler * compiler, VM * vm, const char * source, int opt_level, bool opt_report)
 {
-	lex_init();
-	
+	compiler_init(compiler, source);
+	prepare(compiler);
+	if (opt_level >= 1) {
+		fold(compiler);
+	}
+
+	compile(compiler, vm);
+
+	if (opt_level >= 1) {
+		Peephole_Stats stats = peephole(vm);
+		if (opt_report) {
+			printf("peephole: %d -> %d instructions\n", stats.before, stats.after);
+		}
+	} else {
+		strip_symbols(vm);
+	}
+	finish_compilation(compiler);
+}
+
+static void run_tests()
+{
+	load_file_test();
+	arena_test();
 	str_intern_test();
 	map_test();
+	vm_stack_test();
 	
 	lex_test();
 	//parse_test();
 	vm_test();
+	fold_test();
+	reg_vm_test();
+	jit_test();
+	profile_test();
+	sample_test();
+	bytecode_test();
+	cache_test();
+	compiler_thread_test();
+	sl_test();
+	sl_error_test();
+	sl_batch_test();
+}
 
-	if (argc < 2) {
+int main(int argc, char ** argv)
+{
+	lex_init();
+
+	if (argc == 2 && strcmp(argv[1], "--test") == 0) {
+		run_tests();
+		printf("All tests passed.\n");
+		return 0;
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "--bench-files") == 0) {
+		return bench_pipeline(argc - 2, argv + 2);
+	}
+
+	if (argc == 2 && strcmp(argv[1], "--bench") == 0) {
+		// First, so peak RSS isn't from an earlier benchmark
+		compile_bench();
+		lex_bench();
+		parse_bench();
+		str_intern_bench(10000);
+		str_intern_bench(1000000);
+		map_bench(1000);
+		map_bench(100000);
+		map_bench(10000000);
+		vm_bench();
+		reg_vm_bench();
+		jit_bench();
+		sample_bench();
+		cache_bench();
+		sl_bench();
+		sl_batch_bench();
+		return 0;
+	}
+
+	int opt_level = 1;
+	bool opt_report = false;
+	bool reg_engine = false;
+	bool use_jit = false;
+	size_t stack_limit = VM_STACK_LIMIT;
+	char * emit_path = NULL;
+	char * profile_path = NULL;
+	char * sample_path = NULL;
+	bool use_cache = true;
+	char * path = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-O0") == 0) {
+			opt_level = 0;
+		} else if (strcmp(argv[i], "-O1") == 0) {
+			opt_level = 1;
+		} else if (strcmp(argv[i], "--opt-report") == 0) {
+			opt_report = true;
+		} else if (strcmp(argv[i], "--engine=stack") == 0) {
+			reg_engine = false;
+		} else if (strcmp(argv[i], "--engine=reg") == 0) {
+			reg_engine = true;
+		} else if (strcmp(argv[i], "--jit") == 0) {
+			use_jit = true;
+		} else if (strcmp(argv[i], "--no-cache") == 0) {
+			use_cache = false;
+		} else if (strcmp(argv[i], "--emit-bytecode") == 0) {
+			if (i + 1 >= argc) {
+				printf("--emit-bytecode needs an output path\n");
+				return 1;
+			}
+			emit_path = argv[++i];
+		} else if (strcmp(argv[i], "--profile") == 0) {
+			profile_path = "profile.folded";
+		} else if (strncmp(argv[i], "--profile=", 10) == 0) {
+			profile_path = argv[i] + 10;
+		} else if (strcmp(argv[i], "--sample") == 0) {
+			sample_path = "sample.folded";
+		} else if (strncmp(argv[i], "--sample=", 9) == 0) {
+			sample_path = argv[i] + 9;
+		} else if (strncmp(argv[i], "--stack-limit=", 14) == 0) {
+			stack_limit = strtoull(argv[i] + 14, NULL, 10);
+			if (stack_limit == 0) {
+				printf("Invalid stack limit %s\n", argv[i] + 14);
+				return 1;
+			}
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			printf("Unknown option %s\n", argv[i]);
+			return 1;
+		} else if (path) {
+			printf("Provide one file to interpret.\n");
+			return 1;
+		} else {
+			path = argv[i];
+		}
+	}
+	if (!path) {
 		printf("Need a file to interpret.\n");
 		return 1;
-	} else if (argc > 2) {
-		printf("Provide one file to interpret.\n");
-		return 1;
 	}
 
-	const char * source = load_string_from_file(argv[1]);
-	init_stream(source);
-	prepare();
-
+	Compiler compiler;
 	VM _vm;
 	VM * vm = &_vm;
-	vm_init(vm);
+	vm_init_stacks(vm, VM_STACK_INITIAL, stack_limit);
+
+	if (bytecode_load(vm, path)) {
+		if (reg_engine) {
+			printf("Bytecode files only run on the stack engine.\n");
+			return 1;
+		}
+	} else {
+		Loaded_File file;
+		if (!load_file(path, &file)) {
+			printf("Couldn't read %s\n", path);
+			return 1;
+		}
+		const char * source = file.str;
+
+		if (reg_engine) {
+			if (profile_path || sample_path) {
+				printf("Profiling only works on the stack engine.\n");
+				return 1;
+			}
+			compiler_init(&compiler, source);
+			prepare(&compiler);
+			if (opt_level >= 1) {
+				fold(&compiler);
+			}
+			Reg_VM _rvm;
+			Reg_VM * rvm = &_rvm;
+			reg_vm_init_stacks(rvm, VM_STACK_INITIAL, stack_limit);
+			compile_reg(&compiler, rvm);
+			finish_compilation(&compiler);
+			reg_vm_run(rvm);
+			reg_vm_free(rvm);
+			compiler_free(&compiler);
+			free_loaded_file(&file);
+			vm_free(vm);
+			return 0;
+		}
+
+		// --opt-report describes a compilation, so it always compiles,
+		// and cached programs have no source lines to sample
+		char * cache_path = NULL;
+		if (use_cache && !opt_report && !sample_path) {
+			cache_path = cache_entry_path(source, opt_level);
+		}
+		if (!cache_path || !cache_load(vm, cache_path, source)) {
+			compile_source(&compiler, vm, source, opt_level, opt_report);
+			if (cache_path) {
+				cache_store(vm, cache_path, source);
+			}
+		}
+		free(cache_path);
+		free_loaded_file(&file);
+	}
+
+	if (emit_path) {
+		bytecode_write(vm, emit_path);
+		return 0;
+	}
+
+	// Reports go to stderr, after the program's own output, and the
+	// folded stacks to profile_path or sample_path. Profiled and
+	// sampled runs never use the JIT, as native code doesn't keep
+	// them informed.
+	if (profile_path) {
+		Profile profile;
+		profile_init(&profile, vm);
+		vm_run_profiled(vm, &profile);
+		profile_report(&profile, vm, stderr);
+		if (!profile_write_folded(&profile, profile_path)) {
+			fprintf(stderr, "Couldn't write %s\n", profile_path);
+			return 1;
+		}
+		profile_free(&profile);
+		return 0;
+	}
+	if (sample_path) {
+		Sampler sampler;
+		sampler_init(&sampler, vm, SAMPLE_HZ);
+		vm_run_sampled(vm, &sampler);
+		sampler_report(&sampler, stderr);
+		if (!sampler_write_folded(&sampler, sample_path)) {
+			fprintf(stderr, "Couldn't write %s\n", sample_path);
+			return 1;
+		}
+		sampler_free(&sampler);
+		return 0;
+	}
 
-	compile(vm);
+	// Without a JIT for this machine, everything is interpreted
+	if (use_jit) {
+		jit_attach(vm, JIT_THRESHOLD);
+	}
 
 	#if CPU_STATE_REPORTING
 	printf("%d instructions generated\n", sb_count(vm->insts));
 	for (int i = 0; i < sb_count(vm->insts); i++) {
+		for (int j = 0; j < sb_count(vm->symbols); j++) {
+			if (vm->symbols[j].ip == i) printf("%s:\n", vm->symbols[j].name);
+		}
 		printf("%02d ", i);
 		if (vm->insts[i].type == INST_SYMBOL)
 			printf("%s:\n", vm->insts[i].arg0.symbol);
@@ -47,10 +270,10 @@ int main(int argc, char ** argv)
 	}
 	#endif
 
+	#if CPU_STATE_REPORTING
 	#define CYCLE_LIMIT 100
 	int cycles = 0;
 	do {
-		#if CPU_STATE_REPORTING
 		printf("----\n");
 		printf("IP: %d\n", vm->ip);
 		printf("Call Stack (%lu):\n", vm->call_sp);
@@ -67,14 +290,16 @@ int main(int argc, char ** argv)
 		cycles++;
 		if (cycles >= CYCLE_LIMIT)
 			internal_error("Cycle overflow");
-		#endif
 	} while (vm_step(vm));
+	#else
+	vm_run(vm);
+	#endif
 	
 	#if 0
 	int iter = -1;
-	while ((iter = map_iter(function_map, iter)) != -1) {
-		printf("%s:\n", (char*) function_map->keys[iter]);
-		Function * func = (Function*) function_map->values[iter];
+	while ((iter = map_iter(compiler.function_map, iter)) != -1) {
+		printf("%s:\n", (char*) compiler.function_map->slots[iter].key);
+		Function * func = (Function*) compiler.function_map->slots[iter].value;
 		for (int i = 0; i < sb_count(func->decls); i++) {
 			printf("  %s declared, size %zu\n", func->decls[i].name, func->decls[i].size);
 		}
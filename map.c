@@ -1,48 +1,118 @@
 #include "map.h"
 
+static size_t map_round_size(size_t size)
+{
+	size_t rounded = 16;
+	while (rounded < size) rounded *= 2;
+	return rounded;
+}
+
 Map * make_map(size_t size)
 {
 	Map * map = malloc(sizeof(Map));
-	map->keys   = malloc(sizeof(u64)  * size);
-	map->values = malloc(sizeof(u64)  * size);
-	map->taken  = calloc(size, sizeof(bool));
-	map->size = size;
+	map->size = map_round_size(size);
+	map->slots = calloc(map->size, sizeof(Map_Slot));
+	map->count = 0;
+	map->tombstones = 0;
 	return map;
 }
 
+void free_map(Map * map)
+{
+	free(map->slots);
+	free(map);
+}
+
 u64 map_hash(Map * map, u64 key)
 {
-	return key % map->size;
+	// MurmurHash3 64-bit finalizer
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ull;
+	key ^= key >> 33;
+	return key & (map->size - 1);
 }
 
-void map_insert(Map * map, u64 key, u64 value)
+static void map_rehash(Map * map, size_t new_size)
 {
-	int position = map_hash(map, key);
-	int counter = 0;
-	while (map->taken[position]) {
-		if (map->keys[position] == key) break;
-		assert(counter++ < map->size); // Don't exceed maximum table size
-		position = (position + 1) % map->size;
+	Map_Slot * old_slots = map->slots;
+	size_t old_size = map->size;
+	map->slots = calloc(new_size, sizeof(Map_Slot));
+	map->size = new_size;
+	map->count = 0;
+	map->tombstones = 0;
+	for (size_t i = 0; i < old_size; i++) {
+		if (old_slots[i].state == MAP_SLOT_TAKEN) {
+			map_insert(map, old_slots[i].key, old_slots[i].value);
+		}
 	}
-	map->keys[position]   = key;
-	map->values[position] = value;
-	map->taken[position]  = true;
+	free(old_slots);
 }
 
-bool map_index(Map * map, u64 key, u64 * value)
+/* Returns the slot holding key, or -1 if it isn't in the map.
+ */
+static s64 map_find(Map * map, u64 key)
 {
-	int position = map_hash(map, key);
-	int counter = 0;
+	u64 mask = map->size - 1;
+	u64 position = map_hash(map, key);
 	while (1) {
-		if (!map->taken[position]) {
-			return false;
-		} else if (map->keys[position] == key) {
+		Map_Slot * slot = &map->slots[position];
+		if (slot->state == MAP_SLOT_EMPTY) {
+			return -1;
+		} else if (slot->state == MAP_SLOT_TAKEN && slot->key == key) {
+			return position;
+		}
+		position = (position + 1) & mask;
+	}
+}
+
+void map_insert(Map * map, u64 key, u64 value)
+{
+	if ((map->count + map->tombstones + 1) * 4 > map->size * 3) {
+		// If the table is mostly tombstones, rehashing in place is enough
+		size_t new_size = map->size;
+		if ((map->count + 1) * 2 > map->size) new_size *= 2;
+		map_rehash(map, new_size);
+	}
+	u64 mask = map->size - 1;
+	u64 position = map_hash(map, key);
+	s64 reuse = -1;
+	while (1) {
+		Map_Slot * slot = &map->slots[position];
+		if (slot->state == MAP_SLOT_EMPTY) {
 			break;
+		} else if (slot->state == MAP_SLOT_TAKEN && slot->key == key) {
+			slot->value = value;
+			return;
+		} else if (slot->state == MAP_SLOT_DELETED && reuse == -1) {
+			reuse = position;
 		}
-		if (counter++ >= map->size) return false;
-		position = (position + 1) % map->size;
+		position = (position + 1) & mask;
 	}
-	if (value) *value = map->values[position];
+	if (reuse != -1) {
+		position = reuse;
+		map->tombstones--;
+	}
+	map->slots[position] = (Map_Slot) {key, value, MAP_SLOT_TAKEN};
+	map->count++;
+}
+
+bool map_index(Map * map, u64 key, u64 * value)
+{
+	s64 position = map_find(map, key);
+	if (position == -1) return false;
+	if (value) *value = map->slots[position].value;
+	return true;
+}
+
+bool map_delete(Map * map, u64 key)
+{
+	s64 position = map_find(map, key);
+	if (position == -1) return false;
+	map->slots[position].state = MAP_SLOT_DELETED;
+	map->count--;
+	map->tombstones++;
 	return true;
 }
 
@@ -51,7 +121,7 @@ int map_iter(Map * map, int iter)
 	while (1) {
 		if (iter + 1 >= map->size) return -1;
 		iter++;
-		if (map->taken[iter]) return iter;
+		if (map->slots[iter].state == MAP_SLOT_TAKEN) return iter;
 	}
 }
 
@@ -66,4 +136,52 @@ void map_test()
 	u64 u2;
 	map_index(map, 527, &u2);
 	assert(u2 == 0xBEEF);
+	free_map(map);
+
+	// Grow well past the initial size, then delete half
+	map = make_map(16);
+	for (u64 i = 0; i < 10000; i++) {
+		map_insert(map, i * 16, i);
+	}
+	assert(map->count == 10000);
+	for (u64 i = 0; i < 10000; i += 2) {
+		assert(map_delete(map, i * 16));
+	}
+	assert(!map_delete(map, 0));
+	for (u64 i = 0; i < 10000; i++) {
+		u64 value;
+		bool found = map_index(map, i * 16, &value);
+		assert(found == (i % 2 == 1));
+		if (found) assert(value == i);
+	}
+	int live = 0;
+	int iter = -1;
+	while ((iter = map_iter(map, iter)) != -1) live++;
+	assert(live == 5000);
+	free_map(map);
+}
+
+void map_bench(size_t count)
+{
+	Map * map = make_map(16);
+	// Pointer-like keys, to exercise the hash on aligned values
+	u64 start = time_ns();
+	for (u64 i = 0; i < count; i++) {
+		map_insert(map, i * 16, i);
+	}
+	u64 insert_ns = time_ns() - start;
+	u64 sum = 0;
+	start = time_ns();
+	for (u64 i = 0; i < count; i++) {
+		u64 value;
+		map_index(map, i * 16, &value);
+		sum += value;
+	}
+	u64 lookup_ns = time_ns() - start;
+	assert(sum == (u64) count * (count - 1) / 2);
+
+	printf("map: %zu keys, %.2f M inserts/s, %.2f M lookups/s\n", count,
+		count / (insert_ns / 1e3), count / (lookup_ns / 1e3));
+
+	free_map(map);
 }
@@ -3,19 +3,38 @@
 
 /*
  * Simple u64->u64 hash map
+ *
+ * Open addressing with linear probing over a power-of-two slot
+ * array. Keys are run through a 64-bit finalizer first, since most
+ * of them are pointers whose low bits are always zero. The table
+ * grows once live entries plus tombstones pass 3/4 of capacity.
  */
 
-// TODO(pixlark): Resizing
+typedef enum Map_Slot_State {
+	MAP_SLOT_EMPTY = 0,
+	MAP_SLOT_TAKEN,
+	MAP_SLOT_DELETED,
+} Map_Slot_State;
+
+typedef struct Map_Slot {
+	u64 key;
+	u64 value;
+	u8  state;
+} Map_Slot;
+
 typedef struct Map {
-	u64  * keys;
-	u64  * values;
-	bool * taken;
-	size_t size;
+	Map_Slot * slots;
+	size_t size;       // Capacity, always a power of two
+	size_t count;      // Live entries
+	size_t tombstones;
 } Map;
 
 Map * make_map(size_t size);
+void free_map(Map * map);
 u64 map_hash(Map * map, u64 key);
 void map_insert(Map * map, u64 key, u64 value);
 bool map_index(Map * map, u64 key, u64 * value);
+bool map_delete(Map * map, u64 key);
 int map_iter(Map * map, int iter);
 void map_test();
+void map_bench(size_t count);
@@ -28,16 +28,16 @@ Operator_Type token_to_bin_op[] = {
 	[TOKEN_LTE] = OP_LTE,
 };
 
-Expression * make_expr(Expr_Type type)
+Expression * make_expr(Arena * arena, Expr_Type type)
 {
-	Expression * expr = (Expression*) calloc(1, sizeof(Expression));
+	Expression * expr = (Expression*) arena_alloc(arena, sizeof(Expression));
 	expr->type = type;
 	return expr;
 }
 
-Statement * make_stmt(Stmt_Type type)
+Statement * make_stmt(Arena * arena, Stmt_Type type)
 {
-	Statement * stmt = (Statement*) calloc(1, sizeof(Statement));
+	Statement * stmt = (Statement*) arena_alloc(arena, sizeof(Statement));
 	stmt->type = type;
 	return stmt;
 }
@@ -144,29 +144,29 @@ void print_function(Function * func)
 	printf(")");
 }
 
-Expression * parse_atom()
+Expression * parse_atom(Parser * parser)
 {
 	Expression * expr;
-	switch (token.type) {
+	switch (parser->lex.token.type) {
 	case TOKEN_LITERAL:
-		expr = make_expr(EXPR_LITERAL);
-		expr->literal.value = token.literal;
-		next_token();
+		expr = make_expr(&parser->arena, EXPR_LITERAL);
+		expr->literal.value = parser->lex.token.literal;
+		next_token(&parser->lex);
 		break;
 	case TOKEN_NAME:
-		expr = make_expr(EXPR_NAME);
-		expr->name.name = token.name;
+		expr = make_expr(&parser->arena, EXPR_NAME);
+		expr->name.name = parser->lex.token.name;
 		expr->name.decl_pos = -1;
-		next_token();
+		next_token(&parser->lex);
 		break;
 	case '(':
-		next_token();
-		expr = parse_expression();
-		expect_token(')');
+		next_token(&parser->lex);
+		expr = parse_expression(parser);
+		expect_token(&parser->lex, ')');
 		break;
 	default: {
 		char buf[256];
-		token_type_str(buf, token.type);
+		token_type_str(buf, parser->lex.token.type);
 		fatal("Token %s is not valid inside expression.", buf);
 	} break;
 	}
@@ -174,190 +174,197 @@ Expression * parse_atom()
 }
 
 // NOTE: Leading ( has already been consumed when calling this
-Expression ** parse_arglist()
+Expression ** parse_arglist(Parser * parser)
 {
 	Expression ** arglist = 0;
-	if (!match_token(')')) {
+	if (!match_token(&parser->lex, ')')) {
 		while (1) {
-			sb_push(arglist, parse_expression());
-			if (!match_token(',')) {
-				expect_token(')');
+			sb_push(arglist, parse_expression(parser));
+			if (!match_token(&parser->lex, ',')) {
+				expect_token(&parser->lex, ')');
 				break;
 			}
 		}
 	}
-	return arglist;
+	return arena_sb(&parser->arena, arglist);
 }
 
-Expression * parse_postfix()
+Expression * parse_postfix(Parser * parser)
 {
-	Expression * left = parse_atom();
-	if (match_token('[')) {
-		Expression * expr = make_expr(EXPR_INDEX);
+	Expression * left = parse_atom(parser);
+	if (match_token(&parser->lex, '[')) {
+		Expression * expr = make_expr(&parser->arena, EXPR_INDEX);
 		expr->index.left  = left;
-		expr->index.right = parse_atom();
-		expect_token(']');
+		expr->index.right = parse_atom(parser);
+		expect_token(&parser->lex, ']');
 		left = expr;
-	} else if (match_token('(')) {
-		Expression * expr = make_expr(EXPR_FUNCALL);
+	} else if (match_token(&parser->lex, '(')) {
+		Expression * expr = make_expr(&parser->arena, EXPR_FUNCALL);
 		expr->funcall.name = left;
-		expr->funcall.args = parse_arglist();
+		expr->funcall.args = parse_arglist(parser);
 		left = expr;
 	}
 	return left;
 }
 
-Expression * parse_prefix()
+Expression * parse_prefix(Parser * parser)
 {
-	if (match_token('-')) {
-		Expression * expr = make_expr(EXPR_UNARY);
+	if (match_token(&parser->lex, '-')) {
+		Expression * expr = make_expr(&parser->arena, EXPR_UNARY);
 		expr->unary.type = OP_NEG;
-		expr->unary.right = parse_prefix();
+		expr->unary.right = parse_prefix(parser);
 		return expr;
-	} else if (match_token('!')) {
-		Expression * expr = make_expr(EXPR_UNARY);
+	} else if (match_token(&parser->lex, '!')) {
+		Expression * expr = make_expr(&parser->arena, EXPR_UNARY);
 		expr->unary.type = OP_LNEG;
-		expr->unary.right = parse_prefix();
+		expr->unary.right = parse_prefix(parser);
 		return expr;
 	} else {
-		return parse_postfix();
+		return parse_postfix(parser);
 	}
 }
 
-Expression * parse_bool_ops()
+Expression * parse_bool_ops(Parser * parser)
 {
-	Expression * left = parse_prefix();
-	while (is_token(TOKEN_EQ) || is_token(TOKEN_GTE) || is_token(TOKEN_LTE) || is_token('<') || is_token('>')) {
-		Expression * expr = make_expr(EXPR_BINARY);
-		expr->binary.type = token_to_bin_op[token.type];
+	Expression * left = parse_prefix(parser);
+	while (is_token(&parser->lex, TOKEN_EQ) || is_token(&parser->lex, TOKEN_GTE) || is_token(&parser->lex, TOKEN_LTE) || is_token(&parser->lex, '<') || is_token(&parser->lex, '>')) {
+		Expression * expr = make_expr(&parser->arena, EXPR_BINARY);
+		expr->binary.type = token_to_bin_op[parser->lex.token.type];
 		expr->binary.left = left;
-		next_token();
-		expr->binary.right = parse_prefix();
+		next_token(&parser->lex);
+		expr->binary.right = parse_prefix(parser);
 		left = expr;
 	}
 	return left;
 }
 
-Expression * parse_mul_ops()
+Expression * parse_mul_ops(Parser * parser)
 {
-	Expression * left = parse_bool_ops();
-	while (is_token('*') || is_token('/') || is_token('%')) {
-		Expression * expr = make_expr(EXPR_BINARY);
-		expr->binary.type = token_to_bin_op[token.type];
+	Expression * left = parse_bool_ops(parser);
+	while (is_token(&parser->lex, '*') || is_token(&parser->lex, '/') || is_token(&parser->lex, '%')) {
+		Expression * expr = make_expr(&parser->arena, EXPR_BINARY);
+		expr->binary.type = token_to_bin_op[parser->lex.token.type];
 		expr->binary.left = left;
-		next_token();
-		expr->binary.right = parse_bool_ops();
+		next_token(&parser->lex);
+		expr->binary.right = parse_bool_ops(parser);
 		left = expr;
 	}
 	return left;
 }
 
-Expression * parse_add_ops()
+Expression * parse_add_ops(Parser * parser)
 {
-	Expression * left = parse_mul_ops();
-	while (is_token('+') || is_token('-')) {
-		Expression * expr = make_expr(EXPR_BINARY);
-		expr->binary.type = token_to_bin_op[token.type];
+	Expression * left = parse_mul_ops(parser);
+	while (is_token(&parser->lex, '+') || is_token(&parser->lex, '-')) {
+		Expression * expr = make_expr(&parser->arena, EXPR_BINARY);
+		expr->binary.type = token_to_bin_op[parser->lex.token.type];
 		expr->binary.left = left;
-		next_token();
-		expr->binary.right = parse_mul_ops();
+		next_token(&parser->lex);
+		expr->binary.right = parse_mul_ops(parser);
 		left = expr;
 	}
 	return left;
 }
 
-Expression * parse_expression()
+Expression * parse_expression(Parser * parser)
 {
-	return parse_add_ops();
+	return parse_add_ops(parser);
 }
 
-Statement * parse_lone_expr()
+Statement * parse_lone_expr(Parser * parser)
 {
-	Statement * stmt = make_stmt(STMT_EXPR);
-	stmt->stmt_expr.expr = parse_expression();
-	expect_token(';');
+	Statement * stmt = make_stmt(&parser->arena, STMT_EXPR);
+	stmt->stmt_expr.expr = parse_expression(parser);
+	expect_token(&parser->lex, ';');
 	return stmt;
 }
 
-Statement * parse_assign()
+Statement * parse_assign(Parser * parser)
 {
-	expect_token(TOKEN_SET);
-	Statement * stmt = make_stmt(STMT_ASSIGN);
-	stmt->stmt_assign.left = parse_expression();
-	expect_token('=');
-	stmt->stmt_assign.right = parse_expression();
-	expect_token(';');
+	expect_token(&parser->lex, TOKEN_SET);
+	Statement * stmt = make_stmt(&parser->arena, STMT_ASSIGN);
+	stmt->stmt_assign.left = parse_expression(parser);
+	expect_token(&parser->lex, '=');
+	stmt->stmt_assign.right = parse_expression(parser);
+	expect_token(&parser->lex, ';');
 	return stmt;
 }
 
-Statement * parse_decl()
+Statement * parse_decl(Parser * parser)
 {
-	expect_token(TOKEN_LET);
-	Statement * stmt = make_stmt(STMT_DECL);
-	check_token(TOKEN_NAME);
-	stmt->stmt_decl.name = token.name;
-	next_token();
-	expect_token(';');
+	expect_token(&parser->lex, TOKEN_LET);
+	Statement * stmt = make_stmt(&parser->arena, STMT_DECL);
+	check_token(&parser->lex, TOKEN_NAME);
+	stmt->stmt_decl.name = parser->lex.token.name;
+	next_token(&parser->lex);
+	expect_token(&parser->lex, ';');
 	/*
-	expect_token('=');
-	stmt->stmt_decl.bind_expr = parse_expression();
-	expect_token(';');*/
+	expect_token(&parser->lex, '=');
+	stmt->stmt_decl.bind_expr = parse_expression(parser);
+	expect_token(&parser->lex, ';');*/
 	return stmt;
 }
 
-Statement * parse_if()
+Statement * parse_if(Parser * parser)
 {
-	expect_token(TOKEN_IF);
-	Statement * stmt = make_stmt(STMT_IF);
+	expect_token(&parser->lex, TOKEN_IF);
+	Statement * stmt = make_stmt(&parser->arena, STMT_IF);
 	do {
-		sb_push(stmt->stmt_if.conditions, parse_expression());
-		sb_push(stmt->stmt_if.scopes,     parse_scope());
-	} while (match_token(TOKEN_ELIF));
-	if (match_token(TOKEN_ELSE)) {
-		stmt->stmt_if.else_scope = parse_scope();
+		sb_push(stmt->stmt_if.conditions, parse_expression(parser));
+		sb_push(stmt->stmt_if.scopes,     parse_scope(parser));
+	} while (match_token(&parser->lex, TOKEN_ELIF));
+	arena_sb(&parser->arena, stmt->stmt_if.conditions);
+	arena_sb(&parser->arena, stmt->stmt_if.scopes);
+	if (match_token(&parser->lex, TOKEN_ELSE)) {
+		stmt->stmt_if.else_scope = parse_scope(parser);
 	}
 	return stmt;
 }
 
-Statement * parse_while()
+Statement * parse_while(Parser * parser)
 {
-	expect_token(TOKEN_WHILE);
-	Statement * stmt = make_stmt(STMT_WHILE);
-	stmt->stmt_while.condition = parse_expression();
-	stmt->stmt_while.scope = parse_scope();
+	expect_token(&parser->lex, TOKEN_WHILE);
+	Statement * stmt = make_stmt(&parser->arena, STMT_WHILE);
+	stmt->stmt_while.condition = parse_expression(parser);
+	stmt->stmt_while.scope = parse_scope(parser);
 	return stmt;
 }
 
-Statement * parse_return()
+Statement * parse_return(Parser * parser)
 {
-	expect_token(TOKEN_RETURN);
-	Statement * stmt = make_stmt(STMT_RETURN);
-	stmt->stmt_return.expr = parse_expression();
-	expect_token(';');
+	expect_token(&parser->lex, TOKEN_RETURN);
+	Statement * stmt = make_stmt(&parser->arena, STMT_RETURN);
+	stmt->stmt_return.expr = parse_expression(parser);
+	expect_token(&parser->lex, ';');
 	return stmt;
 }
 
-Statement * parse_scope()
+Statement * parse_scope(Parser * parser)
 {
-	expect_token('{');
-	Statement * stmt = make_stmt(STMT_SCOPE);
-	while (!match_token('}')) {
-		sb_push(stmt->stmt_scope.body, parse_statement());
+	u32 line = parser->lex.token.line;
+	expect_token(&parser->lex, '{');
+	Statement * stmt = make_stmt(&parser->arena, STMT_SCOPE);
+	stmt->line = line;
+	while (!match_token(&parser->lex, '}')) {
+		sb_push(stmt->stmt_scope.body, parse_statement(parser));
 	}
+	arena_sb(&parser->arena, stmt->stmt_scope.body);
 	return stmt;
 }
 
-Statement * parse_statement()
+Statement * parse_statement(Parser * parser)
 {
-	switch (token.type) {
+	u32 line = parser->lex.token.line;
+	Statement * stmt = NULL;
+	switch (parser->lex.token.type) {
 	case TOKEN_SET:
-		return parse_assign();
+		stmt = parse_assign(parser);
 		break;
 	case TOKEN_LET:
-		return parse_decl();
+		stmt = parse_decl(parser);
 		break;
 	case TOKEN_IF:
-		return parse_if();
+		stmt = parse_if(parser);
 		break;
 	case TOKEN_ELIF:
 		fatal("elif outside of if chain");
@@ -366,46 +373,62 @@ Statement * parse_statement()
 		fatal("else outside of if chain");
 		break;
 	case TOKEN_WHILE:
-		return parse_while();
+		stmt = parse_while(parser);
 		break;
 	case TOKEN_RETURN:
-		return parse_return();
+		stmt = parse_return(parser);
 		break;
 	case '{':
-		return parse_scope();
+		stmt = parse_scope(parser);
 		break;
 	default:
-		return parse_lone_expr();
+		stmt = parse_lone_expr(parser);
 		break;
 	}
+	stmt->line = line;
+	return stmt;
 }
 
-Function * parse_function()
+Function * parse_function(Parser * parser)
 {
-	Function * func = calloc(1, sizeof(Function));
-	expect_token(TOKEN_FUNC);
-	check_token(TOKEN_NAME);
-	func->name = token.name;
-	next_token();
-	expect_token('(');
+	Function * func = arena_alloc(&parser->arena, sizeof(Function));
+	expect_token(&parser->lex, TOKEN_FUNC);
+	check_token(&parser->lex, TOKEN_NAME);
+	func->name = parser->lex.token.name;
+	next_token(&parser->lex);
+	expect_token(&parser->lex, '(');
 	Expression ** arglist = 0;
-	if (!match_token(')')) {
-		check_token(TOKEN_NAME);
+	if (!match_token(&parser->lex, ')')) {
+		check_token(&parser->lex, TOKEN_NAME);
 		while (1) {
-			sb_push(func->arg_names, token.name);
-			next_token();
-			if (!match_token(',')) {
-				expect_token(')');
+			sb_push(func->arg_names, parser->lex.token.name);
+			next_token(&parser->lex);
+			if (!match_token(&parser->lex, ',')) {
+				expect_token(&parser->lex, ')');
 				break;
 			}
 		}
 	}
-	func->body = parse_scope();
+	arena_sb(&parser->arena, func->arg_names);
+	func->body = parse_scope(parser);
+	return func;
+}
+
+bool tokens_left(Parser * parser)
+{
+	return parser->lex.token.type;
+}
+
+void parser_init(Parser * parser, Intern_Table * interns)
+{
+	lexer_init(&parser->lex, interns);
+	parser->arena = (Arena) {0};
 }
 
-bool tokens_left()
+void parser_free(Parser * parser)
 {
-	return token.type;
+	lexer_free(&parser->lex);
+	arena_free(&parser->arena);
 }
 
 void parse_test()
@@ -428,10 +451,48 @@ void parse_test()
 		"    }\n"
 		"}\n";
 	printf("%s\n\n", source);
-	init_stream(source);
-	while (!is_token(0)) {
-		Function * func = parse_function();
+	Intern_Table interns = {0};
+	Parser _parser;
+	Parser * parser = &_parser;
+	parser_init(parser, &interns);
+	init_stream(&parser->lex, source);
+	while (!is_token(&parser->lex, 0)) {
+		Function * func = parse_function(parser);
 		print_function(func);
 		printf("\n");
 	}
+	parser_free(parser);
+	intern_table_free(&interns);
+}
+
+void parse_bench()
+{
+	char * source = make_bench_source(16 * 1024 * 1024);
+	double mb = (sb_count(source) - 1) / (1024.0 * 1024.0);
+	Intern_Table interns = {0};
+	Parser _parser;
+	Parser * parser = &_parser;
+	parser_init(parser, &interns);
+
+	// Interleaved lexing and parsing, as without batch lexing
+	parser->lex.batch = false;
+	u64 start = time_ns();
+	init_stream(&parser->lex, source);
+	while (tokens_left(parser)) parse_function(parser);
+	u64 interleaved_ns = time_ns() - start;
+	arena_free(&parser->arena);
+	parser->lex.batch = true;
+
+	start = time_ns();
+	init_stream(&parser->lex, source);
+	u64 lex_ns = time_ns() - start;
+	start = time_ns();
+	while (tokens_left(parser)) parse_function(parser);
+	u64 parse_ns = time_ns() - start;
+
+	printf("parser: %.0f MB, interleaved %.1f ms, batch lex %.1f ms + parse %.1f ms\n",
+		mb, interleaved_ns / 1e6, lex_ns / 1e6, parse_ns / 1e6);
+	parser_free(parser);
+	intern_table_free(&interns);
+	sb_free(source);
 }
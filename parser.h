@@ -1,4 +1,5 @@
 #pragma once
+#include "arena.h"
 #include "lexer.h"
 #include "error.h"
 
@@ -41,7 +42,6 @@ typedef enum Operator_Type {
 extern char * op_to_str[];
 extern Operator_Type token_to_bin_op[];
 
-#include "compiler.h" // TODO(pixlark): fuck it
 // From compiler.h
 typedef struct Declaration Declaration;
 //
@@ -56,6 +56,7 @@ typedef struct Function {
 	Statement * body;
 	Declaration * decls;
 	u64 ip_start;
+	u64 reg_ip_start;
 } Function;
 
 typedef struct Statement {
@@ -71,6 +72,8 @@ typedef struct Statement {
 		struct {
 			const char * name;
 			//Expression * bind_expr;
+			int decl_pos; // Slot, as for names
+			bool reset;   // The slot held an earlier local
 		} stmt_decl;
 		struct {
 			Expression ** conditions;
@@ -122,8 +125,18 @@ typedef struct Expression {
 	u32 line;
 } Expression;
 
-Statement * make_stmt(Stmt_Type type);
-Expression * make_expr(Expr_Type type);
+typedef struct Parser {
+	Lexer lex;
+	// Every node, and every array hanging off one, is allocated here.
+	// finish_compilation releases it once the program is compiled.
+	Arena arena;
+} Parser;
+
+void parser_init(Parser * parser, Intern_Table * interns);
+void parser_free(Parser * parser);
+
+Statement * make_stmt(Arena * arena, Stmt_Type type);
+Expression * make_expr(Arena * arena, Expr_Type type);
 
 void print_statement(Statement * stmt);
 void print_expression(Expression * expr);
@@ -137,25 +150,28 @@ void print_expression(Expression * expr);
  *   LOWEST
  */
 
-Expression * parse_atom();
-Expression * parse_postfix();
-Expression * parse_prefix();
-Expression * parse_bool_ops();
-Expression * parse_mul_ops();
-Expression * parse_add_ops();
-Expression * parse_expression();
-Statement  * parse_return();
-Statement  * parse_while();
-Statement  * parse_lone_expr();
-Statement  * parse_assign();
-Statement  * parse_decl();
-Statement  * parse_if();
+Expression * parse_atom(Parser * parser);
+Expression * parse_postfix(Parser * parser);
+Expression * parse_prefix(Parser * parser);
+Expression * parse_bool_ops(Parser * parser);
+Expression * parse_mul_ops(Parser * parser);
+Expression * parse_add_ops(Parser * parser);
+Expression * parse_expression(Parser * parser);
+Statement  * parse_return(Parser * parser);
+Statement  * parse_while(Parser * parser);
+Statement  * parse_lone_expr(Parser * parser);
+Statement  * parse_assign(Parser * parser);
+Statement  * parse_decl(Parser * parser);
+Statement  * parse_if(Parser * parser);
 
-Statement * parse_scope();
-Statement * parse_statement();
+Statement * parse_scope(Parser * parser);
+Statement * parse_statement(Parser * parser);
 
-Function * parse_function();
+Function * parse_function(Parser * parser);
 
-bool tokens_left();
+bool tokens_left(Parser * parser);
 
 void parse_test();
+void parse_bench();
+
+#include "compiler.h" // TODO(pixlark): fuck it
@@ -0,0 +1,190 @@
+#include "peephole.h"
+
+/* Passes delete instructions by overwriting them with INST_NOP, and
+ * compact() squeezes the NOPs out at the end. Until then every index
+ * in the program stays valid, so the passes don't have to relocate
+ * anything themselves.
+ */
+
+static int next_live(VM * vm, int i)
+{
+	int count = sb_count(vm->insts);
+	for (i++; i < count; i++) {
+		if (vm->insts[i].type != INST_NOP) break;
+	}
+	return i;
+}
+
+// First live instruction at or after i
+static int live_from(VM * vm, int i)
+{
+	if (i >= sb_count(vm->insts)) return sb_count(vm->insts);
+	return vm->insts[i].type == INST_NOP ? next_live(vm, i) : i;
+}
+
+/* Marks every instruction that can be reached other than by falling
+ * into it: jump targets, function entries and the program entry.
+ */
+static bool * find_targets(VM * vm)
+{
+	int count = sb_count(vm->insts);
+	bool * targets = calloc(count + 1, sizeof(bool));
+	for (int i = 0; i < count; i++) {
+		u64 * target = inst_jump_target(&vm->insts[i]);
+		if (target && vm->insts[i].type != INST_NOP) {
+			targets[live_from(vm, *target)] = true;
+		}
+	}
+	targets[live_from(vm, vm->ip)] = true;
+	// Every function entry carries a symbol
+	for (int i = 0; i < sb_count(vm->symbols); i++) {
+		targets[live_from(vm, vm->symbols[i].ip)] = true;
+	}
+	return targets;
+}
+
+static bool is_compare(Inst_Type type, Inst_Type * fused)
+{
+	#define COMPARE_FUSE(name, op)                                      \
+	if (type >= INST_##name && type <= INST_##name##_LL) {              \
+		*fused = INST_JZ_##name + (type - INST_##name);                 \
+		return true;                                                    \
+	}
+	COMPARE_INSTS(COMPARE_FUSE)
+	#undef COMPARE_FUSE
+	return false;
+}
+
+static bool thread_jumps(VM * vm)
+{
+	bool changed = false;
+	int count = sb_count(vm->insts);
+	for (int i = 0; i < count; i++) {
+		u64 * target = inst_jump_target(&vm->insts[i]);
+		if (!target) continue;
+		int dest = live_from(vm, *target);
+		for (int hops = 0; hops < count; hops++) {
+			if (dest >= count || vm->insts[dest].type != INST_JMP) break;
+			dest = live_from(vm, vm->insts[dest].arg0.jmp_ip);
+		}
+		// Leave jump cycles alone
+		if (dest < count && vm->insts[dest].type == INST_JMP) continue;
+		if (dest != *target) {
+			*target = dest;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+static bool remove_jumps_to_next(VM * vm)
+{
+	bool changed = false;
+	int count = sb_count(vm->insts);
+	for (int i = 0; i < count; i++) {
+		if (vm->insts[i].type != INST_JMP) continue;
+		if (live_from(vm, vm->insts[i].arg0.jmp_ip) == next_live(vm, i)) {
+			vm->insts[i].type = INST_NOP;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+static bool remove_dead_code(VM * vm, bool * targets)
+{
+	bool changed = false;
+	int count = sb_count(vm->insts);
+	for (int i = 0; i < count; i++) {
+		Inst_Type type = vm->insts[i].type;
+		if (type != INST_JMP && type != INST_JIP && type != INST_RET && type != INST_HALT) continue;
+		for (int j = next_live(vm, i); j < count && !targets[j]; j = next_live(vm, j)) {
+			vm->insts[j].type = INST_NOP;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+static bool fuse_compare_jumps(VM * vm, bool * targets)
+{
+	bool changed = false;
+	int count = sb_count(vm->insts);
+	for (int i = 0; i < count; i++) {
+		Inst_Type fused;
+		if (!is_compare(vm->insts[i].type, &fused)) continue;
+		int j = next_live(vm, i);
+		if (j >= count || targets[j] || vm->insts[j].type != INST_JZ) continue;
+		vm->insts[i].type = fused;
+		vm->insts[i].arg2.jmp_ip = vm->insts[j].arg0.jmp_ip;
+		vm->insts[j].type = INST_NOP;
+		changed = true;
+	}
+	return changed;
+}
+
+static void compact(VM * vm)
+{
+	int count = sb_count(vm->insts);
+	u64 * relocated = malloc((count + 1) * sizeof(u64));
+	int live = 0;
+	for (int i = 0; i < count; i++) {
+		relocated[i] = live;
+		if (vm->insts[i].type != INST_NOP) live++;
+	}
+	relocated[count] = live;
+
+	for (int i = 0; i < count; i++) {
+		Inst inst = vm->insts[i];
+		if (inst.type == INST_NOP) continue;
+		u64 * target = inst_jump_target(&inst);
+		if (target) *target = relocated[*target];
+		vm->insts[relocated[i]] = inst;
+	}
+	stb__sbn(vm->insts) = live;
+
+	vm->ip = relocated[vm->ip];
+	for (int i = 0; i < sb_count(vm->symbols); i++) {
+		vm->symbols[i].ip = relocated[vm->symbols[i].ip];
+	}
+	for (int i = 0; i < sb_count(vm->lines); i++) {
+		vm->lines[i].ip = relocated[vm->lines[i].ip];
+	}
+	free(relocated);
+}
+
+static void mark_symbols(VM * vm)
+{
+	for (int i = 0; i < sb_count(vm->insts); i++) {
+		if (vm->insts[i].type != INST_SYMBOL) continue;
+		Symbol symbol = {i, vm->insts[i].arg0.symbol};
+		sb_push(vm->symbols, symbol);
+		vm->insts[i].type = INST_NOP;
+	}
+}
+
+void strip_symbols(VM * vm)
+{
+	mark_symbols(vm);
+	compact(vm);
+}
+
+Peephole_Stats peephole(VM * vm)
+{
+	Peephole_Stats stats;
+	stats.before = sb_count(vm->insts);
+	mark_symbols(vm);
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		changed |= thread_jumps(vm);
+		changed |= remove_jumps_to_next(vm);
+		bool * targets = find_targets(vm);
+		changed |= remove_dead_code(vm, targets);
+		changed |= fuse_compare_jumps(vm, targets);
+		free(targets);
+	}
+	compact(vm);
+	stats.after = sb_count(vm->insts);
+	return stats;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "common.h"
+#include "compiler.h"
+#include "vm.h"
+
+/*
+ * Peephole optimizer. Runs over vm->insts once compile has finished,
+ * rewriting the naive sequences the compiler emits and relocating
+ * every jump target, function entry point and vm->ip to match.
+ */
+
+typedef struct Peephole_Stats {
+	int before;
+	int after;
+} Peephole_Stats;
+
+Peephole_Stats peephole(VM * vm);
+
+// Moves INST_SYMBOL markers into vm->symbols. Run as part of
+// peephole, but usable on its own when the rest isn't wanted.
+void strip_symbols(VM * vm);
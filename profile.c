@@ -0,0 +1,321 @@
+#include "profile.h"
+
+#include <unistd.h>
+
+#include "compiler.h"
+#include "fold.h"
+#include "peephole.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline u64 read_cycles()
+{
+	return __rdtsc();
+}
+#else
+// Nanoseconds stand in for cycles elsewhere
+static inline u64 read_cycles()
+{
+	return time_ns();
+}
+#endif
+
+#define PROFILE_HOTTEST 20
+
+void profile_init(Profile * profile, VM * vm)
+{
+	u64 count = sb_count(vm->insts);
+	*profile = (Profile){0};
+	profile->inst_count = count;
+	profile->counts = calloc(count + 1, sizeof(u64));
+	profile->function_of = malloc((count + 1) * sizeof(int));
+	for (u64 ip = 0; ip <= count; ip++) {
+		profile->function_of[ip] = -1;
+	}
+
+	u64 * ends = vm_function_ends(vm);
+	for (int i = 0; i < sb_count(vm->symbols); i++) {
+		Symbol symbol = vm->symbols[i];
+		sb_push(profile->functions, ((Profile_Function){
+			.name = symbol.name,
+			.ip = symbol.ip,
+		}));
+		for (u64 ip = symbol.ip; ip < ends[symbol.ip]; ip++) {
+			profile->function_of[ip] = i;
+		}
+	}
+	free(ends);
+
+	sb_push(profile->nodes, ((Profile_Node){
+		.function = -1,
+		.parent = -1,
+		.first_child = -1,
+		.next_sibling = -1,
+	}));
+}
+
+void profile_free(Profile * profile)
+{
+	free(profile->counts);
+	free(profile->function_of);
+	sb_free(profile->functions);
+	sb_free(profile->nodes);
+	sb_free(profile->frames);
+}
+
+void profile_start(Profile * profile)
+{
+	profile->start = read_cycles();
+}
+
+static int child_node(Profile * profile, int parent, int function)
+{
+	// Direct recursion stays in the caller's node
+	if (profile->nodes[parent].function == function) return parent;
+
+	int node = profile->nodes[parent].first_child;
+	while (node != -1 && profile->nodes[node].function != function) {
+		node = profile->nodes[node].next_sibling;
+	}
+	if (node != -1) return node;
+
+	node = sb_count(profile->nodes);
+	sb_push(profile->nodes, ((Profile_Node){
+		.function = function,
+		.parent = parent,
+		.first_child = -1,
+		.next_sibling = profile->nodes[parent].first_child,
+	}));
+	profile->nodes[parent].first_child = node;
+	return node;
+}
+
+void profile_call(Profile * profile, u64 ip)
+{
+	int function = profile->function_of[ip];
+	int parent = sb_count(profile->frames) ? sb_last(profile->frames).node : 0;
+	int node = child_node(profile, parent, function);
+	if (function != -1) {
+		profile->functions[function].calls++;
+		profile->functions[function].active++;
+	}
+	sb_push(profile->frames, ((Profile_Frame){node, read_cycles(), 0}));
+}
+
+void profile_return(Profile * profile)
+{
+	if (!sb_count(profile->frames)) return;
+	u64 now = read_cycles();
+	Profile_Frame frame = sb_pop(profile->frames);
+	u64 inclusive = now - frame.start;
+	u64 exclusive = inclusive - frame.children;
+	Profile_Node * node = &profile->nodes[frame.node];
+	int function = node->function;
+	if (function != -1) {
+		Profile_Function * func = &profile->functions[function];
+		func->exclusive += exclusive;
+		if (--func->active == 0) func->inclusive += inclusive;
+	}
+	node->exclusive += exclusive;
+	if (sb_count(profile->frames)) {
+		sb_last(profile->frames).children += inclusive;
+	}
+}
+
+void profile_stop(Profile * profile)
+{
+	// Calls still running when the program halts end here
+	while (sb_count(profile->frames)) {
+		profile_return(profile);
+	}
+	profile->total = read_cycles() - profile->start;
+
+	for (u64 ip = 0; ip < profile->inst_count; ip++) {
+		int function = profile->function_of[ip];
+		if (function != -1) profile->functions[function].executed += profile->counts[ip];
+	}
+}
+
+static int compare_exclusive(const void * a, const void * b)
+{
+	const Profile_Function * x = *(Profile_Function * const *) a;
+	const Profile_Function * y = *(Profile_Function * const *) b;
+	return x->exclusive < y->exclusive ? 1 : x->exclusive > y->exclusive ? -1 : 0;
+}
+
+typedef struct Inst_Count {
+	u64 ip;
+	u64 count;
+} Inst_Count;
+
+static int compare_count(const void * a, const void * b)
+{
+	const Inst_Count * x = a;
+	const Inst_Count * y = b;
+	if (x->count != y->count) return x->count < y->count ? 1 : -1;
+	return x->ip < y->ip ? -1 : x->ip > y->ip;
+}
+
+static double percent(u64 part, u64 total)
+{
+	return total ? 100.0 * part / total : 0.0;
+}
+
+void profile_report(Profile * profile, VM * vm, FILE * file)
+{
+	u64 executed = 0;
+	for (u64 ip = 0; ip < profile->inst_count; ip++) {
+		executed += profile->counts[ip];
+	}
+	fprintf(file, "profile: %lu instructions executed in %lu cycles\n",
+		executed, profile->total);
+
+	int function_count = sb_count(profile->functions);
+	Profile_Function ** functions = malloc((function_count + 1) * sizeof(Profile_Function*));
+	for (int i = 0; i < function_count; i++) {
+		functions[i] = &profile->functions[i];
+	}
+	qsort(functions, function_count, sizeof(Profile_Function*), compare_exclusive);
+	fprintf(file, "\n%10s %14s %7s %14s %7s %14s  %s\n",
+		"calls", "inclusive", "", "exclusive", "", "instructions", "function");
+	for (int i = 0; i < function_count; i++) {
+		Profile_Function * func = functions[i];
+		if (!func->calls) continue;
+		fprintf(file, "%10lu %14lu %6.2f%% %14lu %6.2f%% %14lu  %s\n",
+			func->calls,
+			func->inclusive, percent(func->inclusive, profile->total),
+			func->exclusive, percent(func->exclusive, profile->total),
+			func->executed, func->name);
+	}
+	free(functions);
+
+	Inst_Count * hottest = malloc((profile->inst_count + 1) * sizeof(Inst_Count));
+	int hot_count = 0;
+	for (u64 ip = 0; ip < profile->inst_count; ip++) {
+		if (profile->counts[ip]) hottest[hot_count++] = (Inst_Count){ip, profile->counts[ip]};
+	}
+	qsort(hottest, hot_count, sizeof(Inst_Count), compare_count);
+	if (hot_count > PROFILE_HOTTEST) hot_count = PROFILE_HOTTEST;
+	fprintf(file, "\n%14s %7s %8s  %-16s %s\n", "executions", "", "ip", "function", "instruction");
+	for (int i = 0; i < hot_count; i++) {
+		int function = profile->function_of[hottest[i].ip];
+		fprintf(file, "%14lu %6.2f%% %8lu  %-16s ",
+			hottest[i].count, percent(hottest[i].count, executed), hottest[i].ip,
+			function == -1 ? "-" : profile->functions[function].name);
+		fprint_instruction(file, vm->insts[hottest[i].ip]);
+	}
+	free(hottest);
+}
+
+bool profile_write_folded(Profile * profile, const char * path)
+{
+	FILE * file = fopen(path, "w");
+	if (!file) return false;
+
+	// No path is longer than the tree
+	int * path_nodes = malloc(sb_count(profile->nodes) * sizeof(int));
+	for (int i = 1; i < sb_count(profile->nodes); i++) {
+		if (!profile->nodes[i].exclusive) continue;
+		int depth = 0;
+		for (int node = i; node > 0; node = profile->nodes[node].parent) {
+			path_nodes[depth++] = node;
+		}
+		for (int j = depth - 1; j >= 0; j--) {
+			int function = profile->nodes[path_nodes[j]].function;
+			fprintf(file, "%s%s", function == -1 ? "?" : profile->functions[function].name,
+				j ? ";" : "");
+		}
+		fprintf(file, " %lu\n", profile->nodes[i].exclusive);
+	}
+	free(path_nodes);
+
+	bool ok = !ferror(file);
+	ok &= fclose(file) == 0;
+	return ok;
+}
+
+static Profile_Function * find_function(Profile * profile, const char * name)
+{
+	for (int i = 0; i < sb_count(profile->functions); i++) {
+		if (strcmp(profile->functions[i].name, name) == 0) return &profile->functions[i];
+	}
+	return NULL;
+}
+
+void profile_test()
+{
+	const char * source =
+		"func fib(n) { if n < 2 { return n; } return fib(n - 1) + fib(n - 2); }\n"
+		"func loop(n) { let i; let s; while i < n { set s = s + i; set i = i + 1; } return s; }\n"
+		"func main() { return fib(10) + loop(100); }";
+	char path[] = "/tmp/slc-profile-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	for (int optimize = 0; optimize <= 1; optimize++) {
+		Compiler compiler;
+		compiler_init(&compiler, source);
+		prepare(&compiler);
+		if (optimize) fold(&compiler);
+		VM _vm;
+		VM * vm = &_vm;
+		vm_init(vm);
+		compile(&compiler, vm);
+		if (optimize) peephole(vm);
+		else strip_symbols(vm);
+		finish_compilation(&compiler);
+		u64 entry = vm->ip;
+
+		u64 steps = 1;
+		while (vm_step(vm)) steps++;
+		assert(vm->op_stack[vm->op_sp - 1] == 55 + 4950);
+
+		vm->ip = entry;
+		vm->op_sp = 0;
+		vm->call_sp = 0;
+		Profile profile;
+		profile_init(&profile, vm);
+		vm_run_profiled(vm, &profile);
+		assert(vm->op_stack[vm->op_sp - 1] == 55 + 4950);
+
+		u64 executed = 0;
+		u64 in_functions = 0;
+		for (u64 ip = 0; ip < profile.inst_count; ip++) {
+			executed += profile.counts[ip];
+		}
+		for (int i = 0; i < sb_count(profile.functions); i++) {
+			in_functions += profile.functions[i].executed;
+		}
+		assert(executed == steps);
+		assert(in_functions < executed);
+
+		Profile_Function * fib = find_function(&profile, "fib");
+		Profile_Function * loop = find_function(&profile, "loop");
+		Profile_Function * main_func = find_function(&profile, "main");
+		assert(fib->calls == 177);
+		assert(loop->calls == 1);
+		assert(main_func->calls == 1);
+		assert(fib->active == 0 && main_func->active == 0);
+		assert(fib->exclusive <= fib->inclusive);
+		assert(main_func->inclusive >= fib->inclusive + loop->inclusive);
+		assert(main_func->inclusive <= profile.total);
+		assert(loop->executed > 100 * 4);
+
+		// main, main;fib and main;loop, with fib's recursion collapsed
+		assert(sb_count(profile.nodes) == 4);
+		assert(profile_write_folded(&profile, path));
+		Loaded_File file;
+		assert(load_file(path, &file));
+		assert(strstr(file.str, "main;fib "));
+		assert(strstr(file.str, "main;loop "));
+		assert(!strstr(file.str, "fib;fib"));
+		free_loaded_file(&file);
+
+		profile_free(&profile);
+		vm_free(vm);
+		compiler_free(&compiler);
+	}
+
+	unlink(path);
+}
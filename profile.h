@@ -0,0 +1,76 @@
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Instrumenting profiler
+ *
+ * vm_run_profiled is a separate copy of the dispatch loop that counts
+ * every instruction it executes and tells the profile about each call
+ * and return, so vm_run itself carries no instrumentation. Functions
+ * are found from the program's symbols, which run from their
+ * INST_SYMBOL marker up to the next function or the entry stub.
+ *
+ * Calls are timed with the cycle counter. A function's inclusive time
+ * covers only its outermost activation, so recursion isn't counted
+ * twice, and its exclusive time leaves out everything it called.
+ * Exclusive time is also kept per call path for the folded stacks
+ * file, where direct recursion is collapsed into a single frame so
+ * deep recursion doesn't make every line as long as the recursion.
+ */
+
+typedef struct Profile_Function {
+	const char * name;
+	u64 ip;
+	u64 calls;
+	u64 inclusive;
+	u64 exclusive;
+	u64 executed; // Instructions
+	int active;   // Activations on the call stack
+} Profile_Function;
+
+// Node in the tree of call paths. Node 0 is the root, outside any
+// function.
+typedef struct Profile_Node {
+	int function;
+	int parent;
+	int first_child;
+	int next_sibling;
+	u64 exclusive;
+} Profile_Node;
+
+typedef struct Profile_Frame {
+	int node;
+	u64 start;
+	u64 children; // Cycles spent in calls made from this frame
+} Profile_Frame;
+
+typedef struct Profile {
+	u64 inst_count;
+	u64 * counts;      // Executions of each instruction
+	int * function_of; // Function of each instruction, -1 for none
+	Profile_Function * functions;
+	Profile_Node * nodes;
+	Profile_Frame * frames;
+	u64 start;
+	u64 total; // Cycles for the whole run
+} Profile;
+
+// vm's program must be loaded, with its symbols
+void profile_init(Profile * profile, VM * vm);
+void profile_free(Profile * profile);
+
+// Called by vm_run_profiled
+void profile_start(Profile * profile);
+void profile_call(Profile * profile, u64 ip);
+void profile_return(Profile * profile);
+void profile_stop(Profile * profile);
+
+void profile_report(Profile * profile, VM * vm, FILE * file);
+// One line per call path, "main;fib;fact 1234", with the cycles spent
+// in the last function on that path. Returns false if path can't be
+// written.
+bool profile_write_folded(Profile * profile, const char * path);
+
+void profile_test();
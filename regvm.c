@@ -0,0 +1,344 @@
+#include "regvm.h"
+
+#include "compiler.h"
+#include "fold.h"
+#include "peephole.h"
+
+char * reg_inst_type_to_str[] = {
+	[RINST_HALT]  = "HALT",
+	[RINST_ENTER] = "ENTER",
+	[RINST_MOVI]  = "MOVI",
+	[RINST_MOV]   = "MOV",
+	[RINST_NEG]   = "NEG",
+	[RINST_LNEG]  = "LNEG",
+	#define REG_BINARY_STR(name, op)   \
+		[RINST_##name]     = #name,    \
+		[RINST_##name##_I] = #name "_I",
+	BINARY_INSTS(REG_BINARY_STR)
+	#undef REG_BINARY_STR
+	[RINST_JMP]   = "JMP",
+	[RINST_JZ]    = "JZ",
+	#define REG_COMPARE_JUMP_STR(name, op)     \
+		[RINST_JZ_##name]     = "JZ_" #name,   \
+		[RINST_JZ_##name##_I] = "JZ_" #name "_I",
+	COMPARE_INSTS(REG_COMPARE_JUMP_STR)
+	#undef REG_COMPARE_JUMP_STR
+	[RINST_CALL]  = "CALL",
+	[RINST_RET]   = "RET",
+	[RINST_PRINT] = "PRINT",
+};
+
+void print_reg_instruction(Reg_Inst inst)
+{
+	printf("%s r%u r%u r%u %ld\n", reg_inst_type_to_str[inst.type],
+		inst.a, inst.b, inst.c, inst.imm);
+}
+
+void reg_vm_init(Reg_VM * rvm)
+{
+	reg_vm_init_stacks(rvm, VM_STACK_INITIAL, VM_STACK_LIMIT);
+}
+
+void reg_vm_init_stacks(Reg_VM * rvm, size_t initial, size_t limit)
+{
+	vm_stack_init(&rvm->reg_region, "Register file", initial, limit);
+	vm_stack_init(&rvm->frame_region, "Call stack", initial, limit);
+	rvm->regs        = rvm->reg_region.base;
+	rvm->base        = 0;
+	rvm->frames      = (Reg_Frame*) rvm->frame_region.base;
+	rvm->frame_count = 0;
+	rvm->insts       = NULL;
+	rvm->ip          = 0;
+	rvm->executed    = 0;
+}
+
+void reg_vm_free(Reg_VM * rvm)
+{
+	vm_stack_free(&rvm->reg_region);
+	vm_stack_free(&rvm->frame_region);
+	sb_free(rvm->insts);
+}
+
+void reg_vm_run(Reg_VM * rvm)
+{
+	Reg_Inst * insts  = rvm->insts;
+	u64        ip     = rvm->ip;
+	s64 *      regs   = rvm->regs;
+	s64 *      r      = regs + rvm->base;
+	Reg_Frame * frames = rvm->frames;
+	u64 frame_count   = rvm->frame_count;
+	u64 reg_limit     = rvm->reg_region.limit;
+	u64 executed      = 0;
+	Reg_Inst * inst;
+
+	#define R(n) r[inst->n]
+
+	#if VM_THREADED_DISPATCH
+	// Every instruction, once each, counted as in vm_loop.h
+	#define REG_BINARY_LABELS(name, op) \
+		LABEL(RINST_##name),            \
+		LABEL(RINST_##name##_I),
+	#define REG_COMPARE_JUMP_LABELS(name, op) \
+		LABEL(RINST_JZ_##name),               \
+		LABEL(RINST_JZ_##name##_I),
+	#define REG_DISPATCH_LABELS                   \
+		LABEL(RINST_HALT),                        \
+		LABEL(RINST_ENTER),                       \
+		LABEL(RINST_MOVI),                        \
+		LABEL(RINST_MOV),                         \
+		LABEL(RINST_NEG),                         \
+		LABEL(RINST_LNEG),                        \
+		BINARY_INSTS(REG_BINARY_LABELS)           \
+		LABEL(RINST_JMP),                         \
+		LABEL(RINST_JZ),                          \
+		COMPARE_INSTS(REG_COMPARE_JUMP_LABELS)    \
+		LABEL(RINST_CALL),                        \
+		LABEL(RINST_RET),                         \
+		LABEL(RINST_PRINT),
+	#define LABEL(type) [type] = &&do_##type
+	static void * dispatch_table[RINST_COUNT] = { REG_DISPATCH_LABELS };
+	#undef LABEL
+	#define LABEL(type) 0
+	enum { REG_DISPATCH_TABLE_COMPLETE = 1 / (sizeof((char[]) { REG_DISPATCH_LABELS }) == RINST_COUNT) };
+	#undef LABEL
+	#undef REG_DISPATCH_LABELS
+	#undef REG_BINARY_LABELS
+	#undef REG_COMPARE_JUMP_LABELS
+	#define HANDLER(type) do_##type:
+	#define NEXT() \
+		inst = &insts[ip++]; executed++; goto *dispatch_table[inst->type]
+	NEXT();
+	#else
+	#define HANDLER(type) case type:
+	#define NEXT() continue
+	while (1) {
+	inst = &insts[ip++];
+	executed++;
+	switch (inst->type) {
+	#endif
+
+	HANDLER(RINST_HALT) {
+		rvm->ip = ip;
+		rvm->base = r - regs;
+		rvm->frame_count = frame_count;
+		rvm->executed = executed;
+		return;
+	}
+	HANDLER(RINST_ENTER) {
+		// A window can be wider than the guard page, so it's checked
+		// whole rather than left to fault
+		if ((u64) (r - regs) + inst->c > reg_limit)
+			runtime("Register file overflow (limit is %zu slots)", (size_t) reg_limit);
+		memset(r + inst->a, 0, inst->b * sizeof(s64));
+	} NEXT();
+	HANDLER(RINST_MOVI) {
+		R(a) = inst->imm;
+	} NEXT();
+	HANDLER(RINST_MOV) {
+		R(a) = R(b);
+	} NEXT();
+	HANDLER(RINST_NEG) {
+		R(a) = EVAL_NEG(R(b));
+	} NEXT();
+	HANDLER(RINST_LNEG) {
+		R(a) = EVAL_LNEG(R(b));
+	} NEXT();
+	#define REG_BINARY_HANDLERS(name, op)           \
+	HANDLER(RINST_##name) {                         \
+		R(a) = EVAL_##name(R(b), R(c));             \
+	} NEXT();                                       \
+	HANDLER(RINST_##name##_I) {                     \
+		R(a) = EVAL_##name(R(b), inst->imm);        \
+	} NEXT();
+	BINARY_INSTS(REG_BINARY_HANDLERS)
+	#undef REG_BINARY_HANDLERS
+	HANDLER(RINST_JMP) {
+		ip = inst->c;
+	} NEXT();
+	HANDLER(RINST_JZ) {
+		if (R(a) == 0) ip = inst->c;
+	} NEXT();
+	#define REG_COMPARE_JUMP_HANDLERS(name, op)                  \
+	HANDLER(RINST_JZ_##name) {                                   \
+		if (!EVAL_##name(R(a), R(b))) ip = inst->c;              \
+	} NEXT();                                                    \
+	HANDLER(RINST_JZ_##name##_I) {                               \
+		if (!EVAL_##name(R(a), inst->imm)) ip = inst->c;         \
+	} NEXT();
+	COMPARE_INSTS(REG_COMPARE_JUMP_HANDLERS)
+	#undef REG_COMPARE_JUMP_HANDLERS
+	HANDLER(RINST_CALL) {
+		frames[frame_count++] = (Reg_Frame) {ip, r - regs, r - regs + inst->a};
+		r += inst->b;
+		ip = inst->c;
+	} NEXT();
+	HANDLER(RINST_RET) {
+		Reg_Frame frame = frames[--frame_count];
+		regs[frame.dest] = R(a);
+		r  = regs + frame.base;
+		ip = frame.ret_ip;
+	} NEXT();
+	HANDLER(RINST_PRINT) {
+		printf("%ld\n", R(a));
+	} NEXT();
+
+	#if !VM_THREADED_DISPATCH
+	default:
+		internal_error("Register VM read invalid instruction");
+	}
+	}
+	#endif
+
+	#undef HANDLER
+	#undef NEXT
+	#undef R
+}
+
+/* Both engines run every program in the corpus, and main's return
+ * value has to match.
+ */
+typedef struct Engine_Test {
+	const char * source;
+	s64 expected;
+} Engine_Test;
+
+static Engine_Test engine_tests[] = {
+	{"func main() { return 2 + 3 * 4; }", 14},
+	{"func main() { let a; set a = 7; return (a - 10) * -a; }", 21},
+	{"func main() { let a; set a = 5; return !a + !!a + (a == 5) + (a >= 6); }", 2},
+	{"func main() { return 17 / 5 + 17 % 5; }", 5},
+	{"func add(a, b, c) { return a + b * c; }\n"
+	 "func main() { return add(1, 2, 3); }", 7},
+	{"func sum(n) { let i; let s; while i <= n { set s = s + i; set i = i + 1; } return s; }\n"
+	 "func main() { return sum(100); }", 5050},
+	{"func fib(n) { if n < 2 { return n; } return fib(n - 1) + fib(n - 2); }\n"
+	 "func main() { return fib(15); }", 610},
+	{"func fact(n) { if n <= 1 { return 1; } return n * fact(n - 1); }\n"
+	 "func main() { let x; set x = 3; return fact(x) + fact(x + 2); }", 126},
+	{"func pick(n) { if n < 10 { return 1; } elif n < 100 { return 2; } else { return 3; } }\n"
+	 "func main() { return pick(5) * 100 + pick(50) * 10 + pick(500); }", 123},
+	{"func g(x) { return x + 1; }\n"
+	 "func main() { let a; set a = 4; return g(g(a) * g(a + 1)); }", 31},
+	{"func main() { let i; while 1 { set i = i + 1; if i == 7 { return i; } } }", 7},
+	// Shadowing, of arguments and of outer locals, lasts until the end
+	// of the scope, and names used before a let see the outer binding
+	{"func f(n) { let a; set a = n; let n; set n = 100; return a + n; }\n"
+	 "func main() { return f(9); }", 109},
+	{"func main() { let x; let y; set x = 1; if 1 { let x; set x = 10; set y = x; } return x * 100 + y; }", 110},
+	{"func main() { let x; let y; set x = 3; if 1 { set y = x; let x; set x = 40; set y = y + x; } return y + x; }", 46},
+	// Multiplying a division by zero still divides
+	{"func main() { let a; let b; set a = 7; set b = 2; return (a / b) * 0 + 0 * (a % b) + (a / 3) * 0 + 5; }", 5},
+	// Locals in scopes that don't overlap share a slot, and start at 0
+	// all the same, even when the slot was left holding something
+	{"func main() { let t; if 1 { let a; set a = 5; set t = a; } if 1 { let b; set t = t * 10 + b; } return t; }", 50},
+	{"func main() { let t; let i; if 1 { let a; set a = 7; } while i < 3 { let c; set c = c + 1; if 1 { let d; set d = d + 1; } set t = t * 10 + c; set i = i + 1; } return t; }", 123},
+	// Falling off the end returns 0
+	{"func noret(a) { let x; set x = a; }\n"
+	 "func main() { noret(5); return noret(3) + 1; }", 1},
+	// Both engines' stacks grow as deep as the other's
+	{"func down(n) { if n == 0 { return 0; } return down(n - 1) + 1; }\n"
+	 "func main() { return down(100000); }", 100000},
+};
+
+static s64 run_engine_test(const char * source, bool reg, bool optimize)
+{
+	Compiler compiler;
+	compiler_init(&compiler, source);
+	prepare(&compiler);
+	if (optimize) fold(&compiler);
+	s64 result;
+	if (reg) {
+		Reg_VM _rvm;
+		Reg_VM * rvm = &_rvm;
+		reg_vm_init(rvm);
+		compile_reg(&compiler, rvm);
+		finish_compilation(&compiler);
+		reg_vm_run(rvm);
+		result = rvm->regs[0];
+		reg_vm_free(rvm);
+	} else {
+		VM _vm;
+		VM * vm = &_vm;
+		vm_init(vm);
+		compile(&compiler, vm);
+		if (optimize) peephole(vm);
+		finish_compilation(&compiler);
+		vm_run(vm);
+		result = vm->op_stack[vm->op_sp - 1];
+		vm_free(vm);
+	}
+	compiler_free(&compiler);
+	return result;
+}
+
+void reg_vm_test()
+{
+	int count = sizeof(engine_tests) / sizeof(engine_tests[0]);
+	for (int i = 0; i < count; i++) {
+		for (int optimize = 0; optimize <= 1; optimize++) {
+			assert(run_engine_test(engine_tests[i].source, false, optimize) ==
+				engine_tests[i].expected);
+			assert(run_engine_test(engine_tests[i].source, true, optimize) ==
+				engine_tests[i].expected);
+		}
+	}
+}
+
+static void reg_vm_bench_program(const char * name, const char * source)
+{
+	Compiler compiler;
+	compiler_init(&compiler, source);
+	prepare(&compiler);
+	fold(&compiler);
+
+	VM _vm;
+	VM * vm = &_vm;
+	vm_init(vm);
+	compile(&compiler, vm);
+	peephole(vm);
+	u64 entry = vm->ip;
+	u64 stack_dispatches = 1;
+	while (vm_step(vm)) stack_dispatches++;
+	vm->ip = entry;
+	vm->op_sp = vm->call_sp = 0;
+	u64 start = time_ns();
+	vm_run(vm);
+	u64 stack_ns = time_ns() - start;
+	vm_free(vm);
+
+	Reg_VM _rvm;
+	Reg_VM * rvm = &_rvm;
+	reg_vm_init(rvm);
+	compile_reg(&compiler, rvm);
+	compiler_free(&compiler);
+	start = time_ns();
+	reg_vm_run(rvm);
+	u64 reg_ns = time_ns() - start;
+
+	printf("engines %s: stack %lu dispatches %.1f ms, register %lu dispatches %.1f ms\n",
+		name, stack_dispatches, stack_ns / 1e6, rvm->executed, reg_ns / 1e6);
+	reg_vm_free(rvm);
+}
+
+void reg_vm_bench()
+{
+	reg_vm_bench_program("loop",
+		"func main() {\n"
+		"    let i;\n"
+		"    let sum;\n"
+		"    while i < 5000000 {\n"
+		"        set sum = sum + i;\n"
+		"        set i = i + 1;\n"
+		"    }\n"
+		"}\n");
+	reg_vm_bench_program("fib",
+		"func fib(n) {\n"
+		"    if n < 2 {\n"
+		"        return n;\n"
+		"    }\n"
+		"    return fib(n - 1) + fib(n - 2);\n"
+		"}\n"
+		"func main() {\n"
+		"    return fib(27);\n"
+		"}\n");
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "common.h"
+#include "error.h"
+#include "vm.h"
+
+/*
+ * Register-based execution engine
+ *
+ * Each call gets a window of registers in one shared register file.
+ * A function's arguments are its first registers, followed by its
+ * locals and then temporaries. Arguments are passed by evaluating
+ * them into consecutive registers at the top of the caller's window,
+ * which then become the bottom of the callee's window, so a call
+ * never copies them.
+ *
+ * Instructions are three-address. Registers are numbered relative to
+ * the current window.
+ *
+ * The register file and the frames live in guard-paged VM stacks,
+ * which grow the same way and to the same limit as the stack
+ * engine's. Frames take three slots each.
+ */
+
+typedef enum Reg_Inst_Type {
+	RINST_HALT,
+	RINST_ENTER, // Check the window has room for c registers, zero b locals from a
+	RINST_MOVI,  // r[a] = imm
+	RINST_MOV,   // r[a] = r[b]
+	RINST_NEG,   // r[a] = -r[b]
+	RINST_LNEG,  // r[a] = !r[b]
+	// r[a] = r[b] op r[c], and r[a] = r[b] op imm
+	#define REG_BINARY_ENUM(name, op) RINST_##name, RINST_##name##_I,
+	BINARY_INSTS(REG_BINARY_ENUM)
+	#undef REG_BINARY_ENUM
+	RINST_JMP,   // Jump to c
+	RINST_JZ,    // Jump to c if r[a] is zero
+	// Jump to c if !(r[a] op r[b]), and if !(r[a] op imm)
+	#define REG_COMPARE_JUMP_ENUM(name, op) RINST_JZ_##name, RINST_JZ_##name##_I,
+	COMPARE_INSTS(REG_COMPARE_JUMP_ENUM)
+	#undef REG_COMPARE_JUMP_ENUM
+	RINST_CALL,  // Call c with a window starting at r[b], result into r[a]
+	RINST_RET,   // Return r[a]
+	RINST_PRINT, // Print r[a]
+	RINST_COUNT,
+} Reg_Inst_Type;
+
+extern char * reg_inst_type_to_str[];
+
+typedef struct Reg_Inst {
+	Reg_Inst_Type type;
+	u32 a;
+	u32 b;
+	u32 c;
+	s64 imm;
+} Reg_Inst;
+
+typedef struct Reg_Frame {
+	u64 ret_ip;
+	u64 base;
+	u64 dest; // Absolute register the return value goes into
+} Reg_Frame;
+
+typedef struct Reg_VM {
+	s64 * regs;
+	u64 base;
+	VM_Stack reg_region;
+
+	Reg_Frame * frames;
+	u64 frame_count;
+	VM_Stack frame_region;
+
+	Reg_Inst * insts;
+	u64 ip;
+
+	u64 executed; // Instructions dispatched by the last reg_vm_run
+} Reg_VM;
+
+void print_reg_instruction(Reg_Inst inst);
+
+void reg_vm_init(Reg_VM * rvm);
+// Sizes are in slots, as for vm_init_stacks
+void reg_vm_init_stacks(Reg_VM * rvm, size_t initial, size_t limit);
+void reg_vm_free(Reg_VM * rvm);
+// Execute until HALT. main's return value ends up in regs[0].
+void reg_vm_run(Reg_VM * rvm);
+void reg_vm_test();
+void reg_vm_bench();
+
+#define REMIT(type, a, b, c, imm) \
+	(sb_push(rvm->insts, ((Reg_Inst){(type), (a), (b), (c), (imm)})))
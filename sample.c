@@ -0,0 +1,384 @@
+// MAP_ANONYMOUS isn't part of POSIX
+#define _DEFAULT_SOURCE
+#include "sample.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "fold.h"
+#include "intern.h"
+#include "map.h"
+#include "peephole.h"
+
+#define SAMPLE_HOTTEST 20
+
+static Sampler * volatile active_sampler;
+static struct sigaction old_action;
+
+void sampler_init(Sampler * sampler, VM * vm, u32 hz)
+{
+	*sampler = (Sampler){0};
+	sampler->vm = vm;
+	sampler->hz = hz;
+
+	// Every call pushes at least its return ip, so there are never
+	// more live calls than call stack slots. Only the pages that get
+	// used are ever committed.
+	sampler->frames = mmap(NULL, vm->call_region.limit * sizeof(u64),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (sampler->frames == MAP_FAILED) {
+		fatal("Couldn't reserve %zu frames for sampling", vm->call_region.limit);
+	}
+	sampler->buffer = malloc(SAMPLE_BUFFER_SIZE * sizeof(u64));
+
+	u64 count = sb_count(vm->insts);
+	sampler->function_of = malloc((count + 1) * sizeof(int));
+	for (u64 ip = 0; ip <= count; ip++) {
+		sampler->function_of[ip] = -1;
+	}
+	u64 * ends = vm_function_ends(vm);
+	for (int i = 0; i < sb_count(vm->symbols); i++) {
+		for (u64 ip = vm->symbols[i].ip; ip < ends[vm->symbols[i].ip]; ip++) {
+			sampler->function_of[ip] = i;
+		}
+	}
+	free(ends);
+}
+
+void sampler_free(Sampler * sampler)
+{
+	munmap((void*) sampler->frames, sampler->vm->call_region.limit * sizeof(u64));
+	free(sampler->buffer);
+	free(sampler->function_of);
+}
+
+// Only touches memory the sampler reserved up front
+static void on_sigprof(int signal)
+{
+	Sampler * sampler = active_sampler;
+	if (!sampler) return;
+	u64 depth = sampler->depth;
+	u64 recorded = depth < SAMPLE_MAX_DEPTH ? depth : SAMPLE_MAX_DEPTH;
+	if (sampler->used + 2 + recorded > SAMPLE_BUFFER_SIZE) {
+		sampler->dropped++;
+		return;
+	}
+	u64 * sample = sampler->buffer + sampler->used;
+	sample[0] = depth;
+	sample[1] = sampler->ip;
+	s64 * call_stack = sampler->vm->call_stack;
+	for (u64 i = 0; i < recorded; i++) {
+		sample[2 + i] = call_stack[sampler->frames[depth - 1 - i]];
+	}
+	sampler->used += 2 + recorded;
+	sampler->samples++;
+}
+
+void sampler_start(Sampler * sampler)
+{
+	if (active_sampler) internal_error("Only one sampled run may go at a time");
+	active_sampler = sampler;
+
+	struct sigaction action = {0};
+	action.sa_handler = on_sigprof;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, &old_action);
+
+	long interval = 1000000 / sampler->hz;
+	if (interval <= 0) interval = 1;
+	struct itimerval timer = {{0, interval}, {0, interval}};
+	setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void sampler_stop(Sampler * sampler)
+{
+	struct itimerval timer = {{0, 0}, {0, 0}};
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &old_action, NULL);
+	active_sampler = NULL;
+}
+
+/* Samples are summarized once the run is over. Stacks are built as
+ * strings and interned, so identical stacks share a pointer that
+ * keys a map to their count.
+ */
+
+typedef struct Sample_Stack {
+	const char * stack;
+	u64 count;
+} Sample_Stack;
+
+typedef struct Sample_Line {
+	u32 line;
+	int function;
+	u64 count;
+} Sample_Line;
+
+typedef struct Sample_Summary {
+	Intern_Table interns;
+	Map * stack_index; // Interned stack to its index in stacks
+	Sample_Stack * stacks;
+	Map * line_index;  // Function and line to its index in lines
+	Sample_Line * lines;
+	u64 * function_samples; // Samples with the function innermost
+	u64 outside;            // Samples outside any function
+} Sample_Summary;
+
+// Appends the frame for ip, if ip is in a function
+static void append_frame(char ** buf, Sampler * sampler, u64 ip)
+{
+	int function = sampler->function_of[ip];
+	if (function == -1) return;
+	if (sb_count(*buf)) sb_push(*buf, ';');
+	char frame[256];
+	u32 line = vm_line(sampler->vm, ip);
+	int len = line
+		? snprintf(frame, sizeof(frame), "%s:%u", sampler->vm->symbols[function].name, line)
+		: snprintf(frame, sizeof(frame), "%s", sampler->vm->symbols[function].name);
+	if (len >= (int) sizeof(frame)) len = sizeof(frame) - 1;
+	memcpy(sb_add(*buf, len), frame, len);
+}
+
+static void summarize(Sampler * sampler, Sample_Summary * summary)
+{
+	*summary = (Sample_Summary){0};
+	summary->stack_index = make_map(64);
+	summary->line_index = make_map(64);
+	summary->function_samples = calloc(sb_count(sampler->vm->symbols) + 1, sizeof(u64));
+
+	char * buf = NULL;
+	u64 * sample = sampler->buffer;
+	while (sample < sampler->buffer + sampler->used) {
+		u64 depth = sample[0];
+		u64 ip = sample[1];
+		u64 recorded = depth < SAMPLE_MAX_DEPTH ? depth : SAMPLE_MAX_DEPTH;
+
+		// Outermost first. A return ip follows its call, so the call
+		// is just before it.
+		if (buf) stb__sbn(buf) = 0;
+		if (depth > recorded) {
+			const char * truncated = "[truncated]";
+			memcpy(sb_add(buf, strlen(truncated)), truncated, strlen(truncated));
+		}
+		for (u64 i = recorded; i > 0; i--) {
+			append_frame(&buf, sampler, sample[2 + i - 1] - 1);
+		}
+		append_frame(&buf, sampler, ip);
+
+		u64 index;
+		if (sb_count(buf)) {
+			const char * stack = intern_range(&summary->interns, buf, buf + sb_count(buf));
+			if (!map_index(summary->stack_index, (u64) stack, &index)) {
+				index = sb_count(summary->stacks);
+				map_insert(summary->stack_index, (u64) stack, index);
+				sb_push(summary->stacks, ((Sample_Stack){stack, 0}));
+			}
+			summary->stacks[index].count++;
+		}
+
+		int function = sampler->function_of[ip];
+		if (function == -1) {
+			summary->outside++;
+		} else {
+			summary->function_samples[function]++;
+			u32 line = vm_line(sampler->vm, ip);
+			u64 key = (u64) function << 32 | line;
+			if (!map_index(summary->line_index, key, &index)) {
+				index = sb_count(summary->lines);
+				map_insert(summary->line_index, key, index);
+				sb_push(summary->lines, ((Sample_Line){line, function, 0}));
+			}
+			summary->lines[index].count++;
+		}
+		sample += 2 + recorded;
+	}
+	sb_free(buf);
+}
+
+static void free_summary(Sample_Summary * summary)
+{
+	intern_table_free(&summary->interns);
+	free_map(summary->stack_index);
+	free_map(summary->line_index);
+	sb_free(summary->stacks);
+	sb_free(summary->lines);
+	free(summary->function_samples);
+}
+
+static int compare_lines(const void * a, const void * b)
+{
+	const Sample_Line * x = a;
+	const Sample_Line * y = b;
+	if (x->count != y->count) return x->count < y->count ? 1 : -1;
+	return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static double percent(u64 part, u64 total)
+{
+	return total ? 100.0 * part / total : 0.0;
+}
+
+void sampler_report(Sampler * sampler, FILE * file)
+{
+	Sample_Summary summary;
+	summarize(sampler, &summary);
+	u64 total = sampler->samples;
+	fprintf(file, "sample: %lu samples at %u Hz", total, sampler->hz);
+	if (sampler->dropped) fprintf(file, ", %lu dropped", sampler->dropped);
+	fprintf(file, "\n");
+
+	// Functions sort like lines, with their symbol index standing in
+	// for the line so ties keep program order
+	Sample_Line * functions = NULL;
+	for (int i = 0; i < sb_count(sampler->vm->symbols); i++) {
+		if (summary.function_samples[i]) {
+			sb_push(functions, ((Sample_Line){i, i, summary.function_samples[i]}));
+		}
+	}
+	qsort(functions, sb_count(functions), sizeof(Sample_Line), compare_lines);
+	fprintf(file, "\n%10s %7s  %s\n", "samples", "", "function");
+	for (int i = 0; i < sb_count(functions); i++) {
+		fprintf(file, "%10lu %6.2f%%  %s\n", functions[i].count, percent(functions[i].count, total),
+			sampler->vm->symbols[functions[i].function].name);
+	}
+	sb_free(functions);
+	if (summary.outside) {
+		fprintf(file, "%10lu %6.2f%%  -\n", summary.outside, percent(summary.outside, total));
+	}
+
+	int line_count = sb_count(summary.lines);
+	qsort(summary.lines, line_count, sizeof(Sample_Line), compare_lines);
+	if (line_count > SAMPLE_HOTTEST) line_count = SAMPLE_HOTTEST;
+	fprintf(file, "\n%10s %7s %6s  %s\n", "samples", "", "line", "function");
+	for (int i = 0; i < line_count; i++) {
+		Sample_Line line = summary.lines[i];
+		fprintf(file, "%10lu %6.2f%% ", line.count, percent(line.count, total));
+		if (line.line) fprintf(file, "%6u", line.line);
+		else fprintf(file, "%6s", "?");
+		fprintf(file, "  %s\n", sampler->vm->symbols[line.function].name);
+	}
+	free_summary(&summary);
+}
+
+bool sampler_write_folded(Sampler * sampler, const char * path)
+{
+	FILE * file = fopen(path, "w");
+	if (!file) return false;
+	Sample_Summary summary;
+	summarize(sampler, &summary);
+	for (int i = 0; i < sb_count(summary.stacks); i++) {
+		fprintf(file, "%s %lu\n", summary.stacks[i].stack, summary.stacks[i].count);
+	}
+	free_summary(&summary);
+	bool ok = !ferror(file);
+	ok &= fclose(file) == 0;
+	return ok;
+}
+
+static const char * sample_source =
+	"func kernel(n) {\n"
+	"	let i; let s;\n"
+	"	while i < n {\n"
+	"		set s = s + (i * i) % 7;\n"
+	"		set i = i + 1;\n"
+	"	}\n"
+	"	return s;\n"
+	"}\n"
+	"func main() { let k; let t; while k < ROUNDS { set t = t + kernel(100000); set k = k + 1; } return t; }";
+
+// Compiles sample_source with rounds calls to kernel. The compiler
+// holds the symbol names, so free it after the VM.
+static void load_sample_program(Compiler * compiler, VM * vm, int rounds)
+{
+	char * source = malloc(strlen(sample_source) + 32);
+	const char * rounds_at = strstr(sample_source, "ROUNDS");
+	sprintf(source, "%.*s%d%s", (int) (rounds_at - sample_source), sample_source,
+		rounds, rounds_at + strlen("ROUNDS"));
+	compiler_init(compiler, source);
+	prepare(compiler);
+	fold(compiler);
+	vm_init(vm);
+	compile(compiler, vm);
+	peephole(vm);
+	finish_compilation(compiler);
+	free(source);
+}
+
+// Runs sample_source plainly, then sampled at hz, and returns the
+// sampled run's time over the plain one's
+static double compare_runs(int rounds, u32 hz, void (*check)(Sampler * sampler))
+{
+	Compiler compiler;
+	VM _vm;
+	VM * vm = &_vm;
+	load_sample_program(&compiler, vm, rounds);
+	u64 start = time_ns();
+	vm_run(vm);
+	u64 plain_ns = time_ns() - start;
+	s64 expected = vm->op_stack[vm->op_sp - 1];
+	vm_free(vm);
+	compiler_free(&compiler);
+
+	load_sample_program(&compiler, vm, rounds);
+	Sampler sampler;
+	sampler_init(&sampler, vm, hz);
+	start = time_ns();
+	vm_run_sampled(vm, &sampler);
+	u64 sampled_ns = time_ns() - start;
+	assert(vm->op_stack[vm->op_sp - 1] == expected);
+	check(&sampler);
+	sampler_free(&sampler);
+	vm_free(vm);
+	compiler_free(&compiler);
+	return (double) sampled_ns / plain_ns;
+}
+
+static void check_samples(Sampler * sampler)
+{
+	// CPU timers only fire on scheduler ticks, so there may be fewer
+	// samples than the rate asks for
+	assert(sampler->samples >= 5);
+	assert(sampler->depth == 0);
+	assert(!sampler->dropped);
+
+	Sample_Summary summary;
+	summarize(sampler, &summary);
+	for (int i = 0; i < sb_count(summary.stacks); i++) {
+		const char * stack = summary.stacks[i].stack;
+		assert(strncmp(stack, "main:9", 6) == 0);
+		if (strstr(stack, "kernel")) assert(strncmp(stack, "main:9;kernel:", 14) == 0);
+	}
+	u64 counted = summary.outside;
+	for (int i = 0; i < sb_count(summary.lines); i++) {
+		Sample_Line line = summary.lines[i];
+		const char * name = sampler->vm->symbols[line.function].name;
+		if (strcmp(name, "kernel") == 0) assert(line.line >= 1 && line.line <= 7);
+		else assert(line.line == 9);
+		counted += line.count;
+	}
+	assert(counted == sampler->samples);
+	free_summary(&summary);
+}
+
+static u64 bench_samples;
+
+static void count_samples(Sampler * sampler)
+{
+	bench_samples = sampler->samples;
+}
+
+void sample_test()
+{
+	compare_runs(40, SAMPLE_HZ, check_samples);
+}
+
+void sample_bench()
+{
+	double ratio = compare_runs(100, SAMPLE_HZ, count_samples);
+	printf("sample: %+.1f%% time sampling at %u Hz (%lu samples)\n",
+		100.0 * (ratio - 1), SAMPLE_HZ, bench_samples);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Sampling profiler
+ *
+ * vm_run_sampled keeps the ip of the running instruction, and where
+ * on the call stack each live call's return ip is, in the sampler as
+ * it goes. setitimer(ITIMER_PROF) raises SIGPROF every so often, and
+ * the handler copies the ip and the return ips pushed by INST_CALL
+ * into a buffer reserved up front, so it never allocates. Samples are
+ * only turned into function names and source lines once the run is
+ * over.
+ *
+ * The timer and handler belong to the whole process, so only one
+ * sampled run may be going at a time.
+ */
+
+#define SAMPLE_HZ 1000
+// Deeper stacks keep their innermost frames
+#define SAMPLE_MAX_DEPTH 64
+#define SAMPLE_BUFFER_SIZE (1 << 22) // In u64s
+
+typedef struct Sampler {
+	// Written by vm_run_sampled, read by the signal handler
+	volatile u64 ip;
+	volatile u64 depth;
+	volatile u64 * frames; // Call stack index of each live return ip
+
+	VM * vm;
+	u32 hz;
+	int * function_of; // Function of each instruction, -1 for none
+	// Each sample is the call depth, then the ip, then up to
+	// SAMPLE_MAX_DEPTH return ips, innermost first
+	u64 * buffer;
+	volatile size_t used;
+	volatile u64 samples;
+	volatile u64 dropped; // For want of buffer space
+} Sampler;
+
+// vm's program must be loaded, with its symbols and, for source
+// lines, its line table
+void sampler_init(Sampler * sampler, VM * vm, u32 hz);
+void sampler_free(Sampler * sampler);
+
+// Called by vm_run_sampled
+void sampler_start(Sampler * sampler);
+void sampler_stop(Sampler * sampler);
+
+void sampler_report(Sampler * sampler, FILE * file);
+// One line per distinct stack, "main:9;fib:3 12", each frame a
+// function and the line it was running. Returns false if path can't
+// be written.
+bool sampler_write_folded(Sampler * sampler, const char * path);
+
+void sample_test();
+void sample_bench();
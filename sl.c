@@ -0,0 +1,619 @@
+// strdup, before sl.h pulls in any system header
+#define _POSIX_C_SOURCE 200809L
+#include "sl.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "error.h"
+#include "fold.h"
+#include "lexer.h"
+#include "peephole.h"
+#include "vm.h"
+
+struct SL_Function {
+	char * name;
+	u64 ip;
+	int arg_count;
+	SL_Program * program;
+};
+
+struct SL_Program {
+	Inst * insts; // Shared by every VM
+	SL_Function * functions;
+	// A lone HALT, used as the return address of calls from outside
+	u64 halt_ip;
+};
+
+struct SL_VM {
+	VM vm;
+	SL_Program * program;
+};
+
+static SL_Status fail(SL_Error * error, SL_Status status, const char * fmt, ...)
+{
+	if (error) {
+		va_list args;
+		va_start(args, fmt);
+		error->status = status;
+		vsnprintf(error->message, sizeof(error->message), fmt, args);
+		va_end(args);
+	}
+	return status;
+}
+
+static void succeed(SL_Error * error)
+{
+	if (error) {
+		error->status = SL_OK;
+		error->message[0] = '\0';
+	}
+}
+
+// Compile errors longjmp out of here, leaving the caller to free
+// whatever was made
+static bool compile_trapped(Compiler * compiler, VM * vm, SL_Error * error)
+{
+	Error_Trap trap;
+	if (setjmp(trap.jump)) {
+		fail(error, SL_COMPILE_ERROR, "%s", trap.message);
+		return false;
+	}
+	error_trap_set(&trap);
+	prepare(compiler);
+	fold(compiler);
+	compile_functions(compiler, vm);
+	vm->ip = sb_count(vm->insts);
+	EMIT(INST_HALT);
+	peephole(vm);
+	error_trap_clear(&trap);
+	return true;
+}
+
+SL_Program * sl_compile(const char * source, SL_Error * error)
+{
+	lex_init();
+	Compiler compiler;
+	compiler_init(&compiler, source);
+
+	// Only the instruction stream is used, the program's VMs bring
+	// their own stacks
+	VM _vm = {0};
+	VM * vm = &_vm;
+	if (!compile_trapped(&compiler, vm, error)) {
+		sb_free(vm->insts);
+		sb_free(vm->symbols);
+		sb_free(vm->lines);
+		compiler_free(&compiler);
+		return NULL;
+	}
+
+	SL_Program * program = malloc(sizeof(SL_Program));
+	program->insts = vm->insts;
+	program->functions = NULL;
+	program->halt_ip = vm->ip;
+	// Every function entry carries a symbol, relocated by peephole
+	for (int i = 0; i < sb_count(vm->symbols); i++) {
+		Function * func;
+		map_index(compiler.function_map, (u64) vm->symbols[i].name, (u64*) &func);
+		SL_Function function = {strdup(func->name), vm->symbols[i].ip, sb_count(func->arg_names), program};
+		sb_push(program->functions, function);
+	}
+	sb_free(vm->symbols);
+	sb_free(vm->lines);
+	compiler_free(&compiler);
+	succeed(error);
+	return program;
+}
+
+void sl_program_free(SL_Program * program)
+{
+	for (int i = 0; i < sb_count(program->functions); i++) {
+		free(program->functions[i].name);
+	}
+	sb_free(program->functions);
+	sb_free(program->insts);
+	free(program);
+}
+
+SL_VM * sl_vm_new(SL_Program * program)
+{
+	SL_VM * vm = malloc(sizeof(SL_VM));
+	vm_init(&vm->vm);
+	vm->vm.insts = program->insts;
+	vm->program = program;
+	sl_vm_reset(vm);
+	return vm;
+}
+
+void sl_vm_free(SL_VM * vm)
+{
+	vm->vm.insts = NULL; // Belongs to the program
+	vm_free(&vm->vm);
+	free(vm);
+}
+
+void sl_vm_reset(SL_VM * vm)
+{
+	vm->vm.op_sp   = 0;
+	vm->vm.call_sp = 0;
+	vm->vm.fp      = 0;
+	vm->vm.ip      = vm->program->halt_ip;
+}
+
+SL_Function * sl_function(SL_Program * program, const char * name, int nargs, SL_Error * error)
+{
+	SL_Function * func = NULL;
+	for (int i = 0; i < sb_count(program->functions); i++) {
+		if (strcmp(program->functions[i].name, name) == 0) {
+			func = &program->functions[i];
+			break;
+		}
+	}
+	if (!func) {
+		fail(error, SL_BAD_FUNCTION, "Function %s does not exist", name);
+		return NULL;
+	}
+	if (nargs != func->arg_count) {
+		fail(error, SL_BAD_FUNCTION, "Called procedure %s with %d arguments, expected %d",
+			func->name, nargs, func->arg_count);
+		return NULL;
+	}
+	succeed(error);
+	return func;
+}
+
+static s64 run_function(VM * vm, SL_Function * func, const int64_t * args)
+{
+	// Set up the call stack the way INST_CALL would
+	vm->op_sp = 0;
+	vm->call_sp = 0;
+	vm->fp = 0;
+	for (int i = 0; i < func->arg_count; i++) {
+		vm->call_stack[vm->call_sp++] = args[i];
+	}
+	vm->call_stack[vm->call_sp++] = func->program->halt_ip;
+	vm->ip = func->ip;
+	vm_run(vm);
+	return vm->op_sp ? vm->op_stack[vm->op_sp - 1] : 0;
+}
+
+// run_function, with runtime errors reported instead of exiting.
+// Every run starts from empty stacks, so nothing needs undoing.
+static SL_Status run_trapped(VM * vm, SL_Function * func, const int64_t * args,
+	int64_t * result, SL_Error * error)
+{
+	Error_Trap trap;
+	if (setjmp(trap.jump)) {
+		*result = 0;
+		return fail(error, SL_RUNTIME_ERROR, "%s", trap.message);
+	}
+	error_trap_set(&trap);
+	*result = run_function(vm, func, args);
+	error_trap_clear(&trap);
+	return SL_OK;
+}
+
+SL_Status sl_call(SL_VM * vm, SL_Function * func, const int64_t * args,
+	int64_t * result, SL_Error * error)
+{
+	if (func->program != vm->program) {
+		*result = 0;
+		return fail(error, SL_BAD_FUNCTION, "Function %s belongs to another program", func->name);
+	}
+	SL_Status status = run_trapped(&vm->vm, func, args, result, error);
+	sl_vm_reset(vm);
+	if (status == SL_OK) succeed(error);
+	return status;
+}
+
+/*
+ * Batch execution
+ *
+ * Every worker starts a batch owning an equal share of the
+ * invocations and takes them from the front of its share a chunk at
+ * a time. A worker that runs out steals the back half of the largest
+ * share left, so uneven invocations still keep every worker busy.
+ * Each worker keeps one VM for every batch it runs.
+ */
+
+#define BATCH_CHUNK 16
+
+typedef struct Worker {
+	pthread_t thread;
+	SL_Pool * pool;
+	pthread_mutex_t lock; // Guards begin and end
+	int begin;
+	int end;
+} Worker;
+
+struct SL_Pool {
+	Worker * workers;
+	int count;
+
+	pthread_mutex_t batch_lock; // Held by the caller of a running batch
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	u64 generation; // Bumped for every batch
+	int busy;       // Workers still in the current batch
+	bool quit;
+
+	SL_Function * func;
+	const int64_t * inputs;
+	int64_t * outputs;
+	SL_Error error; // The batch's first failure, guarded by lock
+};
+
+// Moves the back half of the fullest other share into worker's own
+static bool steal(Worker * worker)
+{
+	SL_Pool * pool = worker->pool;
+	Worker * victim = NULL;
+	int most = 0;
+	for (int i = 0; i < pool->count; i++) {
+		Worker * other = &pool->workers[i];
+		if (other == worker) continue;
+		pthread_mutex_lock(&other->lock);
+		int left = other->end - other->begin;
+		pthread_mutex_unlock(&other->lock);
+		if (left > most) {
+			victim = other;
+			most = left;
+		}
+	}
+	if (!victim) return false;
+
+	pthread_mutex_lock(&victim->lock);
+	int left = victim->end - victim->begin;
+	int begin = victim->end - (left + 1) / 2;
+	int end = victim->end;
+	victim->end = begin;
+	pthread_mutex_unlock(&victim->lock);
+	if (begin >= end) return true; // Emptied meanwhile, look again
+
+	pthread_mutex_lock(&worker->lock);
+	worker->begin = begin;
+	worker->end = end;
+	pthread_mutex_unlock(&worker->lock);
+	return true;
+}
+
+static void run_share(Worker * worker, VM * vm)
+{
+	SL_Pool * pool = worker->pool;
+	int nargs = pool->func->arg_count;
+	while (1) {
+		pthread_mutex_lock(&worker->lock);
+		int begin = worker->begin;
+		int end = begin + BATCH_CHUNK < worker->end ? begin + BATCH_CHUNK : worker->end;
+		worker->begin = end;
+		pthread_mutex_unlock(&worker->lock);
+
+		if (begin >= end) {
+			if (steal(worker)) continue;
+			return;
+		}
+		for (int i = begin; i < end; i++) {
+			SL_Error error;
+			SL_Status status = run_trapped(vm, pool->func,
+				pool->inputs + (size_t) i * nargs, &pool->outputs[i], &error);
+			if (status != SL_OK) {
+				pthread_mutex_lock(&pool->lock);
+				if (pool->error.status == SL_OK) pool->error = error;
+				pthread_mutex_unlock(&pool->lock);
+			}
+		}
+	}
+}
+
+static void * worker_main(void * data)
+{
+	Worker * worker = (Worker*) data;
+	SL_Pool * pool = worker->pool;
+	VM vm;
+	vm_init(&vm);
+
+	u64 seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->quit && pool->generation == seen) {
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+		if (pool->quit) break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		vm.insts = pool->func->program->insts;
+		run_share(worker, &vm);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	vm.insts = NULL; // Belongs to the program
+	vm_free(&vm);
+	return NULL;
+}
+
+SL_Pool * sl_pool_new(int workers)
+{
+	if (workers <= 0) {
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (workers <= 0) workers = 1;
+	}
+	SL_Pool * pool = calloc(1, sizeof(SL_Pool));
+	pool->workers = calloc(workers, sizeof(Worker));
+	pool->count = workers;
+	pthread_mutex_init(&pool->batch_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (int i = 0; i < workers; i++) {
+		Worker * worker = &pool->workers[i];
+		worker->pool = pool;
+		pthread_mutex_init(&worker->lock, NULL);
+		if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+			fatal("Couldn't start worker thread %d", i);
+		}
+	}
+	return pool;
+}
+
+void sl_pool_free(SL_Pool * pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->count; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+		pthread_mutex_destroy(&pool->workers[i].lock);
+	}
+	pthread_mutex_destroy(&pool->batch_lock);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->workers);
+	free(pool);
+}
+
+SL_Status sl_pool_run(SL_Pool * pool, SL_Function * func,
+	const int64_t * inputs, int64_t * outputs, int n, SL_Error * error)
+{
+	pthread_mutex_lock(&pool->batch_lock);
+	pthread_mutex_lock(&pool->lock);
+	pool->error.status = SL_OK;
+	pool->func    = func;
+	pool->inputs  = inputs;
+	pool->outputs = outputs;
+	for (int i = 0; i < pool->count; i++) {
+		pool->workers[i].begin = (s64) n * i / pool->count;
+		pool->workers[i].end   = (s64) n * (i + 1) / pool->count;
+	}
+	pool->busy = pool->count;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	while (pool->busy > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	SL_Status status = pool->error.status;
+	if (status != SL_OK) {
+		fail(error, status, "%s", pool->error.message);
+	} else {
+		succeed(error);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pool->batch_lock);
+	return status;
+}
+
+static SL_Pool * default_pool;
+
+static void make_default_pool()
+{
+	default_pool = sl_pool_new(0);
+}
+
+SL_Status sl_run_batch(SL_Function * func,
+	const int64_t * inputs, int64_t * outputs, int n, SL_Error * error)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, make_default_pool);
+	return sl_pool_run(default_pool, func, inputs, outputs, n, error);
+}
+
+static const char * sl_test_source =
+	"func score(a, b) { if a > b { return a * 3 - b; } return b * 2 + a; }\n"
+	"func square(x) { return x * x; }\n"
+	"func twice(y) { return square(y) + square(y); }\n"
+	"func nothing() { }\n";
+
+static int64_t expected_score(int64_t a, int64_t b)
+{
+	return a > b ? a * 3 - b : b * 2 + a;
+}
+
+// Calls func on vm, asserting that it succeeds
+static int64_t call(SL_VM * vm, SL_Function * func, const int64_t * args)
+{
+	int64_t result;
+	SL_Status status = sl_call(vm, func, args, &result, NULL);
+	assert(status == SL_OK);
+	return result;
+}
+
+void sl_test()
+{
+	SL_Program * program = sl_compile(sl_test_source, NULL);
+	SL_Function * score  = sl_function(program, "score", 2, NULL);
+	SL_Function * square = sl_function(program, "square", 1, NULL);
+	SL_Function * twice  = sl_function(program, "twice", 1, NULL);
+	SL_Function * nothing = sl_function(program, "nothing", 0, NULL);
+	SL_VM * first  = sl_vm_new(program);
+	SL_VM * second = sl_vm_new(program);
+	for (int64_t i = 0; i < 100; i++) {
+		int64_t args[2] = {i, 50};
+		assert(call(first, score, args) == expected_score(i, 50));
+		args[1] = 100 - i;
+		assert(call(second, score, args) == expected_score(i, 100 - i));
+	}
+	int64_t arg = 7;
+	assert(call(first, twice, &arg) == 98);
+	assert(call(second, nothing, NULL) == 0);
+	sl_vm_reset(first);
+	assert(call(first, square, &arg) == 49);
+	sl_vm_free(first);
+	sl_vm_free(second);
+	sl_program_free(program);
+}
+
+void sl_error_test()
+{
+	SL_Error error;
+	assert(sl_compile("func f( { return 1; }", &error) == NULL);
+	assert(error.status == SL_COMPILE_ERROR);
+	assert(error.message[0] != '\0');
+	assert(sl_compile("func f() { return g(); }", &error) == NULL);
+	assert(error.status == SL_COMPILE_ERROR);
+
+	SL_Program * program = sl_compile(
+		"func divide(a, b) { return a / b; }\n"
+		"func down(n) { return down(n + 1) + 1; }\n", &error);
+	assert(program && error.status == SL_OK);
+	assert(sl_function(program, "missing", 0, &error) == NULL);
+	assert(error.status == SL_BAD_FUNCTION);
+	assert(sl_function(program, "divide", 1, &error) == NULL);
+	assert(error.status == SL_BAD_FUNCTION);
+	SL_Function * divide = sl_function(program, "divide", 2, NULL);
+	SL_Function * down   = sl_function(program, "down", 1, NULL);
+
+	// The VM is ready for the next call after every failure
+	SL_VM * vm = sl_vm_new(program);
+	int64_t result = 1;
+	int64_t args[2] = {7, 0};
+	assert(sl_call(vm, divide, args, &result, &error) == SL_RUNTIME_ERROR);
+	assert(result == 0);
+	assert(strstr(error.message, "Division by zero"));
+	args[1] = 2;
+	assert(call(vm, divide, args) == 3);
+	assert(sl_call(vm, down, args, &result, &error) == SL_RUNTIME_ERROR);
+	assert(strstr(error.message, "overflow"));
+	assert(call(vm, divide, args) == 3);
+
+	SL_Program * other = sl_compile(sl_test_source, NULL);
+	SL_Function * square = sl_function(other, "square", 1, NULL);
+	assert(sl_call(vm, square, args, &result, &error) == SL_BAD_FUNCTION);
+	sl_program_free(other);
+
+	// Failed invocations don't stop the rest of a batch
+	int64_t inputs[8] = {8, 2, 1, 0, 9, 3, 5, 0};
+	int64_t outputs[4];
+	SL_Pool * pool = sl_pool_new(2);
+	assert(sl_pool_run(pool, divide, inputs, outputs, 4, &error) == SL_RUNTIME_ERROR);
+	assert(strstr(error.message, "Division by zero"));
+	assert(outputs[0] == 4 && outputs[1] == 0 && outputs[2] == 3 && outputs[3] == 0);
+	assert(sl_pool_run(pool, divide, inputs, outputs, 1, &error) == SL_OK);
+	assert(error.status == SL_OK);
+	sl_pool_free(pool);
+
+	sl_vm_free(vm);
+	sl_program_free(program);
+}
+
+// Invocations cost very different amounts, so workers have to steal
+static const char * sl_batch_source =
+	"func work(n, k) { let i; let s; while i < n { set s = s + i * k; set i = i + 1; } return s; }\n";
+
+static int64_t expected_work(int64_t n, int64_t k)
+{
+	return n > 0 ? n * (n - 1) / 2 * k : 0;
+}
+
+void sl_batch_test()
+{
+	SL_Program * program = sl_compile(sl_batch_source, NULL);
+	SL_Function * work = sl_function(program, "work", 2, NULL);
+	int n = 5003;
+	int64_t * inputs  = malloc(sizeof(int64_t) * 2 * n);
+	int64_t * outputs = malloc(sizeof(int64_t) * n);
+	for (int i = 0; i < n; i++) {
+		inputs[2 * i]     = i < n / 4 ? (i * 7) % 2000 : i % 5;
+		inputs[2 * i + 1] = i;
+	}
+	for (int workers = 1; workers <= 4; workers++) {
+		SL_Pool * pool = sl_pool_new(workers);
+		for (int round = 0; round < 2; round++) {
+			memset(outputs, 0, sizeof(int64_t) * n);
+			assert(sl_pool_run(pool, work, inputs, outputs, n, NULL) == SL_OK);
+			for (int i = 0; i < n; i++) {
+				assert(outputs[i] == expected_work(inputs[2 * i], inputs[2 * i + 1]));
+			}
+		}
+		// Fewer invocations than workers
+		sl_pool_run(pool, work, inputs, outputs, 1, NULL);
+		assert(outputs[0] == 0);
+		sl_pool_free(pool);
+	}
+	sl_run_batch(work, inputs, outputs, n, NULL);
+	assert(outputs[n - 1] == expected_work(inputs[2 * (n - 1)], inputs[2 * (n - 1) + 1]));
+	free(inputs);
+	free(outputs);
+	sl_program_free(program);
+}
+
+void sl_batch_bench()
+{
+	SL_Program * program = sl_compile(sl_batch_source, NULL);
+	SL_Function * work = sl_function(program, "work", 2, NULL);
+	int n = 50000;
+	int64_t * inputs  = malloc(sizeof(int64_t) * 2 * n);
+	int64_t * outputs = malloc(sizeof(int64_t) * n);
+	for (int i = 0; i < n; i++) {
+		inputs[2 * i]     = 100 + i % 400;
+		inputs[2 * i + 1] = i;
+	}
+	int cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores <= 0) cores = 1;
+	u64 single_ns = 0;
+	for (int workers = 1; workers <= cores; workers = workers * 2 > cores && workers < cores ? cores : workers * 2) {
+		SL_Pool * pool = sl_pool_new(workers);
+		u64 start = time_ns();
+		sl_pool_run(pool, work, inputs, outputs, n, NULL);
+		u64 elapsed = time_ns() - start;
+		if (workers == 1) single_ns = elapsed;
+		printf("batch: %d invocations on %d workers, %.1f ms, %.2fx\n",
+			n, workers, elapsed / 1e6, (double) single_ns / elapsed);
+		sl_pool_free(pool);
+	}
+	free(inputs);
+	free(outputs);
+	sl_program_free(program);
+}
+
+void sl_bench()
+{
+	SL_Program * program = sl_compile(sl_test_source, NULL);
+	SL_Function * score = sl_function(program, "score", 2, NULL);
+	SL_VM * vm = sl_vm_new(program);
+
+	#define SL_BENCH_CALLS 10000000
+	int64_t sum = 0;
+	u64 start = time_ns();
+	for (int64_t i = 0; i < SL_BENCH_CALLS; i++) {
+		int64_t args[2] = {i & 1023, 512};
+		int64_t result;
+		sl_call(vm, score, args, &result, NULL);
+		sum += result;
+	}
+	u64 elapsed = time_ns() - start;
+	printf("embedding: %d calls, %.1f M calls/s (checksum %ld)\n",
+		SL_BENCH_CALLS, SL_BENCH_CALLS / (elapsed / 1e9) / 1e6, sum);
+
+	sl_vm_free(vm);
+	sl_program_free(program);
+}
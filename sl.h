@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Embedding API
+ *
+ * sl_compile turns source into a program whose instructions are
+ * never written again, so any number of VMs can share it. Each VM
+ * reserves its own stacks when it's made, and sl_call allocates
+ * nothing, so one function can be called over and over with
+ * different arguments.
+ *
+ * Errors don't end the process. Every call that can fail fills in an
+ * SL_Error, when given one, and reports failure through its result.
+ * A VM that hit a runtime error is ready for the next call. A VM may
+ * be made on one thread and used on another, as long as only one
+ * thread uses it at a time.
+ */
+
+typedef struct SL_Program SL_Program;
+typedef struct SL_Function SL_Function;
+typedef struct SL_VM SL_VM;
+typedef struct SL_Pool SL_Pool;
+
+typedef enum SL_Status {
+	SL_OK,
+	SL_COMPILE_ERROR,
+	SL_BAD_FUNCTION, // No such function, or the wrong argument count
+	SL_RUNTIME_ERROR,
+} SL_Status;
+
+typedef struct SL_Error {
+	SL_Status status;
+	char message[256];
+} SL_Error;
+
+// NULL if the source doesn't compile. The program doesn't need a
+// main function.
+SL_Program * sl_compile(const char * source, SL_Error * error);
+// Free every VM made for the program first
+void sl_program_free(SL_Program * program);
+
+// Looks up the function called name once, so calls don't have to.
+// NULL if there isn't one taking nargs arguments. The handle lives
+// as long as the program.
+SL_Function * sl_function(SL_Program * program, const char * name, int nargs, SL_Error * error);
+
+SL_VM * sl_vm_new(SL_Program * program);
+void sl_vm_free(SL_VM * vm);
+// Empties the stacks. sl_call does this itself, so it's only needed
+// to hand a VM back in the state sl_vm_new left it.
+void sl_vm_reset(SL_VM * vm);
+
+// Runs func, from the VM's own program, with the nargs arguments it
+// was looked up with. result gets what it returned, or 0 if it
+// returned nothing or failed.
+SL_Status sl_call(SL_VM * vm, SL_Function * func, const int64_t * args,
+	int64_t * result, SL_Error * error);
+
+/* Batches call one function n times, spread over a pool of worker
+ * threads that each keep their own VM. inputs holds the function's
+ * arguments for each invocation, one after another, and outputs gets
+ * one result per invocation. Returns once the whole batch has run.
+ * An invocation that fails gets 0 and the batch carries on, the
+ * first failure is the one reported. A pool runs one batch at a
+ * time, later callers wait their turn.
+ */
+
+// A pool with one worker per core if workers is 0
+SL_Pool * sl_pool_new(int workers);
+void sl_pool_free(SL_Pool * pool);
+SL_Status sl_pool_run(SL_Pool * pool, SL_Function * func,
+	const int64_t * inputs, int64_t * outputs, int n, SL_Error * error);
+// sl_pool_run on a pool made the first time it's needed, with one
+// worker per core
+SL_Status sl_run_batch(SL_Function * func,
+	const int64_t * inputs, int64_t * outputs, int n, SL_Error * error);
+
+void sl_test();
+void sl_error_test();
+void sl_batch_test();
+void sl_bench();
+void sl_batch_bench();
@@ -1,174 +1,336 @@
 #include "vm.h"
 
-#define UNARY_OPERATOR(_OP_) \
-	s64 x = vm->op_stack[--vm->op_sp]; \
-	vm->op_stack[vm->op_sp++] = (_OP_ x);
-
-#define BINARY_OPERATOR(_OP_)	\
-	s64 y = vm->op_stack[--vm->op_sp]; \
-	s64 x = vm->op_stack[--vm->op_sp]; \
-	vm->op_stack[vm->op_sp++] = (x _OP_ y);
-
-void operator_neg(VM * vm) { UNARY_OPERATOR(-);   }
-void operator_add(VM * vm) { BINARY_OPERATOR(+);  }
-void operator_sub(VM * vm) { BINARY_OPERATOR(-);  }
-void operator_mul(VM * vm) { BINARY_OPERATOR(*);  }
-void operator_div(VM * vm) { BINARY_OPERATOR(/);  }
-void operator_mod(VM * vm) { BINARY_OPERATOR(%);  }
-void operator_eq (VM * vm) { BINARY_OPERATOR(==); }
-void operator_gt (VM * vm) { BINARY_OPERATOR(>);  }
-void operator_lt (VM * vm) { BINARY_OPERATOR(<);  }
-void operator_gte(VM * vm) { BINARY_OPERATOR(>=); }
-void operator_lte(VM * vm) { BINARY_OPERATOR(<=); }
-
-void (*operators[])(VM*) = {
-	[OP_NEG] = operator_neg,
-	[OP_ADD] = operator_add,
-	[OP_SUB] = operator_sub,
-	[OP_MUL] = operator_mul,
-	[OP_DIV] = operator_div,
-	[OP_MOD] = operator_mod,
-	[OP_EQ]  = operator_eq,
-	[OP_GT]  = operator_gt,
-	[OP_LT]  = operator_lt,
-	[OP_GTE] = operator_gte,
-	[OP_LTE] = operator_lte,
-};
+#include <sys/mman.h>
 
-#undef BINARY_OPERATOR
-#undef UNARY_OPERATOR
+#include "fold.h"
+#include "jit.h"
+#include "peephole.h"
+#include "profile.h"
+#include "sample.h"
 
 char * inst_type_to_str[] = {
 	[INST_HALT]   = "HALT",
 	[INST_NOP]    = "NOP",
 	[INST_SYMBOL] = "SYMBOL",
-	[INST_OP]     = "OP",
+	[INST_NEG]    = "NEG",
+	[INST_LNEG]   = "LNEG",
+	#define BINARY_INST_STR(name, op)         \
+		[INST_##name]       = #name,          \
+		[INST_##name##_I]   = #name "_I",     \
+		[INST_##name##_LI]  = #name "_LI",    \
+		[INST_##name##_LL]  = #name "_LL",
+	BINARY_INSTS(BINARY_INST_STR)
+	#undef BINARY_INST_STR
 	[INST_PUSHC]  = "PUSHC",
 	[INST_POPC]   = "POPC",
 	[INST_PUSHO]  = "PUSHO",
 	[INST_POPO]   = "POPO",
 	[INST_LOAD]   = "LOAD",
 	[INST_SAVE]   = "SAVE",
+	[INST_LOADL]  = "LOADL",
+	[INST_STOREL] = "STOREL",
+	[INST_ENTER]  = "ENTER",
+	[INST_CALL]   = "CALL",
+	[INST_RET]    = "RET",
 	[INST_JMP]    = "JMP",
 	[INST_JZ]     = "JZ",
 	[INST_JNZ]    = "JNZ",
 	[INST_JIP]    = "JIP",
 	[INST_JSIP]   = "JSIP",
+	#define COMPARE_JUMP_STR(name, op)            \
+		[INST_JZ_##name]      = "JZ_" #name,      \
+		[INST_JZ_##name##_I]  = "JZ_" #name "_I",  \
+		[INST_JZ_##name##_LI] = "JZ_" #name "_LI", \
+		[INST_JZ_##name##_LL] = "JZ_" #name "_LL",
+	COMPARE_INSTS(COMPARE_JUMP_STR)
+	#undef COMPARE_JUMP_STR
 	[INST_PRINT]  = "PRINT",
 };
 
-void print_instruction(Inst inst)
+Inst_Type op_to_inst[] = {
+	[OP_NEG]  = INST_NEG,
+	[OP_LNEG] = INST_LNEG,
+	[OP_ADD]  = INST_ADD,
+	[OP_SUB]  = INST_SUB,
+	[OP_MUL]  = INST_MUL,
+	[OP_DIV]  = INST_DIV,
+	[OP_MOD]  = INST_MOD,
+	[OP_EQ]   = INST_EQ,
+	[OP_GT]   = INST_GT,
+	[OP_LT]   = INST_LT,
+	[OP_GTE]  = INST_GTE,
+	[OP_LTE]  = INST_LTE,
+};
+
+void fprint_instruction(FILE * file, Inst inst)
 {
-	printf("%s ", inst_type_to_str[inst.type]);
+	fprintf(file, "%s ", inst_type_to_str[inst.type]);
 	switch (inst.type) {
-	case INST_OP:
-		printf("%s\n", op_to_str[inst.arg0.op_type]);
+	#define BINARY_INST_PRINT(name, op)                                  \
+	case INST_##name##_I:                                                \
+		fprintf(file, "%ld\n", inst.arg1.literal);                       \
+		break;                                                           \
+	case INST_##name##_LI:                                               \
+		fprintf(file, "%ld %ld\n", inst.arg0.local, inst.arg1.literal);  \
+		break;                                                           \
+	case INST_##name##_LL:                                               \
+		fprintf(file, "%ld %ld\n", inst.arg0.local, inst.arg1.local);    \
+		break;
+	BINARY_INSTS(BINARY_INST_PRINT)
+	#undef BINARY_INST_PRINT
+	#define COMPARE_JUMP_PRINT(name, op)                                    \
+	case INST_JZ_##name:                                                    \
+		fprintf(file, "%lu\n", inst.arg2.jmp_ip);                           \
+		break;                                                              \
+	case INST_JZ_##name##_I:                                                \
+		fprintf(file, "%ld %lu\n", inst.arg1.literal, inst.arg2.jmp_ip);    \
+		break;                                                              \
+	case INST_JZ_##name##_LI:                                               \
+		fprintf(file, "%ld %ld %lu\n", inst.arg0.local, inst.arg1.literal,  \
+			inst.arg2.jmp_ip);                                              \
+		break;                                                              \
+	case INST_JZ_##name##_LL:                                               \
+		fprintf(file, "%ld %ld %lu\n", inst.arg0.local, inst.arg1.local,    \
+			inst.arg2.jmp_ip);                                              \
 		break;
+	COMPARE_INSTS(COMPARE_JUMP_PRINT)
+	#undef COMPARE_JUMP_PRINT
 	case INST_JMP:
 	case INST_JZ:
 	case INST_JNZ:
 	case INST_JSIP:
-		printf("%lu\n", inst.arg0.jmp_ip);
+		fprintf(file, "%lu\n", inst.arg0.jmp_ip);
 		break;
 	case INST_LOAD:
 	case INST_SAVE:
-		printf("%lu\n", inst.arg0.offset);
+		fprintf(file, "%lu\n", inst.arg0.offset);
+		break;
+	case INST_LOADL:
+	case INST_STOREL:
+		fprintf(file, "%ld\n", inst.arg0.local);
+		break;
+	case INST_CALL:
+		fprintf(file, "%lu %ld\n", inst.arg0.jmp_ip, inst.arg1.literal);
 		break;
 	case INST_PUSHC:
 	case INST_PUSHO:
-		printf("%ld\n", inst.arg0.literal);
+	case INST_ENTER:
+	case INST_RET:
+		fprintf(file, "%ld\n", inst.arg0.literal);
 		break;
 	default:
-		printf("\n");
+		fprintf(file, "\n");
 		break;
 	}
 }
 
-int vm_init(VM * vm)
+void print_instruction(Inst inst)
 {
-	vm->op_sp   = 0;
-	vm->call_sp = 0;
+	fprint_instruction(stdout, inst);
+}
+
+u64 * inst_jump_target(Inst * inst)
+{
+	switch (inst->type) {
+	case INST_JMP:
+	case INST_JZ:
+	case INST_JNZ:
+	case INST_JSIP:
+	case INST_CALL:
+		return &inst->arg0.jmp_ip;
+	#define COMPARE_JUMP_TARGET(name, op) \
+	case INST_JZ_##name:                  \
+	case INST_JZ_##name##_I:              \
+	case INST_JZ_##name##_LI:             \
+	case INST_JZ_##name##_LL:
+	COMPARE_INSTS(COMPARE_JUMP_TARGET)
+	#undef COMPARE_JUMP_TARGET
+		return &inst->arg2.jmp_ip;
+	default:
+		return NULL;
+	}
+}
+
+static int compare_u64(const void * a, const void * b)
+{
+	u64 x = *(const u64*) a;
+	u64 y = *(const u64*) b;
+	return x < y ? -1 : x > y;
+}
+
+u64 * vm_function_ends(VM * vm)
+{
+	u64 count = sb_count(vm->insts);
+	u64 * ends = calloc(count + 1, sizeof(u64));
+
+	// A function runs up to the next one, or to the entry stub
+	int symbol_count = sb_count(vm->symbols);
+	u64 * starts = malloc((symbol_count + 2) * sizeof(u64));
+	for (int i = 0; i < symbol_count; i++) {
+		starts[i] = vm->symbols[i].ip;
+	}
+	starts[symbol_count] = vm->ip;
+	starts[symbol_count + 1] = count;
+	qsort(starts, symbol_count + 2, sizeof(u64), compare_u64);
+	bool * is_function = calloc(count + 1, sizeof(bool));
+	for (int i = 0; i < symbol_count; i++) {
+		is_function[vm->symbols[i].ip] = true;
+	}
+	for (int i = 0; i < symbol_count + 1; i++) {
+		u64 start = starts[i];
+		if (!is_function[start]) continue;
+		int next = i + 1;
+		while (next < symbol_count + 2 && starts[next] == start) next++;
+		if (next < symbol_count + 2) ends[start] = starts[next];
+	}
+	free(is_function);
+	free(starts);
+	return ends;
+}
+
+u32 vm_line(VM * vm, u64 ip)
+{
+	// Last entry at or before ip
+	int lo = 0;
+	int hi = sb_count(vm->lines);
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (vm->lines[mid].ip <= ip) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo ? vm->lines[lo - 1].line : 0;
+}
+
+void vm_init(VM * vm)
+{
+	vm_init_stacks(vm, VM_STACK_INITIAL, VM_STACK_LIMIT);
+}
+
+void vm_init_stacks(VM * vm, size_t initial, size_t limit)
+{
+	vm_stack_init(&vm->op_region, "Op stack", initial, limit);
+	vm_stack_init(&vm->call_region, "Call stack", initial, limit);
+	vm->op_stack   = vm->op_region.base;
+	vm->op_sp      = 0;
+	vm->call_stack = vm->call_region.base;
+	vm->call_sp    = 0;
+	vm->fp         = 0;
 	vm->ip      = 0;
 	vm->insts   = NULL;
+	vm->symbols = NULL;
+	vm->lines   = NULL;
+	vm->image   = NULL;
+	vm->image_size = 0;
+	vm->jit     = NULL;
 }
 
+void vm_free(VM * vm)
+{
+	vm_stack_free(&vm->op_region);
+	vm_stack_free(&vm->call_region);
+	if (vm->image) {
+		munmap(vm->image, vm->image_size);
+	} else {
+		sb_free(vm->insts);
+	}
+	sb_free(vm->symbols);
+	sb_free(vm->lines);
+	if (vm->jit) jit_free(vm->jit);
+}
+
+/* vm_step and the loops built from vm_loop.h share their handler
+ * bodies through vm_handlers.h. All keep the machine registers in
+ * locals while executing and write them back to the VM when they
+ * stop.
+ */
+
+#define VM_LOAD_STATE()                   \
+	Inst * insts      = vm->insts;        \
+	u64    ip         = vm->ip;           \
+	s64 *  op_stack   = vm->op_stack;     \
+	u64    op_sp      = vm->op_sp;        \
+	s64 *  call_stack = vm->call_stack;   \
+	u64    call_sp    = vm->call_sp;      \
+	u64    fp         = vm->fp;           \
+	Inst * inst;
+
+#define VM_SAVE_STATE()          \
+	(vm->ip      = ip,           \
+	 vm->op_sp   = op_sp,        \
+	 vm->call_sp = call_sp,      \
+	 vm->fp      = fp)
+
+#define VM_RELOAD_STATE()        \
+	(ip      = vm->ip,           \
+	 op_sp   = vm->op_sp,        \
+	 call_sp = vm->call_sp,      \
+	 fp      = vm->fp)
+
+// Calls and returns are where execution can move into native code
+#define VM_ENTER_NATIVE()        \
+	if (vm->jit) {               \
+		VM_SAVE_STATE();         \
+		jit_enter(vm);           \
+		VM_RELOAD_STATE();       \
+	}
+
 bool vm_step(VM * vm)
 {
-	Inst inst = vm->insts[vm->ip++];
-	switch (inst.type) {
-	case INST_HALT:
-		return false;
-	case INST_NOP:
-	case INST_SYMBOL:
-		break;
-	case INST_OP:
-		operators[inst.arg0.op_type](vm);
-		break;
-	case INST_PUSHC:
-		vm->call_stack[vm->call_sp++] = (s64) inst.arg0.literal;
-		break;
-	case INST_POPC:
-		if (vm->call_sp == 0)
-			internal_error("POPC executed with an empty call stack");
-		vm->call_sp--;
-		break;
-	case INST_PUSHO:
-		vm->op_stack[vm->op_sp++] = (s64) inst.arg0.literal;
-		break;
-	case INST_POPO:
-		if (vm->op_sp == 0)
-			internal_error("PUSHO executed with an empty op stack");
-		vm->op_sp--;
-		break;
-	case INST_LOAD:
-		if (inst.arg0.offset < 1)
-			internal_error("Tried to load from past call stack");
-		if (inst.arg0.offset > vm->call_sp)
-			internal_error("Tried to load from before call stack");
-		vm->op_stack[vm->op_sp++] =
-			vm->call_stack[vm->call_sp - inst.arg0.offset];
-		break;
-	case INST_SAVE:
-		if (vm->op_sp == 0)
-			internal_error("SAVE executed with an empty op stack");
-		if (inst.arg0.offset < 1)
-			internal_error("Tried to save past call stack");
-		if (inst.arg0.offset > vm->call_sp)
-			internal_error("Tried to save before call stack");
-		vm->call_stack[vm->call_sp - inst.arg0.offset] =
-			vm->op_stack[--vm->op_sp];
-		break;
-	case INST_JMP:
-	jump:
-		vm->ip = inst.arg0.jmp_ip;
-		break;
-	case INST_JZ: {
-		s64 pop = vm->op_stack[--vm->op_sp];
-		if (pop == 0) goto jump;
-	} break;
-	case INST_JNZ: {
-		s64 pop = vm->op_stack[--vm->op_sp];
-		if (pop != 0) goto jump;
-	} break;
-	case INST_PRINT: {
-		s64 pop = vm->op_stack[vm->op_sp];
-		printf("%ld\n", pop);
-	} break;
-	case INST_JIP: {
-		u64 pop = (u64) vm->op_stack[--vm->op_sp];
-		vm->ip = pop;
-	} break;
-	case INST_JSIP: {
-		vm->call_stack[vm->call_sp++] = vm->ip;
-		goto jump;
-	} break;
+	VM_LOAD_STATE();
+	inst = &insts[ip++];
+	switch (inst->type) {
+	#define HANDLER(type) case type:
+	#define NEXT() break
+	#define HALT() VM_SAVE_STATE(); return false
+	#define ON_CALL()
+	#define ON_RETURN()
+	#include "vm_handlers.h"
+	#undef HANDLER
+	#undef NEXT
+	#undef HALT
+	#undef ON_CALL
+	#undef ON_RETURN
 	default:
 		internal_error("VM read invalid instruction");
 		break;
 	}
+	VM_SAVE_STATE();
 	return true;
 }
 
+void vm_run(VM * vm)
+{
+	#define BEFORE_INST()
+	#define ON_CALL() VM_ENTER_NATIVE()
+	#define ON_RETURN() VM_ENTER_NATIVE()
+	#define ON_HALT()
+	#include "vm_loop.h"
+}
+
+void vm_run_profiled(VM * vm, Profile * profile)
+{
+	profile_start(profile);
+	#define BEFORE_INST() profile->counts[ip]++
+	#define ON_CALL() profile_call(profile, ip)
+	#define ON_RETURN() profile_return(profile)
+	#define ON_HALT() profile_stop(profile)
+	#include "vm_loop.h"
+}
+
+// A call or return updates the ip and the frames one after the
+// other, so a sample landing in between is a frame off. That window
+// is a couple of stores per call.
+void vm_run_sampled(VM * vm, Sampler * sampler)
+{
+	sampler_start(sampler);
+	#define BEFORE_INST() sampler->ip = ip
+	#define ON_CALL() \
+		(sampler->frames[sampler->depth] = call_sp - 1, sampler->depth++, sampler->ip = ip)
+	#define ON_RETURN() (sampler->depth--, sampler->ip = ip)
+	#define ON_HALT() sampler_stop(sampler)
+	#include "vm_loop.h"
+}
+
 void vm_test()
 {
 	VM _vm;
@@ -179,7 +341,7 @@ void vm_test()
 	EMIT_ARG(INST_PUSHC, literal, 0);   // 0
 	EMIT_ARG(INST_LOAD, offset, 4);
 	EMIT_ARG(INST_LOAD, offset, 3);
-	EMIT_ARG(INST_OP, op_type, OP_ADD);
+	EMIT(INST_ADD);
 	EMIT_ARG(INST_SAVE, offset, 1);     // 4
 	EMIT_ARG(INST_LOAD, offset, 1);
 	EMIT_ARG(INST_LOAD, offset, 2);
@@ -200,7 +362,7 @@ void vm_test()
 	EMIT_ARG(INST_PUSHC, literal, 12);
 	EMIT_ARG(INST_LOAD, offset, 1);
 	EMIT_ARG(INST_PUSHO, literal, 3);
-	EMIT_ARG(INST_OP, op_type, OP_ADD);
+	EMIT(INST_ADD);
 	EMIT_ARG(INST_SAVE, offset, 1);
 	EMIT(INST_POPC);
 	EMIT(INST_HALT);*/
@@ -228,5 +390,82 @@ void vm_test()
 	#if VM_TEST_DEBUG
 	printf("--------\n");
 	#endif
+	vm_free(vm);
 }
 
+
+static void vm_bench_program(const char * name, const char * source)
+{
+	Compiler compiler;
+	compiler_init(&compiler, source);
+	prepare(&compiler);
+	fold(&compiler);
+	VM _vm;
+	VM * vm = &_vm;
+	vm_init(vm);
+	compile(&compiler, vm);
+	peephole(vm);
+	compiler_free(&compiler);
+	u64 entry = vm->ip;
+
+	u64 steps = 1; // The final HALT
+	u64 start = time_ns();
+	while (vm_step(vm)) steps++;
+	u64 step_ns = time_ns() - start;
+
+	vm->ip      = entry;
+	vm->op_sp   = 0;
+	vm->call_sp = 0;
+	start = time_ns();
+	vm_run(vm);
+	u64 run_ns = time_ns() - start;
+
+	printf("vm %s: %lu insts, vm_step %.1f M inst/s, vm_run %.1f M inst/s\n",
+		name, steps, steps / (step_ns / 1e3), steps / (run_ns / 1e3));
+	vm_free(vm);
+}
+
+void vm_bench()
+{
+	vm_bench_program("loop",
+		"func main() {\n"
+		"    let i;\n"
+		"    let sum;\n"
+		"    while i < 5000000 {\n"
+		"        set sum = sum + i;\n"
+		"        set i = i + 1;\n"
+		"    }\n"
+		"}\n");
+	vm_bench_program("fib",
+		"func fib(n) {\n"
+		"    let a;\n"
+		"    let b;\n"
+		"    let i;\n"
+		"    let t;\n"
+		"    set b = 1;\n"
+		"    while i < n {\n"
+		"        set t = b;\n"
+		"        set b = a + b;\n"
+		"        set a = t;\n"
+		"        set i = i + 1;\n"
+		"    }\n"
+		"    return a;\n"
+		"}\n"
+		"func main() {\n"
+		"    let k;\n"
+		"    while k < 50000 {\n"
+		"        fib(90);\n"
+		"        set k = k + 1;\n"
+		"    }\n"
+		"}\n");
+	vm_bench_program("fib_recursive",
+		"func fib(n) {\n"
+		"    if n < 2 {\n"
+		"        return n;\n"
+		"    }\n"
+		"    return fib(n - 1) + fib(n - 2);\n"
+		"}\n"
+		"func main() {\n"
+		"    return fib(27);\n"
+		"}\n");
+}
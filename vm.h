@@ -3,14 +3,118 @@
 #include "common.h"
 #include "error.h"
 #include "parser.h"
+#include "vm_stack.h"
 
-#define STACK_SIZE 1024
+// Stack sizes in slots. Stacks start at the initial size and grow on
+// demand up to the limit.
+#define VM_STACK_INITIAL 1024
+#define VM_STACK_LIMIT   (1024 * 1024)
+
+// Computed-goto dispatch in vm_run, where the compiler supports it
+#if defined(__GNUC__)
+#define VM_THREADED_DISPATCH true
+#else
+#define VM_THREADED_DISPATCH false
+#endif
+
+/* Operator semantics, shared by the VM and the constant folder so
+ * the two can never disagree. Arithmetic wraps on overflow, and
+ * division or modulo by zero is a runtime error.
+ */
+static inline s64 eval_div(s64 x, s64 y)
+{
+	if (y == 0) runtime("Division by zero");
+	if (y == -1) return (s64) -(u64) x; // INT64_MIN / -1 traps
+	return x / y;
+}
+
+static inline s64 eval_mod(s64 x, s64 y)
+{
+	if (y == 0) runtime("Division by zero");
+	if (y == -1) return 0;
+	return x % y;
+}
+
+#define EVAL_NEG(x)    ((s64) -(u64) (x))
+#define EVAL_LNEG(x)   ((s64) !(x))
+#define EVAL_ADD(x, y) ((s64) ((u64) (x) + (u64) (y)))
+#define EVAL_SUB(x, y) ((s64) ((u64) (x) - (u64) (y)))
+#define EVAL_MUL(x, y) ((s64) ((u64) (x) * (u64) (y)))
+#define EVAL_DIV(x, y) eval_div((x), (y))
+#define EVAL_MOD(x, y) eval_mod((x), (y))
+#define EVAL_EQ(x, y)  ((s64) ((x) == (y)))
+#define EVAL_GT(x, y)  ((s64) ((x) >  (y)))
+#define EVAL_LT(x, y)  ((s64) ((x) <  (y)))
+#define EVAL_GTE(x, y) ((s64) ((x) >= (y)))
+#define EVAL_LTE(x, y) ((s64) ((x) <= (y)))
+
+/* Every binary operator gets four instructions:
+ *   INST_ADD     Pop y, pop x, push x + y
+ *   INST_ADD_I   Pop x, push x + arg1
+ *   INST_ADD_LI  Push local arg0 + arg1
+ *   INST_ADD_LL  Push local arg0 + local arg1
+ * The _LI and _LL forms let the compiler skip the LOADL/PUSHO
+ * shuffle when an operand is a local or a literal.
+ */
+#define BINARY_INSTS(X) \
+	X(ADD, +)           \
+	X(SUB, -)           \
+	X(MUL, *)           \
+	X(DIV, /)           \
+	X(MOD, %)           \
+	X(EQ,  ==)          \
+	X(GT,  >)           \
+	X(LT,  <)           \
+	X(GTE, >=)          \
+	X(LTE, <=)
+
+/* Comparisons followed by a JZ get fused into a single
+ * compare-and-branch by the peephole pass. INST_JZ_LT and friends
+ * jump to arg2 if the comparison is false, and take their operands
+ * the same way as the matching binary instruction.
+ */
+#define COMPARE_INSTS(X) \
+	X(EQ,  ==)           \
+	X(GT,  >)            \
+	X(LT,  <)            \
+	X(GTE, >=)           \
+	X(LTE, <=)
+
+/* Frames
+ *
+ * INST_CALL moves the arguments from the op stack onto the call stack,
+ * first to last, and pushes the return ip. The callee's INST_ENTER
+ * pushes the caller's frame pointer and points fp at the slot above
+ * it, where its locals start:
+ *
+ *   arg 0 ... arg n-1 | return ip | saved fp | local 0 ... local m-1
+ *                                              ^ fp
+ *
+ * Locals and arguments are addressed relative to fp, local i at i and
+ * argument i at i - n - 2, so pushing onto the call stack doesn't move
+ * them. INST_RET drops the locals, restores the saved fp, pops the
+ * return ip and arguments and jumps back to the caller.
+ */
+
+// Offsets from a binary instruction to its operand-form variants
+typedef enum Binary_Form {
+	BINARY_FORM_STACK = 0,
+	BINARY_FORM_I,
+	BINARY_FORM_LI,
+	BINARY_FORM_LL,
+} Binary_Form;
 
 typedef enum Inst_Type {
 	INST_HALT,
 	INST_NOP,
 	INST_SYMBOL,
-	INST_OP,
+	// Operators
+	INST_NEG,   // Negate top of op stack
+	INST_LNEG,  // Logically negate top of op stack
+	#define BINARY_INST_ENUM(name, op) \
+		INST_##name, INST_##name##_I, INST_##name##_LI, INST_##name##_LL,
+	BINARY_INSTS(BINARY_INST_ENUM)
+	#undef BINARY_INST_ENUM
 	// Call stack
 	INST_PUSHC, // Push literal onto call stack
 	INST_POPC,  // Pop the top of call stack
@@ -20,49 +124,122 @@ typedef enum Inst_Type {
 	// Inter-stack movement
 	INST_LOAD,  // Load from offset into call stack onto op stack
 	INST_SAVE,  // Pop top of op stack and save into offset into call stack
+	INST_LOADL, // Load a local onto op stack
+	INST_STOREL, // Pop top of op stack and save into a local
+	// Frames
+	INST_ENTER, // Save fp and push a frame of zeroed locals
+	INST_CALL,  // Move arg1 arguments off op stack into a frame and jump to arg0
+	INST_RET,   // Pop the frame and arg0 arguments, restore fp and return
 	// Jumps
 	INST_JMP,   // Jump unconditionally
 	INST_JZ,    // Jump if popped top of op stack is zero
 	INST_JNZ,   // Jump if popped top of op stack is not zero
 	INST_JIP,   // Jump to location popped off op stack
 	INST_JSIP,  // Push instruction pointer to call stack and jump to arg
+	#define COMPARE_JUMP_ENUM(name, op) \
+		INST_JZ_##name, INST_JZ_##name##_I, INST_JZ_##name##_LI, INST_JZ_##name##_LL,
+	COMPARE_INSTS(COMPARE_JUMP_ENUM)
+	#undef COMPARE_JUMP_ENUM
 	// Debug
 	INST_PRINT,
+	INST_COUNT,
 } Inst_Type;
 
 extern char * inst_type_to_str[];
+extern Inst_Type op_to_inst[];
 
 typedef union Inst_Arg {
 	s64 literal;
 	u64 offset;
+	s64 local; // Relative to fp
 	u64 jmp_ip;
 	const char * symbol;
-	Operator_Type op_type;
 } Inst_Arg;
 
 typedef struct Inst {
 	Inst_Type type;
 	Inst_Arg  arg0;
+	Inst_Arg  arg1;
+	Inst_Arg  arg2;
 } Inst;
 
+// From jit.h
+typedef struct Jit Jit;
+typedef struct Profile Profile;
+typedef struct Sampler Sampler;
+//
+
+// Function entry points, kept on the side once the peephole pass
+// strips INST_SYMBOL out of the instruction stream
+typedef struct Symbol {
+	u64 ip;
+	const char * name;
+} Symbol;
+
+// Source line of the instructions from ip up to the next entry
+typedef struct Line_Entry {
+	u64 ip;
+	u32 line; // From 1, 0 for instructions with no line
+} Line_Entry;
+
 typedef struct VM {
-	s64 op_stack[STACK_SIZE];
+	s64 * op_stack;
 	u64 op_sp;
+	VM_Stack op_region;
 	
-	s64 call_stack[STACK_SIZE];
+	s64 * call_stack;
 	u64 call_sp;
+	u64 fp; // Call stack index of the running function's first local
+	VM_Stack call_region;
 	
 	Inst * insts;
 	u64 ip;
+
+	Symbol * symbols;
+	// In ip order. Bytecode files don't keep lines, so programs
+	// loaded from them have none.
+	Line_Entry * lines;
+
+	// Mapped bytecode file that insts points into, if the program
+	// was loaded from one
+	void * image;
+	size_t image_size;
+
+	// Native code for hot functions, if jit_attach was called
+	Jit * jit;
 } VM;
 
 void print_instruction(Inst inst);
+void fprint_instruction(FILE * file, Inst inst);
+// Returns the jump target field of a control flow instruction, or
+// NULL if the instruction doesn't jump
+u64 * inst_jump_target(Inst * inst);
+// Where each function ends, indexed by the ip of its first
+// instruction and 0 elsewhere. vm->ip must be the entry stub. Free
+// the result.
+u64 * vm_function_ends(VM * vm);
+// Source line of the instruction at ip, or 0 if it isn't known
+u32 vm_line(VM * vm, u64 ip);
 
-int vm_init(VM * vm);
+void vm_init(VM * vm);
+void vm_init_stacks(VM * vm, size_t initial, size_t limit);
+void vm_free(VM * vm);
+// Execute a single instruction. Returns false on HALT.
 bool vm_step(VM * vm);
+// Execute until HALT
+void vm_run(VM * vm);
+// vm_run, recording every instruction, call and return in profile
+void vm_run_profiled(VM * vm, Profile * profile);
+// vm_run, keeping sampler up to date on where execution is
+void vm_run_sampled(VM * vm, Sampler * sampler);
 void vm_test();
+void vm_bench();
 
 #define EMIT(type) \
 	(sb_push(vm->insts, ((Inst){(type), (Inst_Arg){ .literal = 0 }})))
 #define EMIT_ARG(type, argname, arg) \
 	(sb_push(vm->insts, ((Inst){(type), (Inst_Arg){ .argname = arg }})))
+#define EMIT_ARGS(type, argname0, arg0, argname1, arg1)      \
+	(sb_push(vm->insts, ((Inst){(type),                      \
+		(Inst_Arg){ .argname0 = arg0 },                      \
+		(Inst_Arg){ .argname1 = arg1 }})))
@@ -0,0 +1,171 @@
+/* Instruction handler bodies, shared by vm_step and the loops in
+ * vm_loop.h.
+ *
+ * This file is included inside the body of a dispatch loop, which
+ * must provide the locals ip, inst, op_stack, op_sp, call_stack,
+ * call_sp and fp, and define:
+ *   HANDLER(type)  Start the handler for an instruction type
+ *   NEXT()         Finish the handler and dispatch the next instruction
+ *   HALT()         Stop execution
+ *   ON_CALL()      Run after a call has set ip to the callee
+ *   ON_RETURN()    Run after a return has set ip back in the caller,
+ *                  from INST_JIP or INST_RET
+ */
+
+HANDLER(INST_HALT) {
+	HALT();
+}
+
+HANDLER(INST_NOP)
+HANDLER(INST_SYMBOL) {
+} NEXT();
+
+HANDLER(INST_NEG) {
+	op_stack[op_sp - 1] = EVAL_NEG(op_stack[op_sp - 1]);
+} NEXT();
+
+HANDLER(INST_LNEG) {
+	op_stack[op_sp - 1] = EVAL_LNEG(op_stack[op_sp - 1]);
+} NEXT();
+
+#define BINARY_HANDLERS(name, op)                                        \
+HANDLER(INST_##name) {                                                   \
+	s64 y = op_stack[--op_sp];                                           \
+	op_stack[op_sp - 1] = EVAL_##name(op_stack[op_sp - 1], y);           \
+} NEXT();                                                                \
+HANDLER(INST_##name##_I) {                                               \
+	op_stack[op_sp - 1] =                                                \
+		EVAL_##name(op_stack[op_sp - 1], inst->arg1.literal);            \
+} NEXT();                                                                \
+HANDLER(INST_##name##_LI) {                                              \
+	op_stack[op_sp++] = EVAL_##name(                                     \
+		call_stack[fp + inst->arg0.local], inst->arg1.literal);          \
+} NEXT();                                                                \
+HANDLER(INST_##name##_LL) {                                              \
+	op_stack[op_sp++] = EVAL_##name(                                     \
+		call_stack[fp + inst->arg0.local],                               \
+		call_stack[fp + inst->arg1.local]);                              \
+} NEXT();
+BINARY_INSTS(BINARY_HANDLERS)
+#undef BINARY_HANDLERS
+
+HANDLER(INST_PUSHC) {
+	call_stack[call_sp++] = inst->arg0.literal;
+} NEXT();
+
+HANDLER(INST_POPC) {
+	if (call_sp == 0)
+		internal_error("POPC executed with an empty call stack");
+	call_sp--;
+} NEXT();
+
+HANDLER(INST_PUSHO) {
+	op_stack[op_sp++] = inst->arg0.literal;
+} NEXT();
+
+HANDLER(INST_POPO) {
+	if (op_sp == 0)
+		internal_error("POPO executed with an empty op stack");
+	op_sp--;
+} NEXT();
+
+HANDLER(INST_LOAD) {
+	if (inst->arg0.offset < 1)
+		internal_error("Tried to load from past call stack");
+	if (inst->arg0.offset > call_sp)
+		internal_error("Tried to load from before call stack");
+	op_stack[op_sp++] = call_stack[call_sp - inst->arg0.offset];
+} NEXT();
+
+HANDLER(INST_SAVE) {
+	if (op_sp == 0)
+		internal_error("SAVE executed with an empty op stack");
+	if (inst->arg0.offset < 1)
+		internal_error("Tried to save past call stack");
+	if (inst->arg0.offset > call_sp)
+		internal_error("Tried to save before call stack");
+	call_stack[call_sp - inst->arg0.offset] = op_stack[--op_sp];
+} NEXT();
+
+HANDLER(INST_LOADL) {
+	op_stack[op_sp++] = call_stack[fp + inst->arg0.local];
+} NEXT();
+
+HANDLER(INST_STOREL) {
+	call_stack[fp + inst->arg0.local] = op_stack[--op_sp];
+} NEXT();
+
+HANDLER(INST_ENTER) {
+	call_stack[call_sp++] = fp;
+	fp = call_sp;
+	for (s64 i = 0; i < inst->arg0.literal; i++) {
+		call_stack[call_sp++] = 0;
+	}
+} NEXT();
+
+HANDLER(INST_CALL) {
+	u64 argc = inst->arg1.literal;
+	op_sp -= argc;
+	memcpy(&call_stack[call_sp], &op_stack[op_sp], argc * sizeof(s64));
+	call_sp += argc;
+	call_stack[call_sp++] = ip;
+	ip = inst->arg0.jmp_ip;
+	ON_CALL();
+} NEXT();
+
+HANDLER(INST_RET) {
+	call_sp = fp - 1;
+	fp = call_stack[call_sp];
+	ip = call_stack[call_sp - 1];
+	call_sp -= 1 + inst->arg0.literal;
+	ON_RETURN();
+} NEXT();
+
+HANDLER(INST_JMP) {
+	ip = inst->arg0.jmp_ip;
+} NEXT();
+
+HANDLER(INST_JZ) {
+	if (op_stack[--op_sp] == 0) ip = inst->arg0.jmp_ip;
+} NEXT();
+
+HANDLER(INST_JNZ) {
+	if (op_stack[--op_sp] != 0) ip = inst->arg0.jmp_ip;
+} NEXT();
+
+HANDLER(INST_JIP) {
+	ip = (u64) op_stack[--op_sp];
+	ON_RETURN();
+} NEXT();
+
+HANDLER(INST_JSIP) {
+	call_stack[call_sp++] = ip;
+	ip = inst->arg0.jmp_ip;
+	ON_CALL();
+} NEXT();
+
+#define COMPARE_JUMP_HANDLERS(name, op)                                   \
+HANDLER(INST_JZ_##name) {                                                \
+	s64 y = op_stack[--op_sp];                                           \
+	s64 x = op_stack[--op_sp];                                           \
+	if (!EVAL_##name(x, y)) ip = inst->arg2.jmp_ip;                      \
+} NEXT();                                                                \
+HANDLER(INST_JZ_##name##_I) {                                            \
+	s64 x = op_stack[--op_sp];                                           \
+	if (!EVAL_##name(x, inst->arg1.literal)) ip = inst->arg2.jmp_ip;     \
+} NEXT();                                                                \
+HANDLER(INST_JZ_##name##_LI) {                                           \
+	s64 x = call_stack[fp + inst->arg0.local];                           \
+	if (!EVAL_##name(x, inst->arg1.literal)) ip = inst->arg2.jmp_ip;     \
+} NEXT();                                                                \
+HANDLER(INST_JZ_##name##_LL) {                                           \
+	s64 x = call_stack[fp + inst->arg0.local];                           \
+	s64 y = call_stack[fp + inst->arg1.local];                           \
+	if (!EVAL_##name(x, y)) ip = inst->arg2.jmp_ip;                      \
+} NEXT();
+COMPARE_INSTS(COMPARE_JUMP_HANDLERS)
+#undef COMPARE_JUMP_HANDLERS
+
+HANDLER(INST_PRINT) {
+	printf("%ld\n", op_stack[op_sp - 1]);
+} NEXT();
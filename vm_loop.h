@@ -0,0 +1,98 @@
+/* Dispatch loop that runs until HALT, shared by vm_run,
+ * vm_run_profiled and vm_run_sampled.
+ *
+ * This file is included as the whole body of a function with a VM *
+ * vm parameter, which must first define:
+ *   BEFORE_INST()  Run before each instruction, with ip pointing at it
+ *   ON_CALL()      As for vm_handlers.h
+ *   ON_RETURN()    As for vm_handlers.h
+ *   ON_HALT()      Run on HALT, once the state is saved
+ * It undefines them again at the end.
+ */
+
+VM_LOAD_STATE();
+#if VM_THREADED_DISPATCH
+// Every instruction, once each. Expanded into the table, and into a
+// count that has to come to INST_COUNT, so the table has no holes.
+// Instructions come from the compiler or from bytecode_load, which
+// refuses unknown types, so there's nothing past the end to catch.
+#define BINARY_INST_LABELS(name, op) \
+	LABEL(INST_##name),              \
+	LABEL(INST_##name##_I),          \
+	LABEL(INST_##name##_LI),         \
+	LABEL(INST_##name##_LL),
+#define COMPARE_JUMP_LABELS(name, op) \
+	LABEL(INST_JZ_##name),            \
+	LABEL(INST_JZ_##name##_I),        \
+	LABEL(INST_JZ_##name##_LI),       \
+	LABEL(INST_JZ_##name##_LL),
+#define DISPATCH_LABELS                  \
+	LABEL(INST_HALT),                    \
+	LABEL(INST_NOP),                     \
+	LABEL(INST_SYMBOL),                  \
+	LABEL(INST_NEG),                     \
+	LABEL(INST_LNEG),                    \
+	BINARY_INSTS(BINARY_INST_LABELS)     \
+	LABEL(INST_PUSHC),                   \
+	LABEL(INST_POPC),                    \
+	LABEL(INST_PUSHO),                   \
+	LABEL(INST_POPO),                    \
+	LABEL(INST_LOAD),                    \
+	LABEL(INST_SAVE),                    \
+	LABEL(INST_LOADL),                   \
+	LABEL(INST_STOREL),                  \
+	LABEL(INST_ENTER),                   \
+	LABEL(INST_CALL),                    \
+	LABEL(INST_RET),                     \
+	LABEL(INST_JMP),                     \
+	LABEL(INST_JZ),                      \
+	LABEL(INST_JNZ),                     \
+	LABEL(INST_JIP),                     \
+	LABEL(INST_JSIP),                    \
+	COMPARE_INSTS(COMPARE_JUMP_LABELS)   \
+	LABEL(INST_PRINT),
+#define LABEL(type) [type] = &&do_##type
+static void * dispatch_table[INST_COUNT] = { DISPATCH_LABELS };
+#undef LABEL
+#define LABEL(type) 0
+enum { DISPATCH_TABLE_COMPLETE = 1 / (sizeof((char[]) { DISPATCH_LABELS }) == INST_COUNT) };
+#undef LABEL
+#undef DISPATCH_LABELS
+#undef BINARY_INST_LABELS
+#undef COMPARE_JUMP_LABELS
+#define DISPATCH() \
+	BEFORE_INST(); inst = &insts[ip++]; goto *dispatch_table[inst->type]
+#define HANDLER(type) do_##type:
+#define NEXT() DISPATCH()
+#define HALT() VM_SAVE_STATE(); ON_HALT(); return
+
+DISPATCH();
+#include "vm_handlers.h"
+
+#undef DISPATCH
+#undef HANDLER
+#undef NEXT
+#undef HALT
+#else
+while (1) {
+	BEFORE_INST();
+	inst = &insts[ip++];
+	switch (inst->type) {
+	#define HANDLER(type) case type:
+	#define NEXT() continue
+	#define HALT() VM_SAVE_STATE(); ON_HALT(); return
+	#include "vm_handlers.h"
+	#undef HANDLER
+	#undef NEXT
+	#undef HALT
+	default:
+		internal_error("VM read invalid instruction");
+		break;
+	}
+}
+#endif
+
+#undef BEFORE_INST
+#undef ON_CALL
+#undef ON_RETURN
+#undef ON_HALT
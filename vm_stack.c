@@ -0,0 +1,337 @@
+// MAP_ANONYMOUS isn't part of POSIX
+#define _DEFAULT_SOURCE
+#include "vm_stack.h"
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "error.h"
+
+/* Every live stack in the process, ordered by address, so a VM can
+ * be made on one thread and run or freed on another.
+ *
+ * The fault handler reads it without taking any lock. Writers, one
+ * at a time under registry_lock, build a new copy, publish it, and
+ * free the old one once registry_readers shows no handler can still
+ * be looking at it. A handler never waits for anything, so a fault
+ * on a thread in the middle of registering a stack can't deadlock.
+ */
+typedef struct Registry_Entry {
+	char * start;
+	size_t limit;
+	VM_Stack * stack;
+} Registry_Entry;
+
+typedef struct Registry {
+	size_t count;
+	Registry_Entry entries[];
+} Registry;
+
+static Registry * registry = NULL;
+static int registry_readers = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t page_size = 0;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+// Whatever handled SIGSEGV before us, for faults that aren't ours
+static struct sigaction previous_action;
+// Each thread's alternate signal stack, if we made it one
+static pthread_key_t alt_stack_key;
+
+// Runs when a thread that was given an alternate stack exits
+static void free_alt_stack(void * sp)
+{
+	stack_t disable;
+	memset(&disable, 0, sizeof(disable));
+	disable.ss_flags = SS_DISABLE;
+	sigaltstack(&disable, NULL);
+	free(sp);
+}
+
+// Index of the first stack at or above start
+static size_t registry_search(Registry * current, const char * start)
+{
+	size_t lo = 0;
+	size_t hi = current ? current->count : 0;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (current->entries[mid].start < start) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// Replaces the registry with a copy that has stack added, or removed
+static void update_registry(VM_Stack * stack, bool add)
+{
+	pthread_mutex_lock(&registry_lock);
+	Registry * current = registry;
+	size_t count = current ? current->count : 0;
+	size_t at = registry_search(current, (char*) stack->base);
+	bool present = at < count && current->entries[at].stack == stack;
+	if (add == present) {
+		pthread_mutex_unlock(&registry_lock);
+		return;
+	}
+
+	size_t next_count = add ? count + 1 : count - 1;
+	Registry * next = malloc(sizeof(Registry) + next_count * sizeof(Registry_Entry));
+	if (!next) {
+		pthread_mutex_unlock(&registry_lock);
+		fatal("Couldn't register %s", stack->name);
+	}
+	next->count = next_count;
+	if (at > 0) memcpy(next->entries, current->entries, at * sizeof(Registry_Entry));
+	if (add) {
+		next->entries[at] = (Registry_Entry) {(char*) stack->base, stack->limit, stack};
+		memcpy(&next->entries[at + 1], &current->entries[at], (count - at) * sizeof(Registry_Entry));
+	} else {
+		memcpy(&next->entries[at], &current->entries[at + 1], (count - at - 1) * sizeof(Registry_Entry));
+	}
+
+	// A handler that counted itself in before the swap may hold the old
+	// copy, one that counts itself in after sees the new one
+	__atomic_store_n(&registry, next, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&registry_readers, __ATOMIC_SEQ_CST) > 0);
+	free(current);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static size_t round_to_page(size_t bytes)
+{
+	return (bytes + page_size - 1) & ~(page_size - 1);
+}
+
+static bool commit(VM_Stack * stack, size_t bytes)
+{
+	if (mprotect(stack->base, bytes, PROT_READ | PROT_WRITE) != 0) return false;
+	stack->committed = bytes / sizeof(s64);
+	return true;
+}
+
+/* Hands a fault that isn't on a VM stack to the previous handler. If
+ * there was none, or it ignored SIGSEGV, that disposition is put back
+ * and the faulting instruction runs again under it, as though we had
+ * never been installed.
+ */
+static void chain_fault(int sig, siginfo_t * info, void * context)
+{
+	if (previous_action.sa_flags & SA_SIGINFO) {
+		previous_action.sa_sigaction(sig, info, context);
+	} else if (previous_action.sa_handler != SIG_DFL &&
+		previous_action.sa_handler != SIG_IGN) {
+		previous_action.sa_handler(sig);
+	} else {
+		sigaction(SIGSEGV, &previous_action, NULL);
+	}
+}
+
+/* Faults on VM stacks are synchronous. They come from a push or a
+ * frame access in the dispatch loop or in JIT code, never from inside
+ * libc, so the faulting thread holds no stdio or malloc lock, and
+ * the handler itself holds nothing by the time it reports an error.
+ * Reporting goes one of two ways, both safe under those conditions:
+ *
+ * - With an error trap set (see error.h), runtime() and
+ *   internal_error() format into the trap with vsnprintf and longjmp
+ *   to it. SA_NODEFER leaves SIGSEGV unblocked, so there's no signal
+ *   mask to restore, and the kernel notices leaving the alternate
+ *   stack by the stack pointer alone.
+ * - Otherwise they printf and exit(). Any lock those take is held by
+ *   some other thread, which will let it go.
+ */
+static void vm_stack_fault(int sig, siginfo_t * info, void * context)
+{
+	char * addr = (char*) info->si_addr;
+
+	// Only the stack just below addr, or the one above it through its
+	// lower guard page, can own it
+	__atomic_add_fetch(&registry_readers, 1, __ATOMIC_SEQ_CST);
+	Registry * current = __atomic_load_n(&registry, __ATOMIC_SEQ_CST);
+	size_t at = registry_search(current, addr + page_size + 1);
+	Registry_Entry entry = {NULL, 0, NULL};
+	if (at > 0) entry = current->entries[at - 1];
+	__atomic_sub_fetch(&registry_readers, 1, __ATOMIC_SEQ_CST);
+
+	char * start = entry.start;
+	char * end   = entry.start + entry.limit * sizeof(s64);
+	if (!entry.stack || addr < start - page_size || addr >= end + page_size) {
+		chain_fault(sig, info, context);
+		return;
+	}
+	// The stack is in use on this thread, so it can't go away under us
+	VM_Stack * stack = entry.stack;
+	if (addr < start) {
+		internal_error("%s underflow", stack->name);
+	} else if (addr >= end) {
+		runtime("%s overflow (limit is %zu slots)", stack->name, stack->limit);
+	} else {
+		size_t needed = round_to_page(addr - start + 1);
+		size_t bytes  = stack->committed * sizeof(s64) * 2;
+		if (bytes < needed) bytes = needed;
+		if (bytes > (size_t) (end - start)) bytes = end - start;
+		if (!commit(stack, bytes)) fatal("Couldn't commit %zu bytes of %s", bytes, stack->name);
+	}
+}
+
+static void install_fault_handler()
+{
+	page_size = sysconf(_SC_PAGESIZE);
+	pthread_key_create(&alt_stack_key, free_alt_stack);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = vm_stack_fault;
+	// On the alternate stack, so overflowing the native stack is still
+	// reported by whoever handles it
+	action.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &previous_action);
+}
+
+// Gives the calling thread an alternate signal stack unless it
+// already has one
+static void ensure_alt_stack()
+{
+	stack_t current;
+	if (sigaltstack(NULL, &current) != 0 || !(current.ss_flags & SS_DISABLE)) return;
+	stack_t alt;
+	alt.ss_size  = SIGSTKSZ < 64 * 1024 ? 64 * 1024 : SIGSTKSZ;
+	alt.ss_sp    = malloc(alt.ss_size);
+	alt.ss_flags = 0;
+	if (!alt.ss_sp) return;
+	if (sigaltstack(&alt, NULL) != 0) {
+		free(alt.ss_sp);
+		return;
+	}
+	pthread_setspecific(alt_stack_key, alt.ss_sp);
+}
+
+void vm_stack_init(VM_Stack * stack, const char * name, size_t initial, size_t limit)
+{
+	pthread_once(&handler_once, install_fault_handler);
+	ensure_alt_stack();
+	if (initial > limit) initial = limit;
+
+	size_t reserved = round_to_page(limit * sizeof(s64));
+	if (reserved == 0) reserved = page_size;
+	char * region = mmap(NULL, reserved + 2 * page_size, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (region == MAP_FAILED)
+		fatal("Couldn't reserve %zu bytes for %s", reserved, name);
+
+	stack->base  = (s64*) (region + page_size);
+	stack->limit = reserved / sizeof(s64);
+	stack->name  = name;
+	stack->committed = 0;
+	size_t bytes = round_to_page(initial * sizeof(s64));
+	if (initial > 0 && !commit(stack, bytes))
+		fatal("Couldn't commit %zu bytes of %s", bytes, name);
+	update_registry(stack, true);
+}
+
+void vm_stack_free(VM_Stack * stack)
+{
+	update_registry(stack, false);
+
+	munmap((char*) stack->base - page_size,
+		stack->limit * sizeof(s64) + 2 * page_size);
+	stack->base = NULL;
+	stack->committed = stack->limit = 0;
+}
+
+static sigjmp_buf chained_jump;
+
+static void chained_handler(int sig, siginfo_t * info, void * context)
+{
+	siglongjmp(chained_jump, 1);
+}
+
+static void * fill_stack(void * arg)
+{
+	VM_Stack * stack = arg;
+	for (size_t i = 0; i < stack->limit; i++) {
+		stack->base[i] = i;
+	}
+	return NULL;
+}
+
+static void * make_stack(void * arg)
+{
+	vm_stack_init(arg, "Thread stack", 1, 64 * 1024);
+	return NULL;
+}
+
+// Makes, grows and frees stacks while other threads do the same
+static void * churn_stacks(void * arg)
+{
+	for (int i = 0; i < 50; i++) {
+		VM_Stack stack;
+		vm_stack_init(&stack, "Churned stack", 1, 16 * 1024);
+		fill_stack(&stack);
+		assert(stack.committed == stack.limit);
+		vm_stack_free(&stack);
+	}
+	return NULL;
+}
+
+void vm_stack_test()
+{
+	VM_Stack _stack;
+	VM_Stack * stack = &_stack;
+	vm_stack_init(stack, "Test stack", 1, 64 * 1024);
+	assert(stack->committed < stack->limit);
+
+	// Writing every slot commits the whole reservation
+	for (size_t i = 0; i < stack->limit; i++) {
+		stack->base[i] = i;
+	}
+	assert(stack->committed == stack->limit);
+	for (size_t i = 0; i < stack->limit; i++) {
+		assert(stack->base[i] == (s64) i);
+	}
+	vm_stack_free(stack);
+
+	// A stack that isn't allowed to grow starts fully committed
+	vm_stack_init(stack, "Test stack", 100, 100);
+	assert(stack->committed == stack->limit);
+	vm_stack_free(stack);
+
+	// A stack made on one thread grows on another
+	pthread_t thread;
+	vm_stack_init(stack, "Test stack", 1, 64 * 1024);
+	pthread_create(&thread, NULL, fill_stack, stack);
+	pthread_join(thread, NULL);
+	assert(stack->committed == stack->limit);
+	vm_stack_free(stack);
+
+	// And one made on another thread grows and is freed here
+	pthread_create(&thread, NULL, make_stack, stack);
+	pthread_join(thread, NULL);
+	fill_stack(stack);
+	assert(stack->committed == stack->limit);
+	vm_stack_free(stack);
+
+	pthread_t threads[4];
+	for (int i = 0; i < 4; i++) pthread_create(&threads[i], NULL, churn_stacks, NULL);
+	for (int i = 0; i < 4; i++) pthread_join(threads[i], NULL);
+
+	// Faults elsewhere go to the handler that was there before
+	struct sigaction saved = previous_action;
+	memset(&previous_action, 0, sizeof(previous_action));
+	previous_action.sa_sigaction = chained_handler;
+	previous_action.sa_flags = SA_SIGINFO;
+	volatile char * page = mmap(NULL, page_size, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(page != MAP_FAILED);
+	volatile bool chained = false;
+	if (sigsetjmp(chained_jump, 1) == 0) {
+		page[0] = 1;
+	} else {
+		chained = true;
+	}
+	assert(chained);
+	munmap((void*) page, page_size);
+	previous_action = saved;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "common.h"
+
+/*
+ * Guard-paged VM stacks
+ *
+ * Each stack reserves address space for its whole limit up front,
+ * with an inaccessible guard page on either side, but only commits
+ * the first few pages. The VM's push and pop paths do no bounds
+ * checks. Touching an uncommitted page faults, and the SIGSEGV
+ * handler commits more of the reservation and resumes the faulting
+ * instruction. Running into a guard page is reported as a runtime
+ * error instead. Faults anywhere else go on to whatever handled
+ * SIGSEGV before, so a host's own handler keeps working.
+ *
+ * Stacks are known to the handler process-wide, so one may be made,
+ * used and freed on different threads, one thread at a time.
+ */
+
+typedef struct VM_Stack {
+	s64 * base;
+	size_t committed; // Slots currently readable and writable
+	size_t limit;     // Slots the stack may grow to
+	const char * name;
+} VM_Stack;
+
+// initial and limit are in slots. A stack with initial == limit
+// never grows.
+void vm_stack_init(VM_Stack * stack, const char * name, size_t initial, size_t limit);
+void vm_stack_free(VM_Stack * stack);
+void vm_stack_test();